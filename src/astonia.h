@@ -134,6 +134,8 @@ extern char localdata[MAX_PATH];
 #define GO_TINYTOP  (1ull<<16) // Slide out top only when mouse cursor is over window border
 #define GO_LOWLIGHT (1ull<<17) // Simplify Light calculations for slow CPUs
 #define GO_NOMAP    (1ull<<18) // Disable minimap completely
+#define GO_GPULIGHT (1ull<<19) // Apply light on the graphics card, fewer textures
+#define GO_TICKVIEW (1ull<<20) // Draw the game view once per tick and reuse it for the frames in between
 
 #define GO_NOTSET   (1ull<<63) // No -o given on command line
 
@@ -23,11 +23,11 @@
 
 #define DDT             '' // draw text terminator - (zero stays one, too)
 
-#define DL_STEP 128
+#define DL_STEP 1024    // display list entries per arena block
 
 #define DLC_STRIKE      1
 #define DLC_NUMBER	2
-#define DLC_DUMMY	3       // used to get space in the list to reduce compares ;-)
+#define DLC_DUMMY	3       // draws nothing, sorted first
 #define DLC_PIXEL	4
 #define DLC_BLESS	5
 #define DLC_POTION	6
@@ -121,5 +121,13 @@ void dd_set_textfont(int nr);
 void dd_create_font(void);
 void dd_init_text(void);
 void dd_display_strike(int fx,int fy,int tx,int ty);
+int dd_sprite_rect(DDFX *ddfx,int scrx,int scry,int *sx,int *sy,int *ex,int *ey);
+int dd_ground_begin(int w,int h);
+void dd_ground_clear(int sx,int sy,int ex,int ey);
+void dd_ground_end(void);
+void dd_ground_blit(int sx,int sy);
+int dd_view_begin(int w,int h);
+void dd_view_end(void);
+int dd_view_blit(int sx,int sy);
 
 
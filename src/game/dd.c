@@ -99,13 +99,11 @@ int dd_exit(void) {
     return 0;
 }
 
-__declspec(dllexport) int dd_copysprite_fx(DDFX *ddfx,int scrx,int scry) {
+// Loads the texture for ddfx and moves scrx,scry to where it goes. Returns
+// the texture, -1 on failure.
+static int dd_sprite_place(DDFX *ddfx,int *scrx,int *scry) {
     int stx;
 
-    PARANOIA(if (!ddfx) paranoia("dd_copysprite_fx: ddfx=NULL"); )
-    PARANOIA(if (ddfx->light<0 || ddfx->light>16) paranoia("dd_copysprite_fx: ddfx->light=%d",ddfx->light); )
-    PARANOIA(if (ddfx->freeze<0 || ddfx->freeze>=DDFX_MAX_FREEZE) paranoia("dd_copysprite_fx: ddfx->freeze=%d",ddfx->freeze); )
-
     stx=sdl_tx_load(ddfx->sprite,
                  ddfx->sink,
                  ddfx->freeze,
@@ -124,19 +122,44 @@ __declspec(dllexport) int dd_copysprite_fx(DDFX *ddfx,int scrx,int scry) {
                  ddfx->rl,
                  ddfx->ul,
                  ddfx->dl,
-                 NULL,0,0,NULL,0,0,0);
+                 0,0,0);
 
-    if (stx==-1) return 0;
+    if (stx==-1) return -1;
 
     // shift position according to align
     if (ddfx->align==DD_OFFSET) {
-        scrx+=sdlt_xoff(stx);
-        scry+=sdlt_yoff(stx);
+        *scrx+=sdlt_xoff(stx);
+        *scry+=sdlt_yoff(stx);
     } else if (ddfx->align==DD_CENTER) {
-        scrx-=sdlt_xres(stx)/2;
-        scry-=sdlt_yres(stx)/2;
+        *scrx-=sdlt_xres(stx)/2;
+        *scry-=sdlt_yres(stx)/2;
     }
 
+    return stx;
+}
+
+// The area dd_copysprite_fx() would draw to, not counting the clipping.
+// Returns 0 if there's nothing to draw.
+int dd_sprite_rect(DDFX *ddfx,int scrx,int scry,int *sx,int *sy,int *ex,int *ey) {
+    int stx;
+
+    if ((stx=dd_sprite_place(ddfx,&scrx,&scry))==-1) return 0;
+
+    *sx=scrx; *ex=scrx+sdlt_xres(stx);
+    *sy=scry; *ey=scry+sdlt_yres(stx);
+
+    return 1;
+}
+
+__declspec(dllexport) int dd_copysprite_fx(DDFX *ddfx,int scrx,int scry) {
+    int stx;
+
+    PARANOIA(if (!ddfx) paranoia("dd_copysprite_fx: ddfx=NULL"); )
+    PARANOIA(if (ddfx->light<0 || ddfx->light>16) paranoia("dd_copysprite_fx: ddfx->light=%d",ddfx->light); )
+    PARANOIA(if (ddfx->freeze<0 || ddfx->freeze>=DDFX_MAX_FREEZE) paranoia("dd_copysprite_fx: ddfx->freeze=%d",ddfx->freeze); )
+
+    if ((stx=dd_sprite_place(ddfx,&scrx,&scry))==-1) return 0;
+
     // add the additional cliprect
     if (ddfx->clipsx!=ddfx->clipex || ddfx->clipsy!=ddfx->clipey) {
         dd_push_clip();
@@ -146,7 +169,7 @@ __declspec(dllexport) int dd_copysprite_fx(DDFX *ddfx,int scrx,int scry) {
 
     // blit it
     if (ddfx->alpha) sdl_tex_alpha(stx,ddfx->alpha);
-    sdl_blit(stx,scrx,scry,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+    sdl_blit_light(stx,scrx,scry,clipsx,clipsy,clipex,clipey,x_offset,y_offset,ddfx->ml,ddfx->ll,ddfx->rl,ddfx->ul,ddfx->dl);
     if (ddfx->alpha) sdl_tex_alpha(stx,255);
 
     // remove additional cliprect
@@ -155,6 +178,41 @@ __declspec(dllexport) int dd_copysprite_fx(DDFX *ddfx,int scrx,int scry) {
     return 1;
 }
 
+// Ground cache, see dl_ground() in game.c. The target is w by h, positions
+// in it are relative to its top left corner.
+int dd_ground_begin(int w,int h) {
+    return sdl_target_begin(SDL_TARGET_GROUND,w,h);
+}
+
+void dd_ground_clear(int sx,int sy,int ex,int ey) {
+    sdl_target_clear(sx,sy,ex,ey);
+}
+
+void dd_ground_end(void) {
+    sdl_target_end();
+}
+
+void dd_ground_blit(int sx,int sy) {
+    sdl_target_blit(SDL_TARGET_GROUND,sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+}
+
+// View cache, see display_game() in game.c. Starts drawing the view into a
+// cleared target of w by h.
+int dd_view_begin(int w,int h) {
+    if (!sdl_target_begin(SDL_TARGET_VIEW,w,h)) return 0;
+    sdl_target_clear(0,0,w,h);
+
+    return 1;
+}
+
+void dd_view_end(void) {
+    sdl_target_end();
+}
+
+int dd_view_blit(int sx,int sy) {
+    return sdl_target_blit(SDL_TARGET_VIEW,sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+}
+
 void dd_copysprite_callfx(int sprite,int scrx,int scry,int light,int ml,int align) {
     DDFX ddfx;
 
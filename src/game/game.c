@@ -21,45 +21,46 @@ static int fsprite_cnt=0,f2sprite_cnt=0,gsprite_cnt=0,g2sprite_cnt=0,isprite_cnt
 static int qs_time=0,dg_time=0,ds_time=0;
 int stom_off_x=0,stom_off_y=0;
 
-static DL *dllist=NULL;
+// sort key of a display list entry, see dl_sort()
+struct dl_key {
+    uint64_t key;
+    DL *dl;
+};
+
+// The display list lives in an arena of blocks of DL_STEP entries, which are
+// kept from frame to frame and never move. dlsort holds pointers to the
+// entries in use, in the order they were added until dl_play() sorts it.
+static DL **dlblock=NULL;
 static DL **dlsort=NULL;
+static struct dl_key *dlkey=NULL,*dltmp=NULL;
 static int dlused=0,dlmax=0;
 static int stat_dlsortcalls,stat_dlused;
 int namesize=DD_SMALL;
 
+// Returns the next entry. Only the fields every kind of entry uses are
+// cleared, dl_next_set() sets the sprite fields.
 DL* dl_next(void) {
-    int d,diff;
-    DL *rem;
+    DL *dl;
 
     if (dlused==dlmax) {
-        rem=dllist;
-        dllist=xrealloc(dllist,(dlmax+DL_STEP)*sizeof(DL),MEM_DL);
+        dlblock=xrealloc(dlblock,(dlmax/DL_STEP+1)*sizeof(DL *),MEM_DL);
+        dlblock[dlmax/DL_STEP]=xmalloc(DL_STEP*sizeof(DL),MEM_DL);
         dlsort=xrealloc(dlsort,(dlmax+DL_STEP)*sizeof(DL *),MEM_DL);
-        diff=(unsigned char *)dllist-(unsigned char *)rem;
-        for (d=0; d<dlmax; d++) dlsort[d]=(DL *)(((unsigned char *)(dlsort[d]))+diff);
-        for (d=dlmax; d<dlmax+DL_STEP; d++) dlsort[d]=&dllist[d];
+        dlkey=xrealloc(dlkey,(dlmax+DL_STEP)*sizeof(struct dl_key),MEM_DL);
+        dltmp=xrealloc(dltmp,(dlmax+DL_STEP)*sizeof(struct dl_key),MEM_DL);
         dlmax+=DL_STEP;
-    } else if (dlused>dlmax) {
-        fail("dlused normally shouldn't exceed dlmax - the error is somewhere else ;-)");
-        return dlsort[dlused-1];
     }
 
-    dlused++;
-    bzero(dlsort[dlused-1],sizeof(DL));
+    dl=dlblock[dlused/DL_STEP]+dlused%DL_STEP;
+    dlsort[dlused++]=dl;
 
-    if (dlused%16==0) {
-        dlsort[dlused-1]->call=DLC_DUMMY;
-        return dl_next();
-    }
+    dl->layer=0;
+    dl->x=dl->y=dl->h=0;
+    dl->call=0;
+    dl->call_x1=dl->call_y1=dl->call_x2=dl->call_y2=dl->call_x3=0;
+    dl->ddfx.sprite=0;
 
-    dlsort[dlused-1]->ddfx.sink=0;
-    dlsort[dlused-1]->ddfx.scale=100;
-    dlsort[dlused-1]->ddfx.cr=dlsort[dlused-1]->ddfx.cg=dlsort[dlused-1]->ddfx.cb=dlsort[dlused-1]->ddfx.clight=dlsort[dlused-1]->ddfx.sat=0;
-    dlsort[dlused-1]->ddfx.c1=0;
-    dlsort[dlused-1]->ddfx.c2=0;
-    dlsort[dlused-1]->ddfx.c3=0;
-    dlsort[dlused-1]->ddfx.shine=0;
-    return dlsort[dlused-1];
+    return dl;
 }
 
 DL* dl_next_set(int layer,int sprite,int scrx,int scry,int light) {
@@ -77,15 +78,10 @@ DL* dl_next_set(int layer,int sprite,int scrx,int scry,int light) {
     dl->y=scry;
     dl->layer=layer;
 
+    bzero(ddfx,sizeof(DDFX));
     ddfx->sprite=sprite;
     ddfx->ml=ddfx->ll=ddfx->rl=ddfx->ul=ddfx->dl=light;
-    ddfx->sink=0;
     ddfx->scale=100;
-    ddfx->cr=ddfx->cg=ddfx->cb=ddfx->clight=ddfx->sat=0;
-    ddfx->c1=0;
-    ddfx->c2=0;
-    ddfx->c3=0;
-    ddfx->shine=0;
 
     return dl;
 }
@@ -288,10 +284,301 @@ int dl_qcmp(const void *ca,const void *cb) {
     return a->ddfx.sprite-b->ddfx.sprite;
 }
 
+// dl_qcmp() with the position in the list before sorting, in key, as the
+// last criterion
+static int dl_kcmp(const void *ca,const void *cb) {
+    const struct dl_key *a=ca,*b=cb;
+    int diff;
+
+    diff=dl_qcmp(&a->dl,&b->dl);
+    if (diff) return diff;
+
+    return a->key<b->key?-1:1;
+}
+
+// number of bits needed for values 0 to range
+static int dl_bits(unsigned long long range) {
+    int n;
+
+    for (n=0; range; n++) range>>=1;
+
+    return n;
+}
+
+// Sorts the display list in the order of dl_qcmp(), entries which compare
+// equal staying in the order they were added. Layer, y, x and sprite are
+// packed into a 64 bit key, each taking as many bits as its range in this
+// frame needs, and the keys are radix sorted a byte at a time. Dummies get
+// key 0, everything else has the top bit set. Should the fields ever need
+// more than 64 bits, it falls back to qsort().
+static void dl_sort(void) {
+    int d,i,n,pass,minl=0,maxl=0,miny=0,maxy=0,minx=0,maxx=0,mins=0,maxs=0,bl,by,bx,bs,first=1;
+    int count[256];
+    struct dl_key *src,*dst,*tmp;
+    DL *dl;
+
+    for (d=0; d<dlused; d++) {
+        dl=dlsort[d];
+        if (dl->call==DLC_DUMMY) continue;
+
+        if (first) {
+            minl=maxl=dl->layer;
+            miny=maxy=dl->y;
+            minx=maxx=dl->x;
+            mins=maxs=dl->ddfx.sprite;
+            first=0;
+            continue;
+        }
+        minl=min(minl,dl->layer); maxl=max(maxl,dl->layer);
+        miny=min(miny,dl->y); maxy=max(maxy,dl->y);
+        minx=min(minx,dl->x); maxx=max(maxx,dl->x);
+        mins=min(mins,dl->ddfx.sprite); maxs=max(maxs,dl->ddfx.sprite);
+    }
+
+    bl=dl_bits((long long)maxl-minl);
+    by=dl_bits((long long)maxy-miny);
+    bx=dl_bits((long long)maxx-minx);
+    bs=dl_bits((long long)maxs-mins);
+
+    if (1+bl+by+bx+bs>64) {
+        for (d=0; d<dlused; d++) {
+            dlkey[d].key=d;
+            dlkey[d].dl=dlsort[d];
+        }
+        qsort(dlkey,dlused,sizeof(struct dl_key),dl_kcmp);
+        for (d=0; d<dlused; d++) dlsort[d]=dlkey[d].dl;
+        return;
+    }
+
+    for (d=0; d<dlused; d++) {
+        dl=dlsort[d];
+        dlkey[d].dl=dl;
+        if (dl->call==DLC_DUMMY) { dlkey[d].key=0; continue; }
+
+        dlkey[d].key=(1ull<<(bl+by+bx+bs))|
+                     ((uint64_t)((long long)dl->layer-minl)<<(by+bx+bs))|
+                     ((uint64_t)((long long)dl->y-miny)<<(bx+bs))|
+                     ((uint64_t)((long long)dl->x-minx)<<bs)|
+                     (uint64_t)((long long)dl->ddfx.sprite-mins);
+    }
+
+    src=dlkey; dst=dltmp;
+    for (pass=0; pass<(1+bl+by+bx+bs+7)/8; pass++) {
+        bzero(count,sizeof(count));
+        for (d=0; d<dlused; d++) count[(src[d].key>>(pass*8))&255]++;
+
+        // all the same, nothing to do
+        if (count[(src[0].key>>(pass*8))&255]==dlused) continue;
+
+        for (i=n=0; i<256; i++) {
+            d=count[i];
+            count[i]=n;
+            n+=d;
+        }
+        for (d=0; d<dlused; d++) dst[count[(src[d].key>>(pass*8))&255]++]=src[d];
+
+        tmp=src; src=dst; dst=tmp;
+    }
+
+    for (d=0; d<dlused; d++) dlsort[d]=src[d].dl;
+}
+
 void draw_pixel(int x,int y,int color) {
     dd_pixel(x,y,color);
 }
 
+// Ground cache: the ground layers (everything up to GND2_LAY) are drawn into
+// a render target, and the target is drawn in their place for as long as
+// they stay the same. Positions are kept relative to the world, so walking
+// only shifts the target, until it has moved by more than the margin it has
+// around the map view. Entries which changed (new tiles, different sprites
+// or lights) are found by comparing them with the ones the target holds, and
+// only the areas they cover are drawn again.
+#define DLG_MARGIN      (FDX*2)
+#define DLG_DIRTY       16          // areas drawn again, more and it's drawn all over
+
+struct dl_gnd {
+    int layer,x,y,h;                // x,y relative to the world
+    DDFX ddfx;
+    int sx,sy,ex,ey;                // area covered, relative to the world
+};
+
+struct dl_rect {
+    int sx,sy,ex,ey;
+};
+
+static struct dl_gnd *dlgnd=NULL,*dlgnd_new=NULL;
+static int dlgnd_cnt=0,dlgnd_max=0,dlgnd_valid=0;
+static int dlgnd_ox,dlgnd_oy;       // world offset when the target was drawn all over
+static int dlgnd_sx,dlgnd_sy;       // screen position of the target then
+static struct dl_rect dlgnd_dirty[DLG_DIRTY];
+static int dlgnd_ndirty;
+
+// Marks an area as to be drawn again. Returns 0 if there are too many.
+static int dl_ground_dirty(int sx,int sy,int ex,int ey) {
+    struct dl_rect *r;
+    int n;
+
+    if (sx>=ex || sy>=ey) return 1;
+
+    for (n=0; n<dlgnd_ndirty; n++) {
+        r=dlgnd_dirty+n;
+        if (sx<=r->ex && ex>=r->sx && sy<=r->ey && ey>=r->sy) {
+            r->sx=min(r->sx,sx); r->ex=max(r->ex,ex);
+            r->sy=min(r->sy,sy); r->ey=max(r->ey,ey);
+            return 1;
+        }
+    }
+    if (dlgnd_ndirty==DLG_DIRTY) return 0;
+
+    r=dlgnd_dirty+dlgnd_ndirty++;
+    r->sx=sx; r->ex=ex;
+    r->sy=sy; r->ey=ey;
+
+    return 1;
+}
+
+// Orders entries like dl_qcmp() does.
+static int dl_ground_cmp(struct dl_gnd *a,struct dl_gnd *b) {
+    if (a->layer!=b->layer) return a->layer<b->layer?-1:1;
+    if (a->y!=b->y) return a->y<b->y?-1:1;
+    if (a->x!=b->x) return a->x<b->x?-1:1;
+    if (a->ddfx.sprite!=b->ddfx.sprite) return a->ddfx.sprite<b->ddfx.sprite?-1:1;
+    return 0;
+}
+
+// Sets the area entry g covers, ox,oy being the world offset on screen.
+static void dl_ground_rect(struct dl_gnd *g,int ox,int oy) {
+    if (dd_sprite_rect(&g->ddfx,g->x+ox,g->y+oy-g->h,&g->sx,&g->sy,&g->ex,&g->ey)) {
+        g->sx-=ox; g->ex-=ox;
+        g->sy-=oy; g->ey-=oy;
+    } else g->sx=g->sy=g->ex=g->ey=0;
+}
+
+// Draws the ground entries at the start of the sorted display list through
+// the ground cache. Returns how many entries that were, 0 if it couldn't.
+static int dl_ground(void) {
+    int n,i,j,cnt,ox,oy,vsx,vsy,vex,vey,w,h,tx,ty,full,r,xoff,yoff;
+    struct dl_gnd *g,*tmp;
+    struct dl_rect *rc;
+    DL *dl;
+
+    for (cnt=0; cnt<dlused && dlsort[cnt]->layer<=GND2_LAY; cnt++)
+        if (dlsort[cnt]->call) return 0;
+    if (!cnt) return 0;
+
+    // the map view and a margin around it
+    vsx=dotx(DOT_MTL); vex=dotx(DOT_MBR);
+    vsy=doty(DOT_MTL); vey=doty(DOT_MBR);
+    w=vex-vsx+DLG_MARGIN*2;
+    h=vey-vsy+DLG_MARGIN*2;
+
+    // where the world is on the screen
+    ox=mapoffx+mapaddx-(originx-originy)*(FDX/2);
+    oy=mapoffy+mapaddy-(originx+originy)*(FDY/2);
+
+    if (!(r=dd_ground_begin(w,h))) return 0;
+
+    full=(r==2 || !dlgnd_valid || abs(ox-dlgnd_ox)>DLG_MARGIN || abs(oy-dlgnd_oy)>DLG_MARGIN ||
+          dlgnd_sx!=vsx-DLG_MARGIN || dlgnd_sy!=vsy-DLG_MARGIN);
+
+    if (cnt>dlgnd_max) {
+        dlgnd=xrealloc(dlgnd,cnt*sizeof(struct dl_gnd),MEM_DL);
+        dlgnd_new=xrealloc(dlgnd_new,cnt*sizeof(struct dl_gnd),MEM_DL);
+        dlgnd_max=cnt;
+    }
+
+    for (n=0; n<cnt; n++) {
+        dl=dlsort[n];
+        g=dlgnd_new+n;
+        g->layer=dl->layer;
+        g->x=dl->x-ox;
+        g->y=dl->y-oy;
+        g->h=dl->h;
+        memcpy(&g->ddfx,&dl->ddfx,sizeof(DDFX));
+    }
+
+    // find what changed since the target was drawn
+    dlgnd_ndirty=0;
+    if (!full) {
+        for (i=j=0; (i<dlgnd_cnt || j<cnt) && !full; ) {
+            if (j==cnt) r=-1;
+            else if (i==dlgnd_cnt) r=1;
+            else r=dl_ground_cmp(dlgnd+i,dlgnd_new+j);
+
+            if (r<0) {
+                g=dlgnd+i++;
+                full=!dl_ground_dirty(g->sx,g->sy,g->ex,g->ey);
+            } else if (r>0) {
+                g=dlgnd_new+j++;
+                dl_ground_rect(g,ox,oy);
+                full=!dl_ground_dirty(g->sx,g->sy,g->ex,g->ey);
+            } else {
+                g=dlgnd_new+j++;
+                if (dlgnd[i].h==g->h && !memcmp(&dlgnd[i].ddfx,&g->ddfx,sizeof(DDFX))) {
+                    g->sx=dlgnd[i].sx; g->ex=dlgnd[i].ex;
+                    g->sy=dlgnd[i].sy; g->ey=dlgnd[i].ey;
+                    i++;
+                } else {
+                    full=!dl_ground_dirty(dlgnd[i].sx,dlgnd[i].sy,dlgnd[i].ex,dlgnd[i].ey);
+                    i++;
+                    dl_ground_rect(g,ox,oy);
+                    if (!full) full=!dl_ground_dirty(g->sx,g->sy,g->ex,g->ey);
+                }
+            }
+        }
+    }
+
+    if (full) {
+        for (n=0; n<cnt; n++) dl_ground_rect(dlgnd_new+n,ox,oy);
+
+        dlgnd_ox=ox; dlgnd_oy=oy;
+        dlgnd_sx=vsx-DLG_MARGIN; dlgnd_sy=vsy-DLG_MARGIN;
+
+        dlgnd_ndirty=1;
+        rc=dlgnd_dirty;
+        rc->sx=dlgnd_sx-ox; rc->ex=rc->sx+w;
+        rc->sy=dlgnd_sy-oy; rc->ey=rc->sy+h;
+    }
+
+    // world to target
+    tx=dlgnd_ox-dlgnd_sx;
+    ty=dlgnd_oy-dlgnd_sy;
+
+    // draw the areas which changed again, entries at their current screen
+    // position shifted to where the target has them
+    xoff=x_offset; yoff=y_offset;
+    x_offset=tx-ox; y_offset=ty-oy;
+    dd_push_clip();
+    for (n=0; n<dlgnd_ndirty; n++) {
+        rc=dlgnd_dirty+n;
+        rc->sx=max(rc->sx,-tx); rc->ex=min(rc->ex,w-tx);
+        rc->sy=max(rc->sy,-ty); rc->ey=min(rc->ey,h-ty);
+        if (rc->sx>=rc->ex || rc->sy>=rc->ey) continue;
+
+        dd_ground_clear(rc->sx+tx,rc->sy+ty,rc->ex+tx,rc->ey+ty);
+        dd_set_clip(rc->sx+ox,rc->sy+oy,rc->ex+ox,rc->ey+oy);
+
+        for (i=0; i<cnt; i++) {
+            g=dlgnd_new+i;
+            if (g->ex<=rc->sx || g->sx>=rc->ex || g->ey<=rc->sy || g->sy>=rc->ey) continue;
+            dd_copysprite_fx(&dlsort[i]->ddfx,dlsort[i]->x,dlsort[i]->y-dlsort[i]->h);
+        }
+    }
+    dd_pop_clip();
+    x_offset=xoff; y_offset=yoff;
+
+    dd_ground_end();
+
+    tmp=dlgnd; dlgnd=dlgnd_new; dlgnd_new=tmp;
+    dlgnd_cnt=cnt;
+    dlgnd_valid=1;
+
+    dd_ground_blit(dlgnd_sx+ox-dlgnd_ox,dlgnd_sy+oy-dlgnd_oy);
+
+    return cnt;
+}
+
 void dl_play(void) {
     int d,start;
     void helper_cmp_dl(int attick,DL **dl,int dlused);
@@ -301,10 +588,10 @@ void dl_play(void) {
     start=SDL_GetTicks();
     stat_dlsortcalls=0;
     stat_dlused=dlused;
-    qsort(dlsort,dlused,sizeof(DL *),dl_qcmp);
+    if (dlused) dl_sort();
     qs_time+=SDL_GetTicks()-start;
 
-    for (d=0; d<dlused && !quit; d++) {
+    for (d=dl_ground(); d<dlused && !quit; d++) {
         if (dlsort[d]->call==0) {
             dd_copysprite_fx(&dlsort[d]->ddfx,dlsort[d]->x,dlsort[d]->y-dlsort[d]->h);
         } else {
@@ -1514,11 +1801,71 @@ void display_pents(void) {
     }
 }
 
-void display_game(void) {
+// View cache (GO_TICKVIEW): the map, the spell effects and the names only
+// change with the ticks, the selections under the mouse cursor and the
+// action shown. They are drawn into a render target once and the target is
+// drawn for the frames in between, as long as none of that changes.
+struct dl_view {
+    int tick;
+    int originx,originy;
+    int mapoffx,mapoffy,mapaddx,mapaddy;
+    int itmsel,chrsel,mapsel,ctxsel;
+    int act,actx,acty;
+    int namesize;
+    int sx,sy,ex,ey;
+    uint64_t options;
+};
+
+static struct dl_view dlview;
+static int dlview_valid=0;
+
+static void display_game_view(void) {
     display_game_spells();
     display_game_spells2();
     display_game_map(map);
     display_game_names();
+}
+
+// Draws the view through the view cache. Returns 0 if it couldn't.
+static int display_game_cached(void) {
+    struct dl_view v;
+    int xoff,yoff;
+
+    bzero(&v,sizeof(v));
+    v.tick=tick;
+    v.originx=originx; v.originy=originy;
+    v.mapoffx=mapoffx; v.mapoffy=mapoffy;
+    v.mapaddx=mapaddx; v.mapaddy=mapaddy;
+    v.itmsel=itmsel; v.chrsel=chrsel;
+    v.mapsel=mapsel; v.ctxsel=context_getnm();
+    v.act=act; v.actx=actx; v.acty=acty;
+    v.namesize=namesize;
+    v.sx=dotx(DOT_MTL); v.ex=dotx(DOT_MBR);
+    v.sy=doty(DOT_MTL); v.ey=doty(DOT_MBR);
+    v.options=game_options;
+
+    if (dlview_valid && !memcmp(&v,&dlview,sizeof(v)) && dd_view_blit(v.sx,v.sy)) return 1;
+
+    if (!dd_view_begin(v.ex-v.sx,v.ey-v.sy)) return 0;
+
+    // draw at the top left corner of the target
+    xoff=x_offset; yoff=y_offset;
+    x_offset=-v.sx; y_offset=-v.sy;
+    display_game_view();
+    x_offset=xoff; y_offset=yoff;
+
+    dd_view_end();
+
+    memcpy(&dlview,&v,sizeof(v));
+    dlview_valid=1;
+
+    dd_view_blit(v.sx,v.sy);
+
+    return 1;
+}
+
+void display_game(void) {
+    if (!(game_options&GO_TICKVIEW) || !display_game_cached()) display_game_view();
     display_pents();
 }
 
@@ -1617,15 +1964,28 @@ void init_game(int mcx,int mcy) {
 }
 
 void exit_game(void) {
+    int n;
+
     xfree(quick);
     quick=NULL;
     maxquick=0;
-    xfree(dllist);
-    dllist=NULL;
+    for (n=0; n<dlmax/DL_STEP; n++) xfree(dlblock[n]);
+    xfree(dlblock);
+    dlblock=NULL;
     xfree(dlsort);
     dlsort=NULL;
+    xfree(dlkey);
+    dlkey=NULL;
+    xfree(dltmp);
+    dltmp=NULL;
     dlused=0;
     dlmax=0;
+    xfree(dlgnd);
+    dlgnd=NULL;
+    xfree(dlgnd_new);
+    dlgnd_new=NULL;
+    dlgnd_cnt=dlgnd_max=dlgnd_valid=0;
+    dlview_valid=0;
 
 
 }
@@ -275,7 +275,7 @@ void myheapfree(void *ptr) {
 void list_mem(void) {
     int i,flag=0;
     MEMORYSTATUS ms;
-    extern long long mem_tex;
+    extern long long mem_tex,mem_png;
 
     note("--mem----------------------");
     for (i=1; i<MAX_MEM; i++) {
@@ -288,6 +288,7 @@ void list_mem(void) {
     note("%s %.2fMB in %d ptrs","MEM_MAX",maxmemsize/(1024.0*1024.0),maxmemptrs);
     note("---------------------------");
     note("Texture Cache: %.2fMB",mem_tex/(1024.0*1024.0));
+    note("Image Cache: %.2fMB",mem_png/(1024.0*1024.0));
 
     bzero(&ms,sizeof(ms));
     ms.dwLength=sizeof(ms);
@@ -541,7 +542,7 @@ void display_usage(void) {
     txt=buf=malloc(1024*8);
     buf+=sprintf(buf,"The Astonia Client can only be started from the command line or with a specially created shortcut.\n\n");
     buf+=sprintf(buf,"Usage: moac -u playername -p password -d url\n ... [-w width] [-h height]\n");
-    buf+=sprintf(buf," ... [-m threads] [-o options] [-c cachesize]\n ... [-k framespersecond]\n\n");
+    buf+=sprintf(buf," ... [-m threads] [-o options] [-c cachesize] [-b cachemem]\n ... [-i imagemem] [-k framespersecond]\n\n");
     buf+=sprintf(buf,"url being, for example, \"server.astonia.com\" or \"192.168.77.132\" (without the quotes).\n\n");
     buf+=sprintf(buf,"width and height are the desired window size. If this matches the desktop size the client will start in windowed borderless pseudo-fullscreen mode.\n\n");
     buf+=sprintf(buf,"threads is the number of background threads the game should use. Use 0 to disable. Default is 4.\n\n");
@@ -557,8 +558,12 @@ void display_usage(void) {
     buf+=sprintf(buf,"Bit 16 makes the sliding top bar less sensitive.\n");
     buf+=sprintf(buf,"Bit 17 reduces lighting effects (more performance, less pretty).\n");
     buf+=sprintf(buf,"Bit 18 disables the minimap.\n");
+    buf+=sprintf(buf,"Bit 19 applies light on the graphics card (less texture memory, slightly different look).\n");
+    buf+=sprintf(buf,"Bit 20 draws the game view once per tick (less CPU load at more than 24 frames per second, spell effects move at tick rate).\n");
     buf+=sprintf(buf,"Default depends on screen height.\n\n");
-    buf+=sprintf(buf,"cachesize is the size of the texture cache. Default is 8000. Lower numbers might crash!\n\n");
+    buf+=sprintf(buf,"cachesize is the maximum number of entries in the texture cache. Default is 16000. Lower numbers might crash!\n\n");
+    buf+=sprintf(buf,"cachemem is the memory the texture cache may use, in MB. Default is 1/8 of the system memory, but at least 256 and at most 2048.\n\n");
+    buf+=sprintf(buf,"imagemem is the memory the decoded sprite images may use, in MB. Default is 1/16 of the system memory, but at least 128 and at most 1024.\n\n");
     buf+=sprintf(buf,"framespersecond will set the display rate in frames per second.\n\n");
 
     MessageBox(NULL,txt,"Usage",MB_APPLMODAL|MB_OK|MB_ICONEXCLAMATION);
@@ -624,6 +629,16 @@ int parse_cmd(char *s) {
                 while (isspace(*s)) s++;
                 sdl_cache_size=strtol(s,&end,10);
                 s=end;
+            } else if (tolower(*s)=='b') { // -b texture cache memory in MB
+                s++;
+                while (isspace(*s)) s++;
+                sdl_cache_mem=strtol(s,&end,10);
+                s=end;
+            } else if (tolower(*s)=='i') { // -i image cache memory in MB
+                s++;
+                while (isspace(*s)) s++;
+                sdl_image_mem=strtol(s,&end,10);
+                s=end;
             } else if (tolower(*s)=='k') { // -k frames per second
                 s++;
                 while (isspace(*s)) s++;
@@ -641,8 +641,10 @@ display_graphs:
     int duration=SDL_GetTicks64()-start;
 
     if (display_vc) {
-        extern long long texc_miss,texc_pre; //mem_tex,
-        extern uint64_t sdl_backgnd_wait,sdl_backgnd_work,sdl_time_preload,sdl_time_load,gui_time_network;
+        extern long long texc_miss,texc_pre,texc_lookup,texc_probe; //mem_tex,
+        extern int texc_probe_max;
+        extern long long texc_evict_prob,texc_evict_prot,sdli_evict,mem_png;
+        extern uint64_t sdl_time_preload,sdl_time_load,gui_time_network;
         extern uint64_t gui_frametime,gui_ticktime;
         extern uint64_t sdl_time_pre1,sdl_time_pre2,sdl_time_pre3,sdl_time_mutex,sdl_time_alloc,sdl_time_make_main;
         extern int x_offset,y_offset; //pre_2,pre_in,pre_3;
@@ -654,6 +656,7 @@ display_graphs:
         //static int tick_min=99,tick_max=0,tick_step=0;
         int px=800-110,py=35+(!(game_options&GO_SMALLTOP) ? 0 : gui_topoff);
         PROCESS_MEMORY_COUNTERS mi;
+        int n;
 
         GetProcessMemoryInfo(GetCurrentProcess(),&mi,sizeof(mi));
 
@@ -661,6 +664,9 @@ display_graphs:
         //dd_drawtext_fmt(px,py+=10,0xffff,DD_SMALL|DD_LEFT|DD_FRAME|DD_NOCACHE,"idle %3.0f%%",100.0*idle/tota);
         //dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME|DD_NOCACHE,"Tex: %5.2f MB",mem_tex/(1024.0*1024.0));
         dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME|DD_NOCACHE,"Mem: %5.2f MB",mi.WorkingSetSize/(1024.0*1024.0));
+        dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME|DD_NOCACHE,"Probe: %.2f/%d",texc_lookup?(double)texc_probe/texc_lookup:0.0,texc_probe_max);
+        dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME|DD_NOCACHE,"Evict: %lld/%lld",texc_evict_prob,texc_evict_prot);
+        dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME|DD_NOCACHE,"Img: %.0fMB/%lld",mem_png/(1024.0*1024.0),sdli_evict);
 
 #if 0
         if (pre_in>=pre_3) size=pre_in-pre_3;
@@ -703,6 +709,8 @@ display_graphs:
         sdl_bargraph_add(sizeof(pre2_graph),pre2_graph,size<42?size:42);
         sdl_bargraph(px,py+=40,sizeof(pre2_graph),pre2_graph,x_offset,y_offset);
 
+        dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_NOCACHE|DD_LEFT|DD_FRAME,"Draw calls %d",sdl_drawcalls);
+
         size=gui_ticktime/2;
         dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_NOCACHE|DD_LEFT|DD_FRAME,"Ticktime %lld",gui_ticktime);
         sdl_bargraph_add(sizeof(pre3_graph),pre3_graph,size<42?size:42);
@@ -739,8 +747,11 @@ display_graphs:
 
 #endif
         if (sdl_multi) {
-            size=sdl_backgnd_work/sdl_multi;
+            for (size=n=0; n<sdl_multi; n++) size+=sdl_jobstat[n].busy;
+            size/=sdl_multi;
             dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME,"Pre-Back (%d)",sdl_multi);
+            for (n=0; n<sdl_multi; n++)
+                dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME|DD_NOCACHE,"%d: %3d/%3d %d",n,(int)sdl_jobstat[n].busy,(int)sdl_jobstat[n].idle,sdl_jobstat[n].steals);
         } else {
             size=sdl_time_pre2;
             dd_drawtext_fmt(px,py+=10,IRGB(8,31,8),DD_LEFT|DD_FRAME,"Make");
@@ -798,8 +809,12 @@ display_graphs:
         sdl_time_tex=0;
         sdl_time_text=0;
         sdl_time_blit=0;
-        sdl_backgnd_work=0;
-        sdl_backgnd_wait=0;
+        for (n=0; n<sdl_multi; n++) {
+            sdl_jobstat[n].busy=0;
+            sdl_jobstat[n].idle=0;
+            sdl_jobstat[n].jobs=0;
+            sdl_jobstat[n].steals=0;
+        }
         sdl_time_load=0;
         sdl_time_pre1=0;
         sdl_time_pre2=0;
@@ -810,6 +825,12 @@ display_graphs:
         sdl_time_alloc=0;
         texc_miss=0;
         texc_pre=0;
+        texc_lookup=0;
+        texc_probe=0;
+        texc_probe_max=0;
+        texc_evict_prob=0;
+        texc_evict_prot=0;
+        sdli_evict=0;
         sdl_time_make_main=0;
         gui_time_network=0;
 #if 0
@@ -0,0 +1,198 @@
+/*
+ * Part of Astonia Client (c) Daniel Brockhaus. Please read license.txt.
+ *
+ * pack.exe
+ *
+ * Builds the packed sprite archive for one scale out of the graphics archives
+ * in res/ (gx1.zip, gx2.zip, ..., including patch and mod archives). Every
+ * sprite is loaded exactly like the client would load it, so it is trimmed,
+ * scaled up, smoothed and pre-multiplied already. The client maps the archive
+ * and uses the images straight from it.
+ *
+ * Usage: pack.exe [-c] <scale>
+ *
+ * Run it from the main folder. The archive is written to res/gx<scale>.pak.
+ *
+ * -c stores images as spans, leaving out the transparent pixels, where that
+ * saves at least a quarter of the space. The client uses those as they are,
+ * too.
+ *
+ * The archive remembers which graphics archives it was built from, the client
+ * ignores it once those change. Run pack.exe again then.
+ *
+ * Sprites which can't be loaded are reported and left out, the client loads
+ * those from the graphics archives as before.
+ *
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#define SDL_MAIN_HANDLED
+#include <SDL2/SDL.h>
+
+#include "../../src/astonia.h"
+#include "../../src/sdl.h"
+#include "../../src/sdl/_sdl.h"
+
+int sdl_scale=1;
+
+int note(const char *format,...) {
+    va_list args;
+
+    va_start(args,format);
+    vprintf(format,args);
+    va_end(args);
+    printf("\n");
+
+    return 0;
+}
+
+int warn(const char *format,...) {
+    va_list args;
+
+    printf("WARNING: ");
+    va_start(args,format);
+    vprintf(format,args);
+    va_end(args);
+    printf("\n");
+
+    return 0;
+}
+
+// Gives up on the archive. A partial one must not be left behind.
+static int pack_abort(FILE *fp,char *filename,char *what) {
+    printf("Could not %s %s\n",what,filename);
+    fclose(fp);
+    remove(filename);
+
+    return 1;
+}
+
+int main(int argc,char *args[]) {
+    struct sdl_zips z;
+    struct sdl_pak_head head;
+    struct sdl_pak_entry *entry;
+    struct sdl_image si;
+    char filename[80];
+    uint32_t *buf,*data,zero[4]={0,0,0,0};
+    long long offset,len,size,total=0;
+    int n,sprite,count=0,compress=0,packed=0,missing=0;
+    FILE *fp;
+
+    for (n=1; n<argc; n++) {
+        if (!strcmp(args[n],"-c")) compress=1;
+        else sdl_scale=atoi(args[n]);
+    }
+    if (sdl_scale<1 || sdl_scale>4) {
+        printf("Usage: pack.exe [-c] <scale>\n");
+        return 1;
+    }
+
+    bzero(&z,sizeof(z));
+    sdl_zip_open(&z);
+    if (!z.zip1) {
+        printf("res/gx1.zip not found, please run pack.exe from the main folder.\n");
+        return 1;
+    }
+
+    // find all sprites in any of the archives
+    if (!sdl_zip_index(&z)) {
+        printf("No sprites found.\n");
+        return 1;
+    }
+    for (sprite=0; sprite<MAXSPRITE; sprite++)
+        if (sdl_zip_has(sprite)) count=sprite+1;
+
+    entry=calloc(count,sizeof(struct sdl_pak_entry));
+    if (!entry) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    head.magic=SDL_PAK_MAGIC;
+    head.version=SDL_PAK_VERSION;
+    head.scale=sdl_scale;
+    head.count=count;
+    head.sum=sdl_zip_sum(&z);
+
+    sprintf(filename,"res/gx%d.pak",sdl_scale);
+    fp=fopen(filename,"wb");
+    if (!fp) {
+        printf("Could not create %s\n",filename);
+        return 1;
+    }
+
+    // header and index get written again once they're filled in
+    offset=sizeof(head)+sizeof(struct sdl_pak_entry)*count;
+    if (fwrite(&head,sizeof(head),1,fp)!=1 ||
+        fwrite(entry,sizeof(struct sdl_pak_entry),count,fp)!=count) return pack_abort(fp,filename,"write");
+
+    for (sprite=0; sprite<count; sprite++) {
+        if (!sdl_zip_has(sprite)) continue;
+
+        // no placeholder for missing or broken images, the entry stays empty
+        bzero(&si,sizeof(si));
+        if (sdl_load_image_zip(&si,sprite,&z)) {
+            printf("Sprite %d could not be loaded, left out.\n",sprite);
+            missing++;
+            continue;
+        }
+
+        if (offset&15) {
+            if (fwrite(zero,16-(offset&15),1,fp)!=1) return pack_abort(fp,filename,"write");
+            offset=(offset+15)&~15ll;
+        }
+
+        len=(long long)si.xres*si.yres*sdl_scale*sdl_scale;
+        data=si.pixel;
+        size=len;
+        buf=NULL;
+
+        if (compress) {
+            buf=malloc((len+len/2+1)*sizeof(uint32_t));
+            if (!buf) {
+                printf("Out of memory.\n");
+                return pack_abort(fp,filename,"finish");
+            }
+            size=sdl_span_pack(buf,si.pixel,len);
+            if (size<len*3/4) {
+                data=buf;
+                entry[sprite].flags=SDL_PAK_PACKED;
+                packed++;
+            } else size=len;
+        }
+
+        if (size && fwrite(data,size*sizeof(uint32_t),1,fp)!=1) return pack_abort(fp,filename,"write");
+
+        entry[sprite].offset=offset;
+        entry[sprite].size=size*sizeof(uint32_t);
+        entry[sprite].xres=si.xres;
+        entry[sprite].yres=si.yres;
+        entry[sprite].xoff=si.xoff;
+        entry[sprite].yoff=si.yoff;
+
+        offset+=size*sizeof(uint32_t);
+        total++;
+
+        free(buf);
+        free(si.pixel);
+
+        if (total%1000==0) printf("%lld sprites, %.2fMB\r",total,offset/(1024.0*1024.0));
+    }
+
+    if (fseek(fp,0,SEEK_SET) ||
+        fwrite(&head,sizeof(head),1,fp)!=1 ||
+        fwrite(entry,sizeof(struct sdl_pak_entry),count,fp)!=count) return pack_abort(fp,filename,"write");
+    if (fclose(fp)) {
+        printf("Could not write %s\n",filename);
+        remove(filename);
+        return 1;
+    }
+
+    sdl_zip_close(&z);
+
+    printf("%s: %lld sprites (%d packed), %.2fMB\n",filename,total,packed,offset/(1024.0*1024.0));
+    if (missing) printf("%d sprites could not be loaded and were left out.\n",missing);
+
+    return 0;
+}
@@ -34,13 +34,26 @@
 #define SDL_MOUM_MDOWN      6
 #define SDL_MOUM_WHEEL      7
 
+#define SDL_TARGET_GROUND   0   // ground of the map, see dl_ground()
+#define SDL_TARGET_VIEW     1   // the whole game view, see display_game()
+#define SDL_TARGETS         2
+
 struct ddfont; typedef struct ddfont DDFONT;
 
 extern int sdl_cache_size;
+extern int sdl_cache_mem;
+extern int sdl_image_mem;
 extern int sdl_scale;
 extern int sdl_frames;
+extern int sdl_drawcalls;
 extern int sdl_multi;
 
+struct sdl_jobstat {
+    uint64_t busy,idle;     // milliseconds spent running jobs / waiting for them
+    int jobs,steals;
+};
+extern struct sdl_jobstat *sdl_jobstat;     // one per background worker
+
 extern int sound_volume;
 
 void sdl_set_cursor(int cursor);
@@ -55,7 +68,7 @@ int sdl_is_shown(void);
 void sdl_set_cursor_pos(int x,int y);
 void sdl_show_cursor(int flag);
 void sdl_capture_mouse(int flag);
-int sdl_tx_load(int sprite,int sink,int freeze,int scale,int cr,int cg,int cb,int light,int sat,int c1,int c2,int c3,int shine,int ml,int ll,int rl,int ul,int dl,const char *text,int text_color,int text_flags,void *text_font,int checkonly,int preload,int fortick);
+int sdl_tx_load(int sprite,int sink,int freeze,int scale,int cr,int cg,int cb,int light,int sat,int c1,int c2,int c3,int shine,int ml,int ll,int rl,int ul,int dl,int checkonly,int preload,int fortick);
 int sdl_init(int width,int height,char *title);
 void sdl_exit(void);
 void sdl_loop(void);
@@ -66,6 +79,7 @@ int sdlt_yoff(int stx);
 int sdlt_xres(int stx);
 int sdlt_yres(int stx);
 void sdl_blit(int stx,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset);
+void sdl_blit_light(int stx,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset,int ml,int ll,int rl,int ul,int dl);
 int sdl_drawtext(int sx,int sy,unsigned short int color,int flags,const char *text,struct ddfont *font,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset);
 void sdl_rect(int sx,int sy,int ex,int ey,unsigned short int color,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset);
 void sdl_shaded_rect(int sx,int sy,int ex,int ey,unsigned short int color,unsigned short alpha,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset);
@@ -76,6 +90,10 @@ void sdl_set_title(char *title);
 void *sdl_create_texture(int width,int height);
 void sdl_render_copy(void *tex,void *sr,void *dr);
 void sdl_render_copy_ex(void *tex,void *sr,void *dr,double angle);
+int sdl_target_begin(int nr,int w,int h);
+void sdl_target_clear(int sx,int sy,int ex,int ey);
+void sdl_target_end(void);
+int sdl_target_blit(int nr,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset);
 int sdl_tex_xres(int stx);
 int sdl_tex_yres(int stx);
 void sdl_render_circle(int32_t centreX, int32_t centreY, int32_t radius,uint32_t color);
@@ -3,7 +3,6 @@
  */
 
 #define MAX_TEXCACHE    (sdl_cache_size)
-#define MAX_TEXHASH     (sdl_cache_size)    // Note: MAX_TEXCACHE and MAX_TEXHASH do not have to be the same value. It just turned out to work well if they are.
 
 #define STX_NONE        (-1)
 
@@ -16,18 +15,21 @@
 
 #define SF_USED         (1<<0)
 #define SF_SPRITE       (1<<1)
-#define SF_TEXT         (1<<2)
 #define SF_DIDALLOC     (1<<3)
 #define SF_DIDMAKE      (1<<4)
 #define SF_DIDTEX       (1<<5)
 #define SF_BUSY         (1<<6)
+#define SF_ATLAS        (1<<7)  // tex is an atlas page, the sprite is at ax,ay on it
+
+#define SDL_NLIGHT      15      // light level which leaves the pixels as they are (DDFX_NLIGHT)
 
 struct sdl_texture {
     SDL_Texture *tex;
     uint32_t *pixel;
 
     int prev,next;
-    int hprev,hnext;
+    uint8_t seg;        // LRU segment, probation or protected
+    uint8_t drawn;      // drawn since it entered the cache (not just prefetched)
 
     uint16_t flags;
 
@@ -52,19 +54,83 @@ struct sdl_texture {
     int16_t xoff;               // offset to blit position
     int16_t yoff;               // offset to blit position
 
-    // ---------- text --------------
-    uint16_t text_flags;
-    uint32_t text_color;
-    char *text;
-    void *text_font;
+    // atlas, SF_ATLAS only
+    int16_t page;
+    uint8_t shelf;
+    uint16_t ax,ay;             // position on the page
+};
+
+// Lookup key of a texture cache entry. All the fields which make up a
+// sprite texture, packed. Kept in its own array, apart from the rest of
+// struct sdl_texture, to keep lookups in the cache.
+struct sdl_key {
+    uint64_t k[3];
+    uint64_t hash;
+};
+
+// slot in the texture hash table (open addressing)
+struct sdl_slot {
+    uint32_t fp;        // fingerprint, upper half of the hash
+    int32_t stx;
+};
+
+// One page of the sprite atlas. Sprites are packed into shelves, rows of
+// entries of about the same height, filled from left to right.
+#define SDLA_SHELVES    255
+
+struct sdl_shelf {
+    uint16_t y,h;               // position and height
+    uint16_t x;                 // where the next entry goes
+    uint16_t live;              // entries on it
+};
+
+struct sdl_page {
+    SDL_Texture *tex;
+    int nshelf;
+    int top;                    // first row not taken by a shelf
+    int live;                   // entries on it
+    long long area;             // pixels taken by those
+    struct sdl_shelf shelf[SDLA_SHELVES];
+};
+
+// A base image: a sprite scaled, colorized and colour balanced, but not lit.
+// The lit variants of a sprite get made from it, see sdl_base_get().
+#define SDLB_NONE       (-1)
+
+struct sdl_base {
+    struct sdl_key key;         // sprite fields without light, sink and freeze
+    uint32_t *pixel;
+
+    uint32_t size;              // words in pixel if it holds spans, 0 if it holds all the pixels
+    int32_t len;                // number of pixels
+    uint8_t busy;               // being made, pixel not there yet
+    uint16_t ref;               // number of users, not evicted while >0
+
+    int32_t prev,next;          // LRU list
+    int32_t hnext;              // hash chain
 };
 
+#define SI_MAPPED       (1<<1)  // pixel points into a mapped file (image cache or sprite archive), don't free
+#define SI_SPANS        (1<<2)  // pixel holds spans, transparent pixels left out, see sdl_span_pack()
+
+#define SIL_NONE        0
+#define SIL_QUEUED      1
+#define SIL_BUSY        2
+
+#define SIDX_NONE       (-1)
+
 struct sdl_image {
     uint32_t *pixel;
 
     uint16_t flags;
+    uint8_t load;               // SIL_QUEUED or SIL_BUSY while it's being loaded
+    uint16_t ref;               // number of users reading the pixels, not evicted while >0
     int16_t xres,yres;
     int16_t xoff,yoff;
+
+    uint32_t size;              // words in pixel, SI_SPANS only
+
+    int32_t prev,next;          // LRU list of loaded images
 };
 
 #ifndef HAVE_DDFONT
@@ -75,16 +141,104 @@ struct ddfont {
 };
 #endif
 
+// Glyph atlas of one font: all the characters drawn once, in white, into one
+// texture. Text is drawn as a quad per character, modulated by the color.
+// The shaded and framed variants are fonts of their own, and fonts are made
+// for the scale in use, so the font is all it takes to find its atlas.
+#define SDLG_CHARS      128
+#define SDLG_ROW        16      // characters per row of the texture
+
+struct sdl_glyphs {
+    struct ddfont *font;
+    SDL_Texture *tex;
+    int cw,ch;                  // size of the cells
+    uint8_t w[SDLG_CHARS];      // size of each character
+    uint8_t h[SDLG_CHARS];
+};
+
 #define DDT             '' // draw text terminator - (zero stays one, too)
 
-int sdl_ic_load(int sprite);
-int sdl_pre_backgnd(void *ptr);
 int sdl_create_cursors(void);
 
 #define MAX_SOUND_CHANNELS   32
 #define MAXSOUND            100
 
+struct sdl_shader {
+    char *name;
+    void (*colorbalance)(uint32_t *pixel,int cnt,int cr,int cg,int cb,int light,int sat);
+    void (*shine)(uint32_t *pixel,int cnt,int shine);
+    void (*light)(uint32_t *pixel,int cnt,int light);
+    void (*light5)(uint32_t *pixel,int cnt,const int32_t *wgt,int stride,int ml,int ll,int rl,int ul,int dl);
+    void (*freeze)(uint32_t *pixel,int cnt,int freeze);
+};
+
+extern struct sdl_shader sdl_shader;
+
+void sdl_shader_init(int level);
+const int32_t *sdl_light_mask(int y,int *width);
+int sdl_light_mod(int light);
+int sdl_light5_mod(float x,float y,float rx,float ry,int ml,int ll,int rl,int ul,int dl);
+uint32_t sdl_shine_pix(uint32_t irgb,unsigned short shine);
+
+int sdl_job_init(int workers);
+void sdl_job_submit(void (*func)(void *data,int worker),void *data);
+int sdl_job_run(void);
+
+int sdl_icache_init(uint64_t sum);
+int sdl_icache_get(int sprite,struct sdl_image *si);
+void sdl_icache_put(int sprite,struct sdl_image *si);
+
 struct png_helper;
 int png_load_helper(struct png_helper *p);
 void png_load_helper_exit(struct png_helper *p);
 
+// libzip handles must not be shared between threads, so every background
+// worker opens its own set of archives
+struct sdl_zips {
+    int open;
+
+    struct zip *zip1,*zip1p,*zip1m;
+    struct zip *zip2,*zip2p,*zip2m;
+};
+
+void sdl_zip_open(struct sdl_zips *z);
+uint64_t sdl_zip_sum(struct sdl_zips *z);
+int sdl_zip_index(struct sdl_zips *z);
+int sdl_zip_has(int sprite);
+void sdl_zip_close(struct sdl_zips *z);
+#define SDL_IMG_NOGFX   (-2)    // sdl_load_image(): not even the placeholder could be loaded
+
+int sdl_load_image(struct sdl_image *si,int sprite,struct sdl_zips *z);
+int sdl_load_image_zip(struct sdl_image *si,int sprite,struct sdl_zips *z);
+
+long long sdl_span_pack(uint32_t *dst,const uint32_t *pixel,long long cnt);
+void sdl_span_unpack(uint32_t *pixel,long long cnt,const uint32_t *src,long long len);
+void sdl_span_image(struct sdl_image *si);
+
+// Packed sprite archive, res/gx<scale>.pak, written by pack.exe. A header,
+// one entry per sprite number and then the images, trimmed, scaled and
+// pre-multiplied, each starting on 16 bytes.
+#define SDL_PAK_MAGIC   0x4b504f4d      // "MOPK"
+#define SDL_PAK_VERSION 1
+
+#define SDL_PAK_PACKED  (1<<0)          // stored as spans, see sdl_span_pack()
+
+struct sdl_pak_head {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t scale;
+    uint32_t count;         // number of entries
+    uint64_t sum;           // checksum of the graphics archives, see sdl_zip_sum()
+};
+
+struct sdl_pak_entry {
+    uint64_t offset;        // 0 = not in the archive
+    uint32_t size;          // bytes stored
+    uint16_t flags;
+    int16_t xres,yres;
+    int16_t xoff,yoff;
+    uint16_t dummy;
+};
+
+int sdl_pak_open(uint64_t sum);
+
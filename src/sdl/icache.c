@@ -0,0 +1,277 @@
+/*
+ * Part of Astonia Client (c) Daniel Brockhaus. Please read license.txt.
+ *
+ * Image Cache
+ *
+ * Keeps the decoded sprite images (trimmed, scaled up, smoothified and
+ * premultiplied) in a file, so the next start can map them instead of
+ * decoding the PNGs again. There is one file per scale. It starts with a
+ * header and a directory with one entry per sprite, followed by the pixel
+ * data. The file is thrown away and started over when the version, the
+ * scale or the contents of the graphics archives change.
+ *
+ * Images added during a run lie beyond the mapping. They are read back from
+ * the file when they're needed again, so they don't get decoded and added
+ * once more after being evicted.
+ */
+
+#include <stdint.h>
+#include <windows.h>
+#include <SDL2/SDL.h>
+
+#include "../../src/astonia.h"
+#include "../../src/sdl.h"
+#include "../../src/sdl/_sdl.h"
+
+#define ICACHE_MAGIC    0x43494f4d     // "MOIC"
+#define ICACHE_VERSION  1               // increase whenever the decoding of images changes
+#define ICACHE_MAXSIZE  (2048ll*1024*1024)
+
+struct icache_head {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t scale;
+    uint32_t maxsprite;
+    uint64_t sum;           // checksum of the graphics archives
+};
+
+struct icache_entry {
+    uint64_t offset;        // 0 = not in the cache
+    int16_t xres,yres;
+    int16_t xoff,yoff;
+};
+
+#define ICACHE_DATA     (sizeof(struct icache_head)+sizeof(struct icache_entry)*MAXSPRITE)
+
+static HANDLE icache_file=INVALID_HANDLE_VALUE;
+static HANDLE icache_mapping=NULL;
+static unsigned char *icache_map=NULL;
+static long long icache_mapsize=0;
+static long long icache_end=0;          // where the next image goes
+static struct icache_entry *icache_added=NULL;  // directory entries of the images added during this run
+static SDL_mutex *icache_mutex=NULL;
+
+long long icache_hit=0,icache_put=0;
+
+static int icache_write(long long offset,const void *buf,DWORD size) {
+    OVERLAPPED ov;
+    DWORD done;
+
+    bzero(&ov,sizeof(ov));
+    ov.Offset=(DWORD)offset;
+    ov.OffsetHigh=(DWORD)(offset>>32);
+
+    if (!WriteFile(icache_file,buf,size,&done,&ov) || done!=size) return -1;
+
+    return 0;
+}
+
+static int icache_read(long long offset,void *buf,DWORD size) {
+    OVERLAPPED ov;
+    DWORD done;
+
+    bzero(&ov,sizeof(ov));
+    ov.Offset=(DWORD)offset;
+    ov.OffsetHigh=(DWORD)(offset>>32);
+
+    if (!ReadFile(icache_file,buf,size,&done,&ov) || done!=size) return -1;
+
+    return 0;
+}
+
+// Starts the cache file over, with an empty directory.
+static int icache_reset(struct icache_head *head) {
+    LARGE_INTEGER size;
+
+    size.QuadPart=0;
+    if (!SetFilePointerEx(icache_file,size,NULL,FILE_BEGIN) || !SetEndOfFile(icache_file)) return -1;
+
+    size.QuadPart=ICACHE_DATA;
+    if (!SetFilePointerEx(icache_file,size,NULL,FILE_BEGIN) || !SetEndOfFile(icache_file)) return -1;
+
+    return icache_write(0,head,sizeof(*head));
+}
+
+// Opens and maps the image cache for the current scale. sum is a checksum
+// of the graphics archives, see sdl_zip_sum(). The mapping stays until the
+// client exits, sdli[] points into it.
+int sdl_icache_init(uint64_t sum) {
+    char filename[MAX_PATH];
+    struct icache_head head,*old;
+    LARGE_INTEGER size;
+
+    if (game_options&GO_APPDATA) sprintf(filename,"%s\\Astonia\\sprite%d.cache",localdata,sdl_scale);
+    else sprintf(filename,"bin/data/sprite%d.cache",sdl_scale);
+
+    icache_file=CreateFile(filename,GENERIC_READ|GENERIC_WRITE,FILE_SHARE_READ,NULL,OPEN_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+    if (icache_file==INVALID_HANDLE_VALUE) {
+        note("image cache %s not available",filename);
+        return 0;
+    }
+
+    head.magic=ICACHE_MAGIC;
+    head.version=ICACHE_VERSION;
+    head.scale=sdl_scale;
+    head.maxsprite=MAXSPRITE;
+    head.sum=sum;
+
+    if (!GetFileSizeEx(icache_file,&size)) size.QuadPart=0;
+
+    if (size.QuadPart>=(long long)ICACHE_DATA) {
+        icache_mapping=CreateFileMapping(icache_file,NULL,PAGE_READONLY,0,0,NULL);
+        if (icache_mapping) icache_map=MapViewOfFile(icache_mapping,FILE_MAP_READ,0,0,0);
+
+        old=(struct icache_head *)icache_map;
+        if (!old || memcmp(old,&head,sizeof(head))) {
+            note("image cache %s is outdated, starting over",filename);
+            if (icache_map) UnmapViewOfFile(icache_map);
+            if (icache_mapping) CloseHandle(icache_mapping);
+            icache_map=NULL;
+            icache_mapping=NULL;
+            size.QuadPart=0;
+        }
+    } else size.QuadPart=0;
+
+    if (!size.QuadPart) {
+        if (icache_reset(&head)) {
+            warn("could not create image cache %s",filename);
+            CloseHandle(icache_file);
+            icache_file=INVALID_HANDLE_VALUE;
+            return 0;
+        }
+        size.QuadPart=ICACHE_DATA;
+        icache_mapping=CreateFileMapping(icache_file,NULL,PAGE_READONLY,0,0,NULL);
+        if (icache_mapping) icache_map=MapViewOfFile(icache_mapping,FILE_MAP_READ,0,0,0);
+    }
+
+    if (!icache_map) {
+        warn("could not map image cache %s",filename);
+        if (icache_mapping) CloseHandle(icache_mapping);
+        CloseHandle(icache_file);
+        icache_mapping=NULL;
+        icache_file=INVALID_HANDLE_VALUE;
+        return 0;
+    }
+
+    icache_mapsize=size.QuadPart;
+    icache_end=(size.QuadPart+15)&~15ll;
+    icache_added=xcalloc(MAXSPRITE*sizeof(struct icache_entry),MEM_SDL_BASE);
+    icache_mutex=SDL_CreateMutex();
+
+    note("image cache %s: %.2fMB",filename,icache_mapsize/(1024.0*1024.0));
+
+    return 1;
+}
+
+// Reads an image added during this run back from the file.
+static int icache_get_added(struct icache_entry *e,struct sdl_image *si) {
+    long long len;
+
+    len=(long long)e->xres*e->yres*sizeof(uint32_t)*sdl_scale*sdl_scale;
+
+#ifdef SDL_FAST_MALLOC
+    si->pixel=malloc(max(1,len));
+#else
+    si->pixel=xmalloc(max(1,len),MEM_SDL_PNG);
+#endif
+    if (!si->pixel) return -1;
+
+    if (len && icache_read(e->offset,si->pixel,len)) {
+        warn("could not read image cache (%lu)",GetLastError());
+#ifdef SDL_FAST_MALLOC
+        free(si->pixel);
+#else
+        xfree(si->pixel);
+#endif
+        si->pixel=NULL;
+        return -1;
+    }
+
+    si->xres=e->xres;
+    si->yres=e->yres;
+    si->xoff=e->xoff;
+    si->yoff=e->yoff;
+    si->flags=1;
+
+    return 0;
+}
+
+// Fills in si from the cache. Images which were in the file at the start
+// stay in the mapped file, si gets SI_MAPPED. Images added since then are
+// read into memory of their own. Returns 0 on success, -1 if the image
+// isn't in the cache.
+int sdl_icache_get(int sprite,struct sdl_image *si) {
+    struct icache_entry *e,added;
+    long long len;
+
+    if (!icache_map || sprite<0 || sprite>=MAXSPRITE) return -1;
+
+    SDL_LockMutex(icache_mutex);
+    added=icache_added[sprite];
+    SDL_UnlockMutex(icache_mutex);
+
+    if (added.offset) {
+        if (icache_get_added(&added,si)) return -1;
+
+        SDL_LockMutex(icache_mutex);
+        icache_hit++;
+        SDL_UnlockMutex(icache_mutex);
+
+        return 0;
+    }
+
+    e=(struct icache_entry *)(icache_map+sizeof(struct icache_head))+sprite;
+    if (!e->offset) return -1;
+
+    // the directory in the mapping might show an entry which is being
+    // added right now, those are only used once they're in icache_added
+    len=(long long)e->xres*e->yres*sizeof(uint32_t)*sdl_scale*sdl_scale;
+    if (e->offset<ICACHE_DATA || e->offset+len>icache_mapsize) return -1;
+
+    si->pixel=(uint32_t *)(icache_map+e->offset);
+    si->xres=e->xres;
+    si->yres=e->yres;
+    si->xoff=e->xoff;
+    si->yoff=e->yoff;
+    si->flags=1|SI_MAPPED;
+
+    SDL_LockMutex(icache_mutex);
+    icache_hit++;
+    SDL_UnlockMutex(icache_mutex);
+
+    return 0;
+}
+
+// Adds a freshly decoded image to the cache file. Called from the
+// background workers, so several might be writing at once.
+void sdl_icache_put(int sprite,struct sdl_image *si) {
+    struct icache_entry e;
+    long long len;
+
+    if (!icache_map || sprite<0 || sprite>=MAXSPRITE) return;
+
+    len=(long long)si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale;
+
+    SDL_LockMutex(icache_mutex);
+    if (icache_added[sprite].offset || icache_end+len>ICACHE_MAXSIZE) {
+        SDL_UnlockMutex(icache_mutex);
+        return;
+    }
+    e.offset=icache_end;
+    icache_end=(icache_end+len+15)&~15ll;
+    SDL_UnlockMutex(icache_mutex);
+
+    e.xres=si->xres;
+    e.yres=si->yres;
+    e.xoff=si->xoff;
+    e.yoff=si->yoff;
+
+    // pixels first, the directory entry only once they are in place
+    if (len && icache_write(e.offset,si->pixel,len)) return;
+    if (icache_write(sizeof(struct icache_head)+sizeof(struct icache_entry)*sprite,&e,sizeof(e))) return;
+
+    SDL_LockMutex(icache_mutex);
+    icache_added[sprite]=e;
+    icache_put++;
+    SDL_UnlockMutex(icache_mutex);
+}
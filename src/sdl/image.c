@@ -0,0 +1,893 @@
+/*
+ * Part of Astonia Client (c) Daniel Brockhaus. Please read license.txt.
+ *
+ * Images
+ *
+ * Gets the sprite images out of the graphics archives: PNG decoding,
+ * trimming, scaling up, smoothing and pre-multiplying. Also reads the packed
+ * sprite archive built by pack.exe, which has all that done already.
+ *
+ * This file is linked into pack.exe too, so nothing in here may depend on
+ * the renderer or the rest of the client.
+ *
+ */
+
+#include <stdint.h>
+#include <windows.h>
+#include <SDL2/SDL.h>
+#include <png.h>
+#include <zip.h>
+
+#include "../../src/astonia.h"
+#include "../../src/sdl.h"
+#include "../../src/sdl/_sdl.h"
+
+// Where to find a sprite, the archive with the highest priority holding it.
+// Built once at startup. The entry indices are the same for everybody's
+// handles, the archives are the same files.
+#define ZA_NONE         0       // in none of the archives
+#define ZA_1            1
+#define ZA_1P           2
+#define ZA_1M           3
+#define ZA_2            4       // high res from here on
+#define ZA_2P           5
+#define ZA_2M           6
+
+struct sdl_zentry {
+    uint32_t index;             // entry in the archive
+    uint8_t arch;
+};
+
+static struct sdl_zentry *zindex=NULL;
+
+static unsigned char *pak_map=NULL;
+static long long pak_size=0;
+static int pak_count=0;
+
+long long pak_hit=0;
+
+void sdl_zip_open(struct sdl_zips *z) {
+
+    z->zip1=zip_open("res/gx1.zip",ZIP_RDONLY,NULL);
+    z->zip1p=zip_open("res/gx1_patch.zip",ZIP_RDONLY,NULL);
+    z->zip1m=zip_open("res/gx1_mod.zip",ZIP_RDONLY,NULL);
+
+    switch (sdl_scale) {
+        case 2:
+            z->zip2=zip_open("res/gx2.zip",ZIP_RDONLY,NULL);
+            z->zip2p=zip_open("res/gx2_patch.zip",ZIP_RDONLY,NULL);
+            z->zip2m=zip_open("res/gx2_mod.zip",ZIP_RDONLY,NULL);
+            break;
+        case 3:
+            z->zip2=zip_open("res/gx3.zip",ZIP_RDONLY,NULL);
+            z->zip2p=zip_open("res/gx3_patch.zip",ZIP_RDONLY,NULL);
+            z->zip2m=zip_open("res/gx3_mod.zip",ZIP_RDONLY,NULL);
+            break;
+        case 4:
+            z->zip2=zip_open("res/gx4.zip",ZIP_RDONLY,NULL);
+            z->zip2p=zip_open("res/gx4_patch.zip",ZIP_RDONLY,NULL);
+            z->zip2m=zip_open("res/gx4_mod.zip",ZIP_RDONLY,NULL);
+            break;
+    }
+    z->open=1;
+}
+
+// Checksum over the directories of all archives, name, size and CRC of
+// every file. Cheap, libzip has the directory in memory already.
+uint64_t sdl_zip_sum(struct sdl_zips *z) {
+    zip_t *zip[6]={z->zip1,z->zip1p,z->zip1m,z->zip2,z->zip2p,z->zip2m};
+    zip_int64_t i,cnt;
+    zip_stat_t st;
+    uint64_t sum=0xcbf29ce484222325ull;
+    const char *c;
+    int n;
+
+    for (n=0; n<6; n++) {
+        sum=(sum^n)*0x100000001b3ull;
+        if (!zip[n]) continue;
+
+        cnt=zip_get_num_entries(zip[n],0);
+        for (i=0; i<cnt; i++) {
+            if (zip_stat_index(zip[n],i,0,&st)) continue;
+            for (c=st.name; c && *c; c++) sum=(sum^(unsigned char)*c)*0x100000001b3ull;
+            sum=(sum^st.size)*0x100000001b3ull;
+            sum=(sum^st.crc)*0x100000001b3ull;
+        }
+    }
+    return sum;
+}
+
+static zip_t *sdl_zip_arch(struct sdl_zips *z,int arch) {
+    switch (arch) {
+        case ZA_1:      return z->zip1;
+        case ZA_1P:     return z->zip1p;
+        case ZA_1M:     return z->zip1m;
+        case ZA_2:      return z->zip2;
+        case ZA_2P:     return z->zip2p;
+        case ZA_2M:     return z->zip2m;
+        default:        return NULL;
+    }
+}
+
+// Scans the directories of all archives once and remembers where each
+// sprite is, so sdl_load_image() can go straight there instead of trying
+// all archives in turn. Same order as there: mod, patch and base of the
+// high res archives first, then those of the standard ones.
+int sdl_zip_index(struct sdl_zips *z) {
+    static int order[6]={ZA_2M,ZA_2P,ZA_2,ZA_1M,ZA_1P,ZA_1};
+    zip_t *zip;
+    zip_int64_t i,cnt;
+    const char *name;
+    char buf[80];
+    int n,sprite,found=0;
+
+    if (!zindex) {
+#ifdef SDL_FAST_MALLOC
+        zindex=calloc(MAXSPRITE,sizeof(struct sdl_zentry));
+#else
+        zindex=xcalloc(MAXSPRITE*sizeof(struct sdl_zentry),MEM_SDL_BASE);
+#endif
+        if (!zindex) return 0;
+    }
+
+    for (n=0; n<6; n++) {
+        zip=sdl_zip_arch(z,order[n]);
+        if (!zip) continue;
+
+        cnt=zip_get_num_entries(zip,0);
+        for (i=0; i<cnt; i++) {
+            name=zip_get_name(zip,i,0);
+            if (!name || sscanf(name,"%d.png",&sprite)!=1) continue;
+            if (sprite<0 || sprite>=MAXSPRITE || zindex[sprite].arch) continue;
+
+            sprintf(buf,"%08d.png",sprite);
+            if (strcmp(name,buf)) continue;
+
+            zindex[sprite].index=i;
+            zindex[sprite].arch=order[n];
+            found++;
+        }
+    }
+
+    return found;
+}
+
+// Returns 1 if sprite is in any of the archives. Needs sdl_zip_index().
+int sdl_zip_has(int sprite) {
+    if (!zindex || sprite<0 || sprite>=MAXSPRITE) return 0;
+
+    return zindex[sprite].arch!=ZA_NONE;
+}
+
+void sdl_zip_close(struct sdl_zips *z) {
+
+    if (z->zip1) zip_close(z->zip1);
+    if (z->zip1m) zip_close(z->zip1m);
+    if (z->zip1p) zip_close(z->zip1p);
+    if (z->zip2) zip_close(z->zip2);
+    if (z->zip2m) zip_close(z->zip2m);
+    if (z->zip2p) zip_close(z->zip2p);
+    z->open=0;
+}
+
+// Maps the packed sprite archive for the current scale, if there is one.
+// sum is the checksum of the graphics archives it has to have been built
+// from, an archive built from different ones is ignored. The mapping stays
+// until the client exits, sdli[] points into it.
+int sdl_pak_open(uint64_t sum) {
+    char filename[MAX_PATH];
+    HANDLE file,mapping;
+    LARGE_INTEGER size;
+    struct sdl_pak_head *head;
+
+    sprintf(filename,"res/gx%d.pak",sdl_scale);
+
+    file=CreateFile(filename,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+    if (file==INVALID_HANDLE_VALUE) return 0;
+
+    if (!GetFileSizeEx(file,&size) || size.QuadPart<(long long)sizeof(struct sdl_pak_head)) {
+        warn("sprite archive %s is broken",filename);
+        CloseHandle(file);
+        return 0;
+    }
+
+    // the view keeps the mapping and the file open
+    mapping=CreateFileMapping(file,NULL,PAGE_READONLY,0,0,NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        warn("could not map sprite archive %s",filename);
+        return 0;
+    }
+    pak_map=MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+    CloseHandle(mapping);
+    if (!pak_map) {
+        warn("could not map sprite archive %s",filename);
+        return 0;
+    }
+
+    head=(struct sdl_pak_head *)pak_map;
+    if (head->magic!=SDL_PAK_MAGIC || head->version!=SDL_PAK_VERSION || head->scale!=sdl_scale || head->count>MAXSPRITE ||
+        size.QuadPart<(long long)(sizeof(struct sdl_pak_head)+sizeof(struct sdl_pak_entry)*head->count)) {
+        warn("sprite archive %s is broken or outdated, ignoring it",filename);
+        UnmapViewOfFile(pak_map);
+        pak_map=NULL;
+        return 0;
+    }
+    if (head->sum!=sum) {
+        note("sprite archive %s does not match the graphics archives, ignoring it",filename);
+        UnmapViewOfFile(pak_map);
+        pak_map=NULL;
+        return 0;
+    }
+
+    pak_size=size.QuadPart;
+    pak_count=head->count;
+
+    note("sprite archive %s: %d sprites, %.2fMB",filename,pak_count,pak_size/(1024.0*1024.0));
+
+    return 1;
+}
+
+// Span images leave out the transparent pixels. Every run is a word with
+// the number of transparent pixels in the upper and the number of stored
+// pixels in the lower half, followed by the stored pixels. Runs go on
+// across the end of a row, transparent pixels at the end are left out.
+
+// Packs cnt pixels into spans. Returns the number of words needed, dst may
+// be NULL to find out how many that will be. It never needs more than
+// cnt+cnt/2+1 words.
+long long sdl_span_pack(uint32_t *dst,const uint32_t *pixel,long long cnt) {
+    long long n=0,i=0,skip,len;
+
+    while (i<cnt) {
+        for (skip=0; i+skip<cnt && skip<0xffff && !pixel[i+skip]; skip++) ;
+        if (i+skip==cnt) break;     // transparent to the end
+
+        for (len=0; i+skip+len<cnt && len<0xffff && pixel[i+skip+len]; len++) ;
+
+        if (dst) {
+            dst[n]=(skip<<16)|len;
+            memcpy(dst+n+1,pixel+i+skip,len*sizeof(uint32_t));
+        }
+        n+=len+1;
+        i+=skip+len;
+    }
+
+    return n;
+}
+
+// Makes sure len words of spans stay within cnt pixels.
+static int sdl_span_check(const uint32_t *src,long long len,long long cnt) {
+    const uint32_t *end=src+len;
+    long long pos=0;
+    int n;
+
+    while (src<end) {
+        n=*src&0xffff;
+        pos+=(*src>>16)+n;
+        src+=n+1;
+        if (pos>cnt || src>end) return -1;
+    }
+
+    return 0;
+}
+
+// Unpacks spans into cnt pixels.
+void sdl_span_unpack(uint32_t *pixel,long long cnt,const uint32_t *src,long long len) {
+    const uint32_t *end=src+len;
+    uint32_t *stop=pixel+cnt;
+    int skip,n;
+
+    while (src<end) {
+        skip=*src>>16;
+        n=*src&0xffff;
+        src++;
+
+        bzero(pixel,skip*sizeof(uint32_t));
+        pixel+=skip;
+        memcpy(pixel,src,n*sizeof(uint32_t));
+        pixel+=n;
+        src+=n;
+    }
+    bzero(pixel,(stop-pixel)*sizeof(uint32_t));
+}
+
+// Turns a freshly loaded image into a span image, if that saves at least
+// a quarter of the memory. Most sprites are mostly transparent.
+void sdl_span_image(struct sdl_image *si) {
+    long long cnt,len;
+    uint32_t *span;
+
+    if (si->flags&(SI_MAPPED|SI_SPANS)) return;
+
+    cnt=(long long)si->xres*si->yres*sdl_scale*sdl_scale;
+    len=sdl_span_pack(NULL,si->pixel,cnt);
+    if (len>=cnt*3/4) return;
+
+#ifdef SDL_FAST_MALLOC
+    span=malloc(max(1,len)*sizeof(uint32_t));
+#else
+    span=xmalloc(max(1,len)*sizeof(uint32_t),MEM_SDL_PNG);
+#endif
+    sdl_span_pack(span,si->pixel,cnt);
+
+#ifdef SDL_FAST_MALLOC
+    free(si->pixel);
+#else
+    xfree(si->pixel);
+#endif
+    si->pixel=span;
+    si->size=len;
+    si->flags|=SI_SPANS;
+}
+
+// Load image from the packed sprite archive. All images are used right
+// where they are, packed ones as span images.
+static int sdl_load_image_pak(struct sdl_image *si,int sprite) {
+    struct sdl_pak_entry *e;
+    long long cnt;
+
+    if (!pak_map || sprite>=pak_count) return -1;
+
+    e=(struct sdl_pak_entry *)(pak_map+sizeof(struct sdl_pak_head))+sprite;
+    if (!e->offset || e->offset+e->size>pak_size) return -1;
+
+    cnt=(long long)e->xres*e->yres*sdl_scale*sdl_scale;
+
+    if (e->flags&SDL_PAK_PACKED) {
+        if (sdl_span_check((uint32_t *)(pak_map+e->offset),e->size/sizeof(uint32_t),cnt)) return -1;
+        si->pixel=(uint32_t *)(pak_map+e->offset);
+        si->size=e->size/sizeof(uint32_t);
+        si->flags=1|SI_MAPPED|SI_SPANS;
+    } else {
+        if (e->size!=cnt*sizeof(uint32_t)) return -1;
+        si->pixel=(uint32_t *)(pak_map+e->offset);
+        si->flags=1|SI_MAPPED;
+    }
+
+    si->xres=e->xres;
+    si->yres=e->yres;
+    si->xoff=e->xoff;
+    si->yoff=e->yoff;
+
+    pak_hit++;
+
+    return 0;
+}
+
+uint32_t mix_argb(uint32_t c1,uint32_t c2,float w1,float w2) {
+    int r1,r2,g1,g2,b1,b2,a1,a2;
+    int r,g,b,a;
+
+    a1=IGET_A(c1);
+    a2=IGET_A(c2);
+    if (!a1 && !a2) return 0; // save some work
+
+    r1=IGET_R(c1);
+    g1=IGET_G(c1);
+    b1=IGET_B(c1);
+
+    r2=IGET_R(c2);
+    g2=IGET_G(c2);
+    b2=IGET_B(c2);
+
+    a=(a1*w1+a2*w2);
+    r=(r1*w1+r2*w2);
+    g=(g1*w1+g2*w2);
+    b=(b1*w1+b2*w2);
+
+    a=min(255,a);
+    r=min(255,r);
+    g=min(255,g);
+    b=min(255,b);
+
+    return IRGBA(r,g,b,a);
+}
+
+void sdl_smoothify(uint32_t *pixel,int xres,int yres,int scale) {
+    int x,y;
+    uint32_t c1,c2,c3,c4;
+
+    switch (scale) {
+        case 2:
+            for (x=0; x<xres-2; x+=2) {
+                for (y=0; y<yres-2; y+=2) {
+                    c1=pixel[x+y*xres];             // top left
+                    c2=pixel[x+y*xres+2];           // top right
+                    c3=pixel[x+y*xres+xres*2];      // bottom left
+                    c4=pixel[x+y*xres+2+xres*2];    // bottom right
+
+                    pixel[x+y*xres+1]=mix_argb(c1,c2,0.5,0.5);
+                    pixel[x+y*xres+xres]=mix_argb(c1,c3,0.5,0.5);
+                    pixel[x+y*xres+1+xres]=mix_argb(mix_argb(c1,c2,0.5,0.5),mix_argb(c3,c4,0.5,0.5),0.5,0.5);
+                }
+            }
+            break;
+        case 3:
+            for (x=0; x<xres-3; x+=3) {
+                for (y=0; y<yres-3; y+=3) {
+                    c1=pixel[x+y*xres];             // top left
+                    c2=pixel[x+y*xres+3];           // top right
+                    c3=pixel[x+y*xres+xres*3];      // bottom left
+                    c4=pixel[x+y*xres+3+xres*3];    // bottom right
+
+                    pixel[x+y*xres+1]=mix_argb(c1,c2,0.667,0.333);
+                    pixel[x+y*xres+2]=mix_argb(c1,c2,0.333,0.667);
+
+                    pixel[x+y*xres+xres*1]=mix_argb(c1,c3,0.667,0.333);
+                    pixel[x+y*xres+xres*2]=mix_argb(c1,c3,0.333,0.667);
+
+                    pixel[x+y*xres+1+xres*1]=mix_argb(mix_argb(c1,c2,0.5,0.5),mix_argb(c3,c4,0.5,0.5),0.5,0.5);
+                    pixel[x+y*xres+2+xres*1]=mix_argb(mix_argb(c1,c2,0.333,0.667),mix_argb(c3,c4,0.333,0.667),0.667,0.333);
+                    pixel[x+y*xres+1+xres*2]=mix_argb(mix_argb(c1,c2,0.667,0.333),mix_argb(c3,c4,0.667,0.333),0.333,0.667);
+                    pixel[x+y*xres+2+xres*2]=mix_argb(mix_argb(c1,c2,0.333,0.667),mix_argb(c3,c4,0.333,0.667),0.333,0.667);
+                }
+            }
+            break;
+
+        case 4:
+            for (x=0; x<xres-4; x+=4) {
+                for (y=0; y<yres-4; y+=4) {
+                    c1=pixel[x+y*xres];             // top left
+                    c2=pixel[x+y*xres+4];           // top right
+                    c3=pixel[x+y*xres+xres*4];      // bottom left
+                    c4=pixel[x+y*xres+4+xres*4];    // bottom right
+
+                    pixel[x+y*xres+1]=mix_argb(c1,c2,0.75,0.25);
+                    pixel[x+y*xres+2]=mix_argb(c1,c2,0.50,0.50);
+                    pixel[x+y*xres+3]=mix_argb(c1,c2,0.25,0.75);
+
+                    pixel[x+y*xres+xres*1]=mix_argb(c1,c3,0.75,0.25);
+                    pixel[x+y*xres+xres*2]=mix_argb(c1,c3,0.50,0.50);
+                    pixel[x+y*xres+xres*3]=mix_argb(c1,c3,0.25,0.75);
+
+                    pixel[x+y*xres+1+xres*1]=mix_argb(mix_argb(c1,c2,0.75,0.25),mix_argb(c3,c4,0.75,0.25),0.75,0.25);
+                    pixel[x+y*xres+1+xres*2]=mix_argb(mix_argb(c1,c2,0.75,0.25),mix_argb(c3,c4,0.75,0.25),0.50,0.50);
+                    pixel[x+y*xres+1+xres*3]=mix_argb(mix_argb(c1,c2,0.75,0.75),mix_argb(c3,c4,0.75,0.25),0.25,0.75);
+
+                    pixel[x+y*xres+2+xres*1]=mix_argb(mix_argb(c1,c2,0.50,0.50),mix_argb(c3,c4,0.50,0.50),0.75,0.25);
+                    pixel[x+y*xres+2+xres*2]=mix_argb(mix_argb(c1,c2,0.50,0.50),mix_argb(c3,c4,0.50,0.50),0.50,0.50);
+                    pixel[x+y*xres+2+xres*3]=mix_argb(mix_argb(c1,c2,0.50,0.50),mix_argb(c3,c4,0.50,0.50),0.25,0.75);
+
+                    pixel[x+y*xres+3+xres*1]=mix_argb(mix_argb(c1,c2,0.25,0.75),mix_argb(c3,c4,0.25,0.75),0.75,0.25);
+                    pixel[x+y*xres+3+xres*2]=mix_argb(mix_argb(c1,c2,0.25,0.75),mix_argb(c3,c4,0.25,0.75),0.50,0.50);
+                    pixel[x+y*xres+3+xres*3]=mix_argb(mix_argb(c1,c2,0.25,0.75),mix_argb(c3,c4,0.25,0.75),0.25,0.75);
+                }
+            }
+            break;
+        default:
+            warn("Unsupported scale %d in sdl_load_image_png()",sdl_scale);
+            break;
+    }
+}
+
+void sdl_premulti(uint32_t *pixel,int xres,int yres,int scale) {
+    int n,r,g,b,a;
+    uint32_t c;
+
+    for (n=0; n<xres*yres; n++) {
+        c=pixel[n];
+
+        a=IGET_A(c);
+        if (!a) continue;
+
+        r=IGET_R(c);
+        g=IGET_G(c);
+        b=IGET_B(c);
+
+        r=min(255,r*255/a);
+        g=min(255,g*255/a);
+        b=min(255,b*255/a);
+
+        c=IRGBA(r,g,b,a);
+        pixel[n]=c;
+    }
+}
+
+struct png_helper {
+    char *filename;
+    zip_t *zip;
+    int index;                  // entry in zip, -1 to look it up by filename
+    unsigned char **row;
+    int xres;
+    int yres;
+    int bpp;
+
+    png_structp png_ptr;
+    png_infop info_ptr;
+};
+
+void png_helper_read(png_struct *ps,unsigned char *buf,long long unsigned len) {
+    zip_fread(png_get_io_ptr(ps),buf,len);
+}
+
+static void png_load_helper_fail(struct png_helper *p,FILE *fp,zip_file_t *zp) {
+    if (zp) zip_fclose(zp);
+    if (fp) fclose(fp);
+    png_destroy_read_struct(&p->png_ptr,&p->info_ptr,(png_infopp)NULL);
+}
+
+int png_load_helper(struct png_helper *p) {
+    FILE *volatile fp=NULL;             // volatile, they're still needed after a longjmp
+    zip_file_t *volatile zp=NULL;
+    int tmp;
+
+    if (p->zip) {
+        if (p->index>=0) zp=zip_fopen_index(p->zip,p->index,0);
+        else zp=zip_fopen(p->zip,p->filename,0);
+        if (!zp) return -1;
+    } else {
+        fp=fopen(p->filename,"rb");
+        if (!fp) return -1;
+    }
+
+    p->info_ptr=NULL;
+    p->png_ptr=png_create_read_struct(PNG_LIBPNG_VER_STRING,NULL,NULL,NULL);
+    if (!p->png_ptr) { png_load_helper_fail(p,fp,zp); warn("create read\n"); return -1; }
+
+    p->info_ptr=png_create_info_struct(p->png_ptr);
+    if (!p->info_ptr) { png_load_helper_fail(p,fp,zp); warn("create info1\n"); return -1; }
+
+    // libpng jumps back here on errors, a broken file must not take the process down
+    if (setjmp(png_jmpbuf(p->png_ptr))) { png_load_helper_fail(p,fp,zp); warn("%s: broken PNG",p->filename); return -1; }
+
+    if (p->zip) {
+        png_set_read_fn(p->png_ptr,zp,png_helper_read);
+    } else {
+        png_init_io(p->png_ptr,fp);
+    }
+    png_set_strip_16(p->png_ptr);
+    png_read_png(p->png_ptr,p->info_ptr,PNG_TRANSFORM_PACKING,NULL);
+
+    p->row=png_get_rows(p->png_ptr,p->info_ptr);
+    if (!p->row) { png_load_helper_fail(p,fp,zp); warn("read row\n"); return -1; }
+
+    p->xres=png_get_image_width(p->png_ptr,p->info_ptr);
+    p->yres=png_get_image_height(p->png_ptr,p->info_ptr);
+
+    tmp=png_get_rowbytes(p->png_ptr,p->info_ptr);
+
+    if (tmp==p->xres*3) p->bpp=24;
+    else if (tmp==p->xres*4) p->bpp=32;
+    else { png_load_helper_fail(p,fp,zp); warn("rowbytes!=xres*4 (%d, %d, %s)",tmp,p->xres,p->filename); return -1; }
+
+    if (png_get_bit_depth(p->png_ptr,p->info_ptr)!=8) { png_load_helper_fail(p,fp,zp); warn("bit depth!=8\n"); return -1; }
+    if (png_get_channels(p->png_ptr,p->info_ptr)!=p->bpp/8) { png_load_helper_fail(p,fp,zp); warn("channels!=format\n"); return -1; }
+
+    if (p->zip) zip_fclose(zp);
+    else fclose(fp);
+
+    return 0;
+}
+
+void png_load_helper_exit(struct png_helper *p) {
+    png_destroy_read_struct(&p->png_ptr,&p->info_ptr,(png_infopp)NULL);
+}
+
+// Load high res PNG
+int sdl_load_image_png_(struct sdl_image *si,char *filename,zip_t *zip,int index) {
+    int x,y,r,g,b,a,sx,sy,ex,ey;
+    uint32_t c;
+    struct png_helper p;
+
+    p.zip=zip;
+    p.index=index;
+    p.filename=filename;
+    if (png_load_helper(&p)) return -1;
+
+    // prescan
+    sx=p.xres;
+    sy=p.yres;
+    ex=0;
+    ey=0;
+
+    for (y=0; y<p.yres; y++) {
+        for (x=0; x<p.xres; x++) {
+            if (p.bpp==32 && (p.row[y][x*4+3]==0 || (p.row[y][x*4+0]==255 && p.row[y][x*4+1]==0 && p.row[y][x*4+2]==255))) continue;
+            if (p.bpp==24 && ((p.row[y][x*3+0]==255 && p.row[y][x*3+1]==0 && p.row[y][x*3+2]==255))) continue;
+            if (x<sx) sx=x;
+            if (x>ex) ex=x;
+            if (y<sy) sy=y;
+            if (y>ey) ey=y;
+        }
+    }
+
+    // Make sure the new found borders of the image are on multiples
+    // of sd_scale. And never shrink the visible portion to do that.
+    sx=(sx/sdl_scale)*sdl_scale;
+    sy=(sy/sdl_scale)*sdl_scale;
+    ex=((ex+sdl_scale)/sdl_scale)*sdl_scale;
+    ey=((ey+sdl_scale)/sdl_scale)*sdl_scale;
+
+    if (ex<sx) ex=sx-1;
+    if (ey<sy) ey=sy-1;
+
+    // write
+    si->flags=1;
+    si->xres=ex-sx;
+    si->yres=ey-sy;
+    si->xoff=-(p.xres/2)+sx;
+    si->yoff=-(p.yres/2)+sy;
+
+#ifdef SDL_FAST_MALLOC
+    si->pixel=malloc(si->xres*si->yres*sizeof(uint32_t));
+#else
+    si->pixel=xmalloc(si->xres*si->yres*sizeof(uint32_t),MEM_SDL_PNG);
+#endif
+
+    for (y=0; y<si->yres; y++) {
+        for (x=0; x<si->xres; x++) {
+
+            if (p.bpp==32) {
+                if (sx+x>=p.xres || sy+y>=p.yres) r=g=b=a=0;
+                else {
+                    r=p.row[(sy+y)][(sx+x)*4+0];
+                    g=p.row[(sy+y)][(sx+x)*4+1];
+                    b=p.row[(sy+y)][(sx+x)*4+2];
+                    a=p.row[(sy+y)][(sx+x)*4+3];
+                }
+            } else {
+                if (sx+x>=p.xres || sy+y>=p.yres) r=g=b=a=0;
+                else {
+                    r=p.row[(sy+y)][(sx+x)*3+0];
+                    g=p.row[(sy+y)][(sx+x)*3+1];
+                    b=p.row[(sy+y)][(sx+x)*3+2];
+                    if (r==255 && g==0 && b==255) a=0;
+                    else a=255;
+                }
+            }
+
+            if (r==255 && g==0 && b==255) a=0;
+
+            if (a) {    // pre-multiply rgb channel by alpha
+                r=min(255,r*255/a);
+                g=min(255,g*255/a);
+                b=min(255,b*255/a);
+            } else r=g=b=0;
+
+            c=IRGBA(r,g,b,a);
+
+            si->pixel[x+y*si->xres]=c;
+        }
+    }
+
+    png_load_helper_exit(&p);
+
+    si->xres/=sdl_scale;
+    si->yres/=sdl_scale;
+    si->xoff/=sdl_scale;
+    si->yoff/=sdl_scale;
+
+    return 0;
+}
+
+// Load and up-scale low res PNG
+// TODO: add support for using a 2X image as a base for 4X
+// and possibly the other way around too
+int sdl_load_image_png(struct sdl_image *si,char *filename,zip_t *zip,int index,int smoothify) {
+    int x,y,r,g,b,a,sx,sy,ex,ey;
+    uint32_t c;
+    struct png_helper p;
+
+    p.zip=zip;
+    p.index=index;
+    p.filename=filename;
+    if (png_load_helper(&p)) return -1;
+
+    // prescan
+    sx=p.xres;
+    sy=p.yres;
+    ex=0;
+    ey=0;
+
+    for (y=0; y<p.yres; y++) {
+        for (x=0; x<p.xres; x++) {
+            if (p.bpp==32 && (p.row[y][x*4+3]==0 || (p.row[y][x*4+0]==255 && p.row[y][x*4+1]==0 && p.row[y][x*4+2]==255))) continue;
+            if (p.bpp==24 && ((p.row[y][x*3+0]==255 && p.row[y][x*3+1]==0 && p.row[y][x*3+2]==255))) continue;
+            if (x<sx) sx=x;
+            if (x>ex) ex=x;
+            if (y<sy) sy=y;
+            if (y>ey) ey=y;
+        }
+    }
+
+    if (ex<sx) ex=sx-1;
+    if (ey<sy) ey=sy-1;
+
+    // write
+    si->flags=1;
+    si->xres=ex-sx+1;
+    si->yres=ey-sy+1;
+    si->xoff=-(p.xres/2)+sx;
+    si->yoff=-(p.yres/2)+sy;
+
+#ifdef SDL_FAST_MALLOC
+    si->pixel=malloc(si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale);
+#else
+    si->pixel=xmalloc(si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale,MEM_SDL_PNG);
+#endif
+
+    for (y=0; y<si->yres; y++) {
+        for (x=0; x<si->xres; x++) {
+
+            if (p.bpp==32) {
+                r=p.row[(sy+y)][(sx+x)*4+0];
+                g=p.row[(sy+y)][(sx+x)*4+1];
+                b=p.row[(sy+y)][(sx+x)*4+2];
+                a=p.row[(sy+y)][(sx+x)*4+3];
+            } else {
+                r=p.row[(sy+y)][(sx+x)*3+0];
+                g=p.row[(sy+y)][(sx+x)*3+1];
+                b=p.row[(sy+y)][(sx+x)*3+2];
+                if (r==255 && g==0 && b==255) a=0;
+                else a=255;
+            }
+
+            if (r==255 && g==0 && b==255) a=0;
+
+            if (!a) // don't pre-multiply rgb channel by alpha because that needs to happen after scaling
+                r=g=b=0;
+
+            c=IRGBA(r,g,b,a);
+
+            switch (sdl_scale) {
+                case 1:
+                    si->pixel[x+y*si->xres]=c;
+                    break;
+                case 2:
+                    si->pixel[x*2+y*si->xres*4]=c;
+                    si->pixel[x*2+y*si->xres*4+1]=c;
+                    si->pixel[x*2+y*si->xres*4+si->xres*2]=c;
+                    si->pixel[x*2+y*si->xres*4+1+si->xres*2]=c;
+                    break;
+                case 3:
+                    si->pixel[x*3+y*si->xres*9+0]=c;
+                    si->pixel[x*3+y*si->xres*9+0+si->xres*3]=c;
+                    si->pixel[x*3+y*si->xres*9+0+si->xres*6]=c;
+
+                    si->pixel[x*3+y*si->xres*9+1]=c;
+                    si->pixel[x*3+y*si->xres*9+1+si->xres*3]=c;
+                    si->pixel[x*3+y*si->xres*9+1+si->xres*6]=c;
+
+                    si->pixel[x*3+y*si->xres*9+2]=c;
+                    si->pixel[x*3+y*si->xres*9+2+si->xres*3]=c;
+                    si->pixel[x*3+y*si->xres*9+2+si->xres*6]=c;
+                    break;
+                case 4:
+                    si->pixel[x*4+y*si->xres*16+0]=c;
+                    si->pixel[x*4+y*si->xres*16+0+si->xres*4]=c;
+                    si->pixel[x*4+y*si->xres*16+0+si->xres*8]=c;
+                    si->pixel[x*4+y*si->xres*16+0+si->xres*12]=c;
+
+                    si->pixel[x*4+y*si->xres*16+1]=c;
+                    si->pixel[x*4+y*si->xres*16+1+si->xres*4]=c;
+                    si->pixel[x*4+y*si->xres*16+1+si->xres*8]=c;
+                    si->pixel[x*4+y*si->xres*16+1+si->xres*12]=c;
+
+                    si->pixel[x*4+y*si->xres*16+2]=c;
+                    si->pixel[x*4+y*si->xres*16+2+si->xres*4]=c;
+                    si->pixel[x*4+y*si->xres*16+2+si->xres*8]=c;
+                    si->pixel[x*4+y*si->xres*16+2+si->xres*12]=c;
+
+                    si->pixel[x*4+y*si->xres*16+3]=c;
+                    si->pixel[x*4+y*si->xres*16+3+si->xres*4]=c;
+                    si->pixel[x*4+y*si->xres*16+3+si->xres*8]=c;
+                    si->pixel[x*4+y*si->xres*16+3+si->xres*12]=c;
+                    break;
+                default:
+                    warn("Unsupported scale %d in sdl_load_image_png()",sdl_scale);
+                    break;
+            }
+        }
+    }
+
+    if (sdl_scale>1 && smoothify) {
+        sdl_smoothify(si->pixel,si->xres*sdl_scale,si->yres*sdl_scale,sdl_scale);
+        sdl_premulti(si->pixel,si->xres*sdl_scale,si->yres*sdl_scale,sdl_scale);
+    } else sdl_premulti(si->pixel,si->xres*sdl_scale,si->yres*sdl_scale,sdl_scale);
+
+    png_load_helper_exit(&p);
+
+    return 0;
+}
+
+
+int do_smoothify(int sprite) {
+
+    // TODO: add more to this list
+    if (sprite>=50 && sprite<=56) return 0;
+    if (sprite>0 && sprite<=1000) return 1;         // GUI
+    if (sprite>=10000 && sprite<11000) return 1;    // items
+    if (sprite>=11000 && sprite<12000) return 1;    // coffin, berries, farn, ...
+    if (sprite>=13000 && sprite<14000) return 1;    // bones and towers, ...
+    if (sprite>=16000 && sprite<17000) return 1;    // cameron doors, carts, ...
+    if (sprite>=20025 && sprite<20034) return 1;    // torches
+    if (sprite>=20042 && sprite<20082) return 1;    // torches
+    if (sprite>=20086 && sprite<20119) return 1;    // chests, chairs
+
+    if (sprite>=100000) return 1;                   // all character sprites
+
+    return 0;
+}
+
+// Loads the image for sprite from the graphics archives. Returns -1 if
+// it isn't in any of them or can't be decoded.
+int sdl_load_image_zip(struct sdl_image *si,int sprite,struct sdl_zips *z) {
+    char filename[1024];
+    struct sdl_zentry *ze;
+
+    // go straight to the right archive if we have an index. only if that
+    // fails (broken PNG) fall back to trying them all.
+    if (zindex) {
+        ze=zindex+sprite;
+        sprintf(filename,"%08d.png",sprite);
+        if (ze->arch==ZA_NONE) return -1;
+        if (ze->arch>=ZA_2 && sdl_load_image_png_(si,filename,sdl_zip_arch(z,ze->arch),ze->index)==0) return 0;
+        if (ze->arch<ZA_2 && sdl_load_image_png(si,filename,sdl_zip_arch(z,ze->arch),ze->index,do_smoothify(sprite))==0) return 0;
+    }
+
+#if 0
+    // get patch png
+    sprintf(filename,"../gfxp/x%d/%08d/%08d.png",sdl_scale,(sprite/1000)*1000,sprite);
+    if (sdl_load_image_png_(si,filename,NULL,-1)==0) return 0;
+#endif
+
+    // get high res from archive
+    if (z->zip2 || z->zip2p || z->zip2m) {
+        sprintf(filename,"%08d.png",sprite);
+        if (z->zip2m && sdl_load_image_png_(si,filename,z->zip2m,-1)==0) return 0;    // check mod archive first
+        if (z->zip2p && sdl_load_image_png_(si,filename,z->zip2p,-1)==0) return 0;    // check patch archive second
+        if (z->zip2 && sdl_load_image_png_(si,filename,z->zip2,-1)==0) return 0;     // check base archive third
+    }
+
+#if 0
+    // get high res from base png folder
+    sprintf(filename,"../gfx/x%d/%08d/%08d.png",sdl_scale,(sprite/1000)*1000,sprite);
+    if (sdl_load_image_png_(si,filename,NULL,-1)==0) return 0;
+#endif
+
+    // get standard from archive
+    if (z->zip1 || z->zip1p || z->zip1m) {
+        sprintf(filename,"%08d.png",sprite);
+        if (z->zip1m && sdl_load_image_png(si,filename,z->zip1m,-1,do_smoothify(sprite))==0) return 0;
+        if (z->zip1p && sdl_load_image_png(si,filename,z->zip1p,-1,do_smoothify(sprite))==0) return 0;
+        if (z->zip1 && sdl_load_image_png(si,filename,z->zip1,-1,do_smoothify(sprite))==0) return 0;
+    }
+
+#if 0
+    // get standard from base png folder
+    sprintf(filename,"../gfx/x1/%08d/%08d.png",(sprite/1000)*1000,sprite);
+    if (sdl_load_image_png(si,filename,NULL,-1,do_smoothify(sprite))==0) return 0;
+    sprintf(filename,"../gfxp/x1/%08d/%08d.png",(sprite/1000)*1000,sprite);
+    if (sdl_load_image_png(si,filename,NULL,-1,do_smoothify(sprite))==0) return 0;
+#endif
+
+    return -1;
+}
+
+// Loads the image for sprite, from the packed archive or the graphics
+// archives. A missing image gets the placeholder sprite instead.
+int sdl_load_image(struct sdl_image *si,int sprite,struct sdl_zips *z) {
+    char filename[1024];
+
+    if (sprite>=MAXSPRITE || sprite<0) {
+        note("sdl_load_image: illegal sprite %d wanted",sprite);
+        return -1;
+    }
+
+    // get it ready made from the packed archive
+    if (sdl_load_image_pak(si,sprite)==0) return 0;
+
+    if (sdl_load_image_zip(si,sprite,z)==0) return 0;
+
+    sprintf(filename,"%08d.png",sprite);
+    warn("%s not found",filename);
+
+    // get unknown sprite image
+    sprintf(filename,"%08d.png",2);
+    if (z->zip1 && sdl_load_image_png(si,filename,z->zip1,-1,do_smoothify(sprite))==0) return 0;
+
+    // this may run on a background worker, the main thread tells the user
+    // and quits, see sdl_gfx_check()
+    return SDL_IMG_NOGFX;
+}
@@ -0,0 +1,163 @@
+/*
+ * Part of Astonia Client (c) Daniel Brockhaus. Please read license.txt.
+ *
+ * Jobs
+ *
+ * A small work-stealing job system for the background workers. Every
+ * worker owns a queue. The main thread spreads the jobs it submits over
+ * those queues, and a worker whose own queue is empty takes jobs from the
+ * others. Jobs are taken oldest first by the owner and newest first by a
+ * thief, so prefetches for the next tick are done before later ones.
+ */
+
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+#include "../../src/astonia.h"
+#include "../../src/sdl.h"
+#include "../../src/sdl/_sdl.h"
+
+#define MAXJOB      4096    // per worker, power of two
+
+struct job {
+    void (*func)(void *data,int worker);
+    void *data;
+};
+
+struct jobqueue {
+    SDL_SpinLock lock;
+    unsigned int head,tail;     // taken at head by the owner, at tail by thieves, added at tail
+    struct job job[MAXJOB];
+};
+
+static struct jobqueue *jobq=NULL;
+static int jobq_cnt=0;          // number of queues, same as workers, at least one
+static int jobq_next=0;         // queue for the next job submitted
+static SDL_sem *jobsem=NULL;    // one count per queued job
+
+struct sdl_jobstat *sdl_jobstat=NULL;
+
+static int job_push(struct jobqueue *q,struct job *job) {
+    SDL_AtomicLock(&q->lock);
+    if (q->tail-q->head==MAXJOB) {
+        SDL_AtomicUnlock(&q->lock);
+        return 0;
+    }
+    q->job[q->tail&(MAXJOB-1)]=*job;
+    q->tail++;
+    SDL_AtomicUnlock(&q->lock);
+
+    return 1;
+}
+
+static int job_pop(struct jobqueue *q,struct job *job,int steal) {
+    SDL_AtomicLock(&q->lock);
+    if (q->tail==q->head) {
+        SDL_AtomicUnlock(&q->lock);
+        return 0;
+    }
+    if (steal) *job=q->job[(--q->tail)&(MAXJOB-1)];
+    else *job=q->job[(q->head++)&(MAXJOB-1)];
+    SDL_AtomicUnlock(&q->lock);
+
+    return 1;
+}
+
+// Takes a job for worker id, from its own queue if possible. Only called
+// after a successful wait on jobsem, so there is a job for us somewhere.
+static void job_take(int id,struct job *job) {
+    int n;
+
+    while (42) {
+        if (job_pop(jobq+id,job,0)) return;
+
+        for (n=1; n<jobq_cnt; n++) {
+            if (job_pop(jobq+(id+n)%jobq_cnt,job,1)) {
+                if (sdl_jobstat) sdl_jobstat[id].steals++;
+                return;
+            }
+        }
+    }
+}
+
+static int job_worker(void *ptr) {
+    int id=(int)(long long)ptr;
+    struct job job;
+    uint64_t start;
+
+    while (!quit) {
+        start=SDL_GetTicks64();
+        SDL_SemWait(jobsem);
+        sdl_jobstat[id].idle+=SDL_GetTicks64()-start;
+
+        start=SDL_GetTicks64();
+        job_take(id,&job);
+        job.func(job.data,id);
+        sdl_jobstat[id].busy+=SDL_GetTicks64()-start;
+        sdl_jobstat[id].jobs++;
+    }
+
+    return 0;
+}
+
+// Starts the background worker threads. With zero workers, jobs are queued
+// until the main thread runs them with sdl_job_run().
+int sdl_job_init(int workers) {
+    char buf[80];
+    int n;
+
+    jobq_cnt=max(1,workers);
+    jobq=xcalloc(sizeof(struct jobqueue)*jobq_cnt,MEM_SDL_BASE);
+    if (!jobq) return fail("Out of memory in sdl_job_init");
+
+    jobsem=SDL_CreateSemaphore(0);
+    if (!jobsem) return fail("SDL_CreateSemaphore Error: %s",SDL_GetError());
+
+    if (!workers) return 1;
+
+    sdl_jobstat=xcalloc(sizeof(struct sdl_jobstat)*workers,MEM_SDL_BASE);
+    if (!sdl_jobstat) return fail("Out of memory in sdl_job_init");
+
+    for (n=0; n<workers; n++) {
+        sprintf(buf,"moac background worker %d",n);
+        SDL_CreateThread(job_worker,buf,(void *)(long long)n);
+    }
+
+    return 1;
+}
+
+// Queues func(data,worker) to be run by one of the workers. worker is the
+// index of the worker running it, or -1 for the main thread. Called from
+// the main thread only.
+void sdl_job_submit(void (*func)(void *data,int worker),void *data) {
+    struct job job;
+    int n,q;
+
+    job.func=func;
+    job.data=data;
+
+    for (n=0; n<jobq_cnt; n++) {
+        q=(jobq_next+n)%jobq_cnt;
+        if (job_push(jobq+q,&job)) {
+            jobq_next=(q+1)%jobq_cnt;
+            SDL_SemPost(jobsem);
+            return;
+        }
+    }
+
+    // all queues full, do it right here
+    func(data,-1);
+}
+
+// Runs one queued job on the main thread, if there is one. Returns 1 if it
+// did some work.
+int sdl_job_run(void) {
+    struct job job;
+
+    if (SDL_SemTryWait(jobsem)) return 0;
+
+    job_take(0,&job);
+    job.func(job.data,-1);
+
+    return 1;
+}
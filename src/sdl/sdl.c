@@ -23,16 +23,100 @@ static SDL_Window *sdlwnd;
 static SDL_Renderer *sdlren;
 
 static struct sdl_texture *sdlt=NULL;
-static int sdlt_best,sdlt_last;
-static int *sdlt_cache;
+static struct sdl_key *sdlt_key=NULL;
+static int sdlt_best[2],sdlt_last[2];
+static int sdlt_cnt[2];
+static int sdlt_tick;
+static int *sdlt_free,sdlt_nfree;
+static long long sdlt_budget;
+static struct sdl_slot *sdlt_table;
+static unsigned int sdlt_mask;
+
+// The texture cache is a segmented LRU: new entries start out on probation,
+// entries which get drawn again move to the protected segment. Eviction takes
+// from probation first, so a burst of sprites used only once (a new area
+// scrolling in) cannot push out the working set.
+#define SDLT_PROBATION  0
+#define SDLT_PROTECTED  1
+#define SDLT_PROTECT    80      // percentage of the entries the protected segment may hold
+#define SDLT_SCAN       64      // entries looked at per segment when searching for a victim
+
+// Sprite atlas: sprite textures are packed into a few large pages instead of
+// getting a texture each. Fewer objects for the driver, and blits in a row
+// mostly stay on the same texture. Large sprites and whatever doesn't fit
+// anymore get a texture of their own.
+#define SDLA_SIZE       2048    // pages are SDLA_SIZE square, or smaller if the renderer can't do that
+#define SDLA_MAXPAGE    64
+#define SDLA_MAXDIM     4       // sprites wider or higher than 1/SDLA_MAXDIM of a page don't go in
+#define SDLA_ROUND      8       // shelf heights are rounded up to this
+#define SDLA_WHITE      2       // white block at the top left of every page, see sdl_queue_solid()
+
+static struct sdl_page *sdla=NULL;
+static int sdla_pages=0,sdla_maxpage=0;
+static int sdla_size=SDLA_SIZE;
+static int sdla_full=0;     // an entry didn't fit, see sdl_atlas_defrag()
+
+// Draw batching: textured quads and triangles are collected as long as they
+// use the same texture and drawn with one SDL_RenderGeometry() call. Solid
+// rectangles, pixels and lines go in as quads, too. Drawing anything else, or
+// changing or destroying the texture, flushes them first.
+#define SDLQ_MAXVERT    4096
+#define SDLQ_MAXINDEX   (SDLQ_MAXVERT*3/2)
+
+static SDL_Vertex sdlq_vert[SDLQ_MAXVERT];
+static int sdlq_index[SDLQ_MAXINDEX];
+static int sdlq_nvert=0,sdlq_nindex=0;
+static SDL_Texture *sdlq_tex=NULL;
+static int sdlq_solid=1;       // sdlq_tex can draw solid quads, see sdl_queue_solid()
+static int sdlq_calls=0;       // draw calls in the current frame
+
+// Render targets parts of the game view are kept in, see sdl_target_begin().
+struct sdl_target {
+    SDL_Texture *tex;
+    int w,h;
+    int lost;                   // the renderer lost its contents
+};
+
+static struct sdl_target sdl_tgt[SDL_TARGETS];
+static int sdl_tgt_ok=0;        // the renderer can draw to textures
+static int sdl_tgt_stack[SDL_TARGETS];  // targets being drawn to, innermost last
+static int sdl_tgt_depth=0;
+
+// Glyph atlases, one per font, see sdl_glyphs().
+#define SDLG_MAX        16
+
+static struct sdl_glyphs sdlg[SDLG_MAX];
+static int sdlg_cnt=0;
 
 static SDL_Cursor *curs[20];
 
 static struct sdl_image *sdli=NULL;
+static int sdli_best=SIDX_NONE,sdli_last=SIDX_NONE;    // LRU list of the loaded images, mapped ones excepted
+static long long sdli_budget;
+
+// Base images, see sdl_base_get(). Chained hash, the entries come from a
+// free list.
+#define SDLB_MAX        4096
+#define SDLB_HASH       4096    // number of hash chains, power of two
+
+static struct sdl_base *sdlb=NULL;
+static int *sdlb_table=NULL;
+static int *sdlb_free,sdlb_nfree;
+static int sdlb_best=SDLB_NONE,sdlb_last=SDLB_NONE;
+static long long sdlb_budget;
 
 int texc_used=0;
 long long mem_png=0,mem_tex=0;
 long long texc_hit=0,texc_miss=0,texc_pre=0;
+long long texc_lookup=0,texc_probe=0;
+int texc_probe_max=0;
+long long texc_evict_prob=0,texc_evict_prot=0;
+long long sdli_evict=0;
+static SDL_atomic_t sdl_nogfx;  // an image failed with SDL_IMG_NOGFX, see sdl_gfx_check()
+long long texc_atlas=0,texc_single=0,texc_defrag=0;
+long long mem_base=0,sdlb_hit=0,sdlb_miss=0;
+extern long long icache_hit,icache_put;
+extern long long pak_hit;
 
 long long sdl_time_preload=0;
 long long sdl_time_make=0;
@@ -49,20 +133,16 @@ long long sdl_time_pre3=0;
 
 __declspec(dllexport) int sdl_scale=1;
 __declspec(dllexport) int sdl_frames=0;
+__declspec(dllexport) int sdl_drawcalls=0;          // draw calls in the last frame
 __declspec(dllexport) int sdl_multi=4;
-__declspec(dllexport) int sdl_cache_size=8000;
+__declspec(dllexport) int sdl_cache_size=16000;
+__declspec(dllexport) int sdl_cache_mem=0;         // texture cache budget in MB, 0 = depends on system memory
+__declspec(dllexport) int sdl_image_mem=0;         // source image budget in MB, 0 = depends on system memory
 
-static zip_t *sdl_zip1=NULL;
-static zip_t *sdl_zip2=NULL;
+static struct sdl_zips *sdl_zips=NULL;     // [0] is the main thread, [n+1] worker n
 
-static zip_t *sdl_zip1p=NULL;
-static zip_t *sdl_zip2p=NULL;
-
-static zip_t *sdl_zip1m=NULL;
-static zip_t *sdl_zip2m=NULL;
-
-static SDL_sem *prework=NULL;
 static SDL_mutex *premutex=NULL;
+static SDL_cond *predone=NULL;     // signalled whenever an entry stops being SF_BUSY or an image got loaded
 
 __declspec(dllexport) int __yres=YRES0;
 
@@ -80,12 +160,22 @@ void sdl_dump(FILE *fp) {
     fprintf(fp,"sdl_frames: %d\n",sdl_frames);
     fprintf(fp,"sdl_multi: %d\n",sdl_multi);
     fprintf(fp,"sdl_cache_size: %d\n",sdl_cache_size);
+    fprintf(fp,"sdl_cache_mem: %d\n",sdl_cache_mem);
+    fprintf(fp,"sdl_image_mem: %d\n",sdl_image_mem);
 
     fprintf(fp,"mem_png: %lld\n",mem_png);
     fprintf(fp,"mem_tex: %lld\n",mem_tex);
     fprintf(fp,"texc_hit: %lld\n",texc_hit);
     fprintf(fp,"texc_miss: %lld\n",texc_miss);
     fprintf(fp,"texc_pre: %lld\n",texc_pre);
+    fprintf(fp,"texc_probe: %.2f avg, %d max\n",texc_lookup?(double)texc_probe/texc_lookup:0.0,texc_probe_max);
+    fprintf(fp,"texc_evict: %lld probation, %lld protected\n",texc_evict_prob,texc_evict_prot);
+    fprintf(fp,"texc_segment: %d probation, %d protected\n",sdlt_cnt[SDLT_PROBATION],sdlt_cnt[SDLT_PROTECTED]);
+    fprintf(fp,"icache: %lld hit, %lld put\n",icache_hit,icache_put);
+    fprintf(fp,"sdli_evict: %lld\n",sdli_evict);
+    fprintf(fp,"pak: %lld hit\n",pak_hit);
+    fprintf(fp,"atlas: %d pages of %d, %lld in atlas, %lld single, %lld defrag\n",sdla_pages,sdla_maxpage,texc_atlas,texc_single,texc_defrag);
+    fprintf(fp,"base: %lld hit, %lld miss, %lld bytes\n",sdlb_hit,sdlb_miss,mem_base);
 
     fprintf(fp,"sdlm_sprite: %d\n",sdlm_sprite);
     fprintf(fp,"sdlm_scale: %d\n",sdlm_scale);
@@ -99,7 +189,9 @@ void sdl_dump(FILE *fp) {
 
 int sdl_init(int width,int height,char *title) {
     int len,i;
+    uint64_t sum;
     SDL_DisplayMode DM;
+    SDL_RendererInfo info;
 
     if (SDL_Init(SDL_INIT_VIDEO|((game_options&GO_SOUND)?SDL_INIT_AUDIO:0)) != 0){
         fail("SDL_Init Error: %s",SDL_GetError());
@@ -137,30 +229,80 @@ int sdl_init(int width,int height,char *title) {
         return 0;
     }
 
+    // solid quads drawn without a texture blend like the rest
+    SDL_SetRenderDrawBlendMode(sdlren,SDL_BLENDMODE_BLEND);
+
     len=sizeof(struct sdl_image)*MAXSPRITE;
     sdli=xcalloc(len*1,MEM_SDL_BASE);
     if (!sdli) return fail("Out of memory in sdl_init");
 
-    sdlt_cache=xcalloc(MAX_TEXHASH*sizeof(int),MEM_SDL_BASE);
-    if (!sdlt_cache) return fail("Out of memory in sdl_init");
+    // open addressing, keep the load factor at or below 50%
+    for (len=1; len<MAX_TEXCACHE*2; len<<=1) ;
+    sdlt_mask=len-1;
 
-    for (i=0; i<MAX_TEXHASH; i++)
-        sdlt_cache[i]=STX_NONE;
+    sdlt_table=xcalloc(len*sizeof(struct sdl_slot),MEM_SDL_BASE);
+    if (!sdlt_table) return fail("Out of memory in sdl_init");
+
+    for (i=0; i<len; i++)
+        sdlt_table[i].stx=STX_NONE;
 
     sdlt=xcalloc(MAX_TEXCACHE*sizeof(struct sdl_texture),MEM_SDL_BASE);
     if (!sdlt) return fail("Out of memory in sdl_init");
 
+    sdlt_key=xcalloc(MAX_TEXCACHE*sizeof(struct sdl_key),MEM_SDL_BASE);
+    if (!sdlt_key) return fail("Out of memory in sdl_init");
+
+    sdlt_free=xcalloc(MAX_TEXCACHE*sizeof(int),MEM_SDL_BASE);
+    if (!sdlt_free) return fail("Out of memory in sdl_init");
+
+    // unused entries are kept on the free list, the LRU list starts out empty
     for (i=0; i<MAX_TEXCACHE; i++) {
         sdlt[i].flags=0;
-        sdlt[i].prev=i-1;
-        sdlt[i].next=i+1;
-        sdlt[i].hnext=STX_NONE;
-        sdlt[i].hprev=STX_NONE;
+        sdlt[i].prev=sdlt[i].next=STX_NONE;
+        sdlt[i].seg=SDLT_PROBATION;
+        sdlt[i].fortick=0;
+        sdlt_free[i]=MAX_TEXCACHE-1-i;
     }
-    sdlt[0].prev=STX_NONE;
-    sdlt[MAX_TEXCACHE-1].next=STX_NONE;
-    sdlt_best=0;
-    sdlt_last=MAX_TEXCACHE-1;
+    sdlt_nfree=MAX_TEXCACHE;
+    for (i=0; i<2; i++) {
+        sdlt_best[i]=sdlt_last[i]=STX_NONE;
+        sdlt_cnt[i]=0;
+    }
+
+    if (!sdl_cache_mem) sdl_cache_mem=min(2048,max(256,SDL_GetSystemRAM()/8));
+    sdlt_budget=sdl_cache_mem*1024ll*1024ll;
+
+    if (!sdl_image_mem) sdl_image_mem=min(1024,max(128,SDL_GetSystemRAM()/16));
+    sdli_budget=sdl_image_mem*1024ll*1024ll;
+
+    if (!SDL_GetRendererInfo(sdlren,&info)) {
+        if (info.max_texture_width && info.max_texture_height)
+            sdla_size=min(SDLA_SIZE,min(info.max_texture_width,info.max_texture_height));
+        sdl_tgt_ok=(info.flags&SDL_RENDERER_TARGETTEXTURE)!=0;
+    }
+    sdla_maxpage=min(SDLA_MAXPAGE,max(1,sdlt_budget/((long long)sdla_size*sdla_size*sizeof(uint32_t))));
+
+    sdla=xcalloc(SDLA_MAXPAGE*sizeof(struct sdl_page),MEM_SDL_BASE);
+    if (!sdla) return fail("Out of memory in sdl_init");
+
+    sdlb=xcalloc(SDLB_MAX*sizeof(struct sdl_base),MEM_SDL_BASE);
+    if (!sdlb) return fail("Out of memory in sdl_init");
+
+    sdlb_table=xcalloc(SDLB_HASH*sizeof(int),MEM_SDL_BASE);
+    if (!sdlb_table) return fail("Out of memory in sdl_init");
+
+    sdlb_free=xcalloc(SDLB_MAX*sizeof(int),MEM_SDL_BASE);
+    if (!sdlb_free) return fail("Out of memory in sdl_init");
+
+    for (i=0; i<SDLB_HASH; i++)
+        sdlb_table[i]=SDLB_NONE;
+    for (i=0; i<SDLB_MAX; i++)
+        sdlb_free[i]=SDLB_MAX-1-i;
+    sdlb_nfree=SDLB_MAX;
+
+    // a quarter of the image budget, they're only worth keeping while the
+    // sprite is in use with several lights
+    sdlb_budget=sdli_budget/4;
 
     SDL_RaiseWindow(sdlwnd);
 
@@ -199,30 +341,21 @@ int sdl_init(int width,int height,char *title) {
         else game_options=GO_DEFAULTS|GO_SMALLBOT|GO_SMALLTOP;
     }
     note("SDL using %dx%d scale %d, options=%llu",XRES,YRES,sdl_scale,game_options);
+    note("SDL texture cache: %d entries, %dMB",sdl_cache_size,sdl_cache_mem);
+    note("SDL image cache: %dMB",sdl_image_mem);
+
+    sdl_shader_init(-1);
+    note("SDL shader using %s kernels",sdl_shader.name);
 
     sdl_create_cursors();
 
-    sdl_zip1=zip_open("res/gx1.zip",ZIP_RDONLY,NULL);
-    sdl_zip1p=zip_open("res/gx1_patch.zip",ZIP_RDONLY,NULL);
-    sdl_zip1m=zip_open("res/gx1_mod.zip",ZIP_RDONLY,NULL);
-
-    switch (sdl_scale) {
-        case 2:
-            sdl_zip2=zip_open("res/gx2.zip",ZIP_RDONLY,NULL);
-            sdl_zip2p=zip_open("res/gx2_patch.zip",ZIP_RDONLY,NULL);
-            sdl_zip2m=zip_open("res/gx2_mod.zip",ZIP_RDONLY,NULL);
-            break;
-        case 3:
-            sdl_zip2=zip_open("res/gx3.zip",ZIP_RDONLY,NULL);
-            sdl_zip2p=zip_open("res/gx3_patch.zip",ZIP_RDONLY,NULL);
-            sdl_zip2m=zip_open("res/gx3_mod.zip",ZIP_RDONLY,NULL);
-            break;
-        case 4:
-            sdl_zip2=zip_open("res/gx4.zip",ZIP_RDONLY,NULL);
-            sdl_zip2p=zip_open("res/gx4_patch.zip",ZIP_RDONLY,NULL);
-            sdl_zip2m=zip_open("res/gx4_mod.zip",ZIP_RDONLY,NULL);
-            break;
-    }
+    sdl_zips=xcalloc(sizeof(struct sdl_zips)*(sdl_multi+1),MEM_SDL_BASE);
+    if (!sdl_zips) return fail("Out of memory in sdl_init");
+    sdl_zip_open(sdl_zips);
+    note("SDL graphics archives: %d sprites",sdl_zip_index(sdl_zips));
+    sum=sdl_zip_sum(sdl_zips);
+    sdl_pak_open(sum);
+    sdl_icache_init(sum);
 
     if ((game_options&GO_SOUND) && Mix_OpenAudio(44100,MIX_DEFAULT_FORMAT,2,2048)<0) {
         warn("initializing audio failed");
@@ -235,610 +368,340 @@ int sdl_init(int width,int height,char *title) {
     }
 
     if (sdl_multi) {
-        char buf[80];
-        int n;
-
-        prework=SDL_CreateSemaphore(0);
         premutex=SDL_CreateMutex();
-
-        for (n=0; n<sdl_multi; n++) {
-            sprintf(buf,"moac background worker %d",n);
-            SDL_CreateThread(sdl_pre_backgnd,buf,(void *)(long long)n);
-        }
+        predone=SDL_CreateCond();
     }
+    if (!sdl_job_init(sdl_multi)) return 0;
 
     return 1;
 }
 
-int maxpanic=0;
+// Draws whatever the batch holds.
+static void sdl_flush(void) {
+    if (!sdlq_nindex) return;
 
-int sdl_clear(void) {
-    //SDL_SetRenderDrawColor(sdlren,255,63,63,255);     // clear with bright red to spot broken sprites
-    SDL_SetRenderDrawColor(sdlren,0,0,0,255);
-    SDL_RenderClear(sdlren);
-    //note("mem: %.2fM PNG, %.2fM Tex, Hit: %ld, Miss: %ld, Max: %d\n",mem_png/(1024.0*1024.0),mem_tex/(1024.0*1024.0),texc_hit,texc_miss,maxpanic);
-    maxpanic=0;
-    return 1;
-}
+    SDL_RenderGeometry(sdlren,sdlq_tex,sdlq_vert,sdlq_nvert,sdlq_index,sdlq_nindex);
+    sdlq_calls++;
 
-int sdl_render(void) {
-    SDL_RenderPresent(sdlren);
-    sdl_frames++;
-    return 1;
+    sdlq_nvert=sdlq_nindex=0;
 }
 
-uint32_t mix_argb(uint32_t c1,uint32_t c2,float w1,float w2) {
-    int r1,r2,g1,g2,b1,b2,a1,a2;
-    int r,g,b,a;
+// Flushes the batch if it uses tex, before tex gets changed or destroyed.
+static inline void sdl_flush_tex(SDL_Texture *tex) {
+    if (tex==sdlq_tex) sdl_flush();
+}
 
-    a1=IGET_A(c1);
-    a2=IGET_A(c2);
-    if (!a1 && !a2) return 0; // save some work
+// The atlas page tex is, -1 if it isn't one.
+static int sdl_atlas_page(SDL_Texture *tex) {
+    int n;
 
-    r1=IGET_R(c1);
-    g1=IGET_G(c1);
-    b1=IGET_B(c1);
+    for (n=0; n<sdla_pages; n++)
+        if (sdla[n].tex==tex) return n;
 
-    r2=IGET_R(c2);
-    g2=IGET_G(c2);
-    b2=IGET_B(c2);
+    return -1;
+}
 
-    a=(a1*w1+a2*w2);
-    r=(r1*w1+r2*w2);
-    g=(g1*w1+g2*w2);
-    b=(b1*w1+b2*w2);
+// Makes room for nvert vertices and nindex indices using tex in the batch.
+// Returns the first vertex, indices are added by the caller relative to
+// that.
+static SDL_Vertex *sdl_queue(SDL_Texture *tex,int nvert,int nindex) {
+    if (tex!=sdlq_tex || sdlq_nvert+nvert>SDLQ_MAXVERT || sdlq_nindex+nindex>SDLQ_MAXINDEX) {
+        sdl_flush();
+        if (tex!=sdlq_tex) sdlq_solid=!tex || sdl_atlas_page(tex)!=-1;
+        sdlq_tex=tex;
+    }
+    return sdlq_vert+sdlq_nvert;
+}
 
-    a=min(255,a);
-    r=min(255,r);
-    g=min(255,g);
-    b=min(255,b);
+// Adds the two triangles of the quad just written to the batch, its corners
+// being top left, top right, bottom left and bottom right.
+static inline void sdl_queue_index4(void) {
+    int *idx=sdlq_index+sdlq_nindex;
 
-    return IRGBA(r,g,b,a);
+    idx[0]=sdlq_nvert; idx[1]=sdlq_nvert+1; idx[2]=sdlq_nvert+3;
+    idx[3]=sdlq_nvert; idx[4]=sdlq_nvert+3; idx[5]=sdlq_nvert+2;
+    sdlq_nvert+=4;
+    sdlq_nindex+=6;
 }
 
-void sdl_smoothify(uint32_t *pixel,int xres,int yres,int scale) {
-    int x,y;
-    uint32_t c1,c2,c3,c4;
-
-    switch (scale) {
-        case 2:
-            for (x=0; x<xres-2; x+=2) {
-                for (y=0; y<yres-2; y+=2) {
-                    c1=pixel[x+y*xres];             // top left
-                    c2=pixel[x+y*xres+2];           // top right
-                    c3=pixel[x+y*xres+xres*2];      // bottom left
-                    c4=pixel[x+y*xres+2+xres*2];    // bottom right
+// Adds a quad drawing sr of tex, which is tw by th pixels, to dr, modulated
+// by col.
+static void sdl_queue_quad(SDL_Texture *tex,const SDL_Rect *dr,const SDL_Rect *sr,int tw,int th,SDL_Color col) {
+    SDL_Vertex *v;
+    int i;
 
-                    pixel[x+y*xres+1]=mix_argb(c1,c2,0.5,0.5);
-                    pixel[x+y*xres+xres]=mix_argb(c1,c3,0.5,0.5);
-                    pixel[x+y*xres+1+xres]=mix_argb(mix_argb(c1,c2,0.5,0.5),mix_argb(c3,c4,0.5,0.5),0.5,0.5);
-                }
-            }
-            break;
-        case 3:
-            for (x=0; x<xres-3; x+=3) {
-                for (y=0; y<yres-3; y+=3) {
-                    c1=pixel[x+y*xres];             // top left
-                    c2=pixel[x+y*xres+3];           // top right
-                    c3=pixel[x+y*xres+xres*3];      // bottom left
-                    c4=pixel[x+y*xres+3+xres*3];    // bottom right
-
-                    pixel[x+y*xres+1]=mix_argb(c1,c2,0.667,0.333);
-                    pixel[x+y*xres+2]=mix_argb(c1,c2,0.333,0.667);
-
-                    pixel[x+y*xres+xres*1]=mix_argb(c1,c3,0.667,0.333);
-                    pixel[x+y*xres+xres*2]=mix_argb(c1,c3,0.333,0.667);
-
-                    pixel[x+y*xres+1+xres*1]=mix_argb(mix_argb(c1,c2,0.5,0.5),mix_argb(c3,c4,0.5,0.5),0.5,0.5);
-                    pixel[x+y*xres+2+xres*1]=mix_argb(mix_argb(c1,c2,0.333,0.667),mix_argb(c3,c4,0.333,0.667),0.667,0.333);
-                    pixel[x+y*xres+1+xres*2]=mix_argb(mix_argb(c1,c2,0.667,0.333),mix_argb(c3,c4,0.667,0.333),0.333,0.667);
-                    pixel[x+y*xres+2+xres*2]=mix_argb(mix_argb(c1,c2,0.333,0.667),mix_argb(c3,c4,0.333,0.667),0.333,0.667);
-                }
-            }
-            break;
-
-        case 4:
-            for (x=0; x<xres-4; x+=4) {
-                for (y=0; y<yres-4; y+=4) {
-                    c1=pixel[x+y*xres];             // top left
-                    c2=pixel[x+y*xres+4];           // top right
-                    c3=pixel[x+y*xres+xres*4];      // bottom left
-                    c4=pixel[x+y*xres+4+xres*4];    // bottom right
-
-                    pixel[x+y*xres+1]=mix_argb(c1,c2,0.75,0.25);
-                    pixel[x+y*xres+2]=mix_argb(c1,c2,0.50,0.50);
-                    pixel[x+y*xres+3]=mix_argb(c1,c2,0.25,0.75);
-
-                    pixel[x+y*xres+xres*1]=mix_argb(c1,c3,0.75,0.25);
-                    pixel[x+y*xres+xres*2]=mix_argb(c1,c3,0.50,0.50);
-                    pixel[x+y*xres+xres*3]=mix_argb(c1,c3,0.25,0.75);
-
-                    pixel[x+y*xres+1+xres*1]=mix_argb(mix_argb(c1,c2,0.75,0.25),mix_argb(c3,c4,0.75,0.25),0.75,0.25);
-                    pixel[x+y*xres+1+xres*2]=mix_argb(mix_argb(c1,c2,0.75,0.25),mix_argb(c3,c4,0.75,0.25),0.50,0.50);
-                    pixel[x+y*xres+1+xres*3]=mix_argb(mix_argb(c1,c2,0.75,0.75),mix_argb(c3,c4,0.75,0.25),0.25,0.75);
-
-                    pixel[x+y*xres+2+xres*1]=mix_argb(mix_argb(c1,c2,0.50,0.50),mix_argb(c3,c4,0.50,0.50),0.75,0.25);
-                    pixel[x+y*xres+2+xres*2]=mix_argb(mix_argb(c1,c2,0.50,0.50),mix_argb(c3,c4,0.50,0.50),0.50,0.50);
-                    pixel[x+y*xres+2+xres*3]=mix_argb(mix_argb(c1,c2,0.50,0.50),mix_argb(c3,c4,0.50,0.50),0.25,0.75);
-
-                    pixel[x+y*xres+3+xres*1]=mix_argb(mix_argb(c1,c2,0.25,0.75),mix_argb(c3,c4,0.25,0.75),0.75,0.25);
-                    pixel[x+y*xres+3+xres*2]=mix_argb(mix_argb(c1,c2,0.25,0.75),mix_argb(c3,c4,0.25,0.75),0.50,0.50);
-                    pixel[x+y*xres+3+xres*3]=mix_argb(mix_argb(c1,c2,0.25,0.75),mix_argb(c3,c4,0.25,0.75),0.25,0.75);
-                }
-            }
-            break;
-        default:
-            warn("Unsupported scale %d in sdl_load_image_png()",sdl_scale);
-            break;
+    v=sdl_queue(tex,4,6);
+    for (i=0; i<4; i++) {
+        v[i].position.x=dr->x+((i&1)?dr->w:0);
+        v[i].position.y=dr->y+((i&2)?dr->h:0);
+        v[i].color=col;
+        v[i].tex_coord.x=(float)(sr->x+((i&1)?sr->w:0))/tw;
+        v[i].tex_coord.y=(float)(sr->y+((i&2)?sr->h:0))/th;
     }
+    sdl_queue_index4();
 }
 
-void sdl_premulti(uint32_t *pixel,int xres,int yres,int scale) {
-    int n,r,g,b,a;
-    uint32_t c;
-
-    for (n=0; n<xres*yres; n++) {
-        c=pixel[n];
+// Adds a solid quad in col, with the corners xy as in sdl_queue_index4().
+// While the batch uses an atlas page, it is drawn from the white block on
+// that, so pixels and lines between sprites don't break the batch up.
+// Otherwise it is drawn without a texture.
+static void sdl_queue_solid(const float *xy,SDL_Color col) {
+    SDL_Texture *tex=sdlq_solid?sdlq_tex:NULL;
+    SDL_Vertex *v;
+    float uv;
+    int i;
 
-        a=IGET_A(c);
-        if (!a) continue;
+    uv=tex?SDLA_WHITE/2.0f/sdla_size:0.0f;      // middle of the white block
 
-        r=IGET_R(c);
-        g=IGET_G(c);
-        b=IGET_B(c);
-
-        r=min(255,r*255/a);
-        g=min(255,g*255/a);
-        b=min(255,b*255/a);
-
-        c=IRGBA(r,g,b,a);
-        pixel[n]=c;
+    v=sdl_queue(tex,4,6);
+    for (i=0; i<4; i++) {
+        v[i].position.x=xy[i*2];
+        v[i].position.y=xy[i*2+1];
+        v[i].color=col;
+        v[i].tex_coord.x=v[i].tex_coord.y=uv;
     }
+    sdl_queue_index4();
 }
 
-struct png_helper {
-    char *filename;
-    zip_t *zip;
-    unsigned char **row;
-    int xres;
-    int yres;
-    int bpp;
+// Solid rectangle in real pixels.
+static void sdl_queue_fill(int x,int y,int w,int h,SDL_Color col) {
+    float xy[8];
 
-    png_structp png_ptr;
-    png_infop info_ptr;
-};
+    if (w<1 || h<1) return;
+
+    xy[0]=xy[4]=x; xy[2]=xy[6]=x+w;
+    xy[1]=xy[3]=y; xy[5]=xy[7]=y+h;
 
-void png_helper_read(png_struct *ps,unsigned char *buf,long long unsigned len) {
-    zip_fread(png_get_io_ptr(ps),buf,len);
+    sdl_queue_solid(xy,col);
 }
 
-int png_load_helper(struct png_helper *p) {
-    FILE *fp=NULL;
-    zip_file_t *zp=NULL;
+// Line one pixel wide from x0,y0 to x1,y1, both included, in real pixels.
+// A parallelogram covering one pixel per column, or per row if it's steep.
+static void sdl_queue_line(int x0,int y0,int x1,int y1,SDL_Color col) {
+    float xy[8];
     int tmp;
 
-    if (p->zip) {
-        zp=zip_fopen(p->zip,p->filename,0);
-        if (!zp) return -1;
+    if (abs(x1-x0)>=abs(y1-y0)) {
+        if (x0>x1) { tmp=x0; x0=x1; x1=tmp; tmp=y0; y0=y1; y1=tmp; }
+        xy[0]=xy[4]=x0; xy[2]=xy[6]=x1+1;
+        xy[1]=y0; xy[3]=y1; xy[5]=y0+1; xy[7]=y1+1;
     } else {
-        fp=fopen(p->filename,"rb");
-        if (!fp) return -1;
+        if (y0>y1) { tmp=x0; x0=x1; x1=tmp; tmp=y0; y0=y1; y1=tmp; }
+        xy[0]=x0; xy[2]=x0+1; xy[4]=x1; xy[6]=x1+1;
+        xy[1]=xy[3]=y0; xy[5]=xy[7]=y1+1;
     }
 
-    p->png_ptr=png_create_read_struct(PNG_LIBPNG_VER_STRING,NULL,NULL,NULL);
-    if (!p->png_ptr) { fclose(fp); warn("create read\n"); return -1; }
-
-    p->info_ptr=png_create_info_struct(p->png_ptr);
-    if (!p->info_ptr) { fclose(fp); png_destroy_read_struct(&p->png_ptr,(png_infopp)NULL,(png_infopp)NULL); warn("create info1\n"); return -1; }
-
-    if (p->zip) {
-        png_set_read_fn(p->png_ptr,zp,png_helper_read);
-    } else {
-        png_init_io(p->png_ptr,fp);
-    }
-    png_set_strip_16(p->png_ptr);
-    png_read_png(p->png_ptr,p->info_ptr,PNG_TRANSFORM_PACKING,NULL);
+    sdl_queue_solid(xy,col);
+}
 
-    p->row=png_get_rows(p->png_ptr,p->info_ptr);
-    if (!p->row) { fclose(fp); png_destroy_read_struct(&p->png_ptr,&p->info_ptr,(png_infopp)NULL); warn("read row\n"); return -1; }
+int sdl_clear(void) {
+    sdl_flush();
 
-    p->xres=png_get_image_width(p->png_ptr,p->info_ptr);
-    p->yres=png_get_image_height(p->png_ptr,p->info_ptr);
+    //SDL_SetRenderDrawColor(sdlren,255,63,63,255);     // clear with bright red to spot broken sprites
+    SDL_SetRenderDrawColor(sdlren,0,0,0,255);
+    SDL_RenderClear(sdlren);
+    //note("mem: %.2fM PNG, %.2fM Tex, Hit: %ld, Miss: %ld, Probe: %d\n",mem_png/(1024.0*1024.0),mem_tex/(1024.0*1024.0),texc_hit,texc_miss,texc_probe_max);
+    return 1;
+}
 
-    tmp=png_get_rowbytes(p->png_ptr,p->info_ptr);
+int sdl_render(void) {
+    sdl_flush();
+    SDL_RenderPresent(sdlren);
+    sdl_frames++;
+    sdl_drawcalls=sdlq_calls;
+    sdlq_calls=0;
+    return 1;
+}
 
-    if (tmp==p->xres*3) p->bpp=24;
-    else if (tmp==p->xres*4) p->bpp=32;
-    else { fclose(fp); png_destroy_read_struct(&p->png_ptr,&p->info_ptr,(png_infopp)NULL); warn("rowbytes!=xres*4 (%d, %d, %s)",tmp,p->xres,p->filename); return -1; }
+static inline long long sdl_ic_bytes(struct sdl_image *si) {
+    if (si->flags&SI_SPANS) return (long long)si->size*sizeof(uint32_t);
+    return (long long)si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale;
+}
 
-    if (png_get_bit_depth(p->png_ptr,p->info_ptr)!=8) { fclose(fp); png_destroy_read_struct(&p->png_ptr,&p->info_ptr,(png_infopp)NULL); warn("bit depth!=8\n"); return -1; }
-    if (png_get_channels(p->png_ptr,p->info_ptr)!=p->bpp/8) { fclose(fp); png_destroy_read_struct(&p->png_ptr,&p->info_ptr,(png_infopp)NULL); warn("channels!=format\n"); return -1; }
+static void sdl_ic_unlink(int sprite) {
+    struct sdl_image *si=sdli+sprite;
 
-    if (p->zip) zip_fclose(zp);
-    else fclose(fp);
+    if (si->prev==SIDX_NONE) sdli_best=si->next;
+    else sdli[si->prev].next=si->next;
 
-    return 0;
+    if (si->next==SIDX_NONE) sdli_last=si->prev;
+    else sdli[si->next].prev=si->prev;
 }
 
-void png_load_helper_exit(struct png_helper *p) {
-    png_destroy_read_struct(&p->png_ptr,&p->info_ptr,(png_infopp)NULL);
-}
+static void sdl_ic_front(int sprite) {
+    struct sdl_image *si=sdli+sprite;
 
-// Load high res PNG
-int sdl_load_image_png_(struct sdl_image *si,char *filename,zip_t *zip) {
-    int x,y,r,g,b,a,sx,sy,ex,ey;
-    uint32_t c;
-    struct png_helper p;
+    si->prev=SIDX_NONE;
+    si->next=sdli_best;
 
-    p.zip=zip;
-    p.filename=filename;
-    if (png_load_helper(&p)) return -1;
+    if (sdli_best!=SIDX_NONE) sdli[sdli_best].prev=sprite;
+    else sdli_last=sprite;
 
-    // prescan
-    sx=p.xres;
-    sy=p.yres;
-    ex=0;
-    ey=0;
-
-    for (y=0; y<p.yres; y++) {
-        for (x=0; x<p.xres; x++) {
-            if (p.bpp==32 && (p.row[y][x*4+3]==0 || (p.row[y][x*4+0]==255 && p.row[y][x*4+1]==0 && p.row[y][x*4+2]==255))) continue;
-            if (p.bpp==24 && ((p.row[y][x*3+0]==255 && p.row[y][x*3+1]==0 && p.row[y][x*3+2]==255))) continue;
-            if (x<sx) sx=x;
-            if (x>ex) ex=x;
-            if (y<sy) sy=y;
-            if (y>ey) ey=y;
-        }
-    }
-
-    // Make sure the new found borders of the image are on multiples
-    // of sd_scale. And never shrink the visible portion to do that.
-    sx=(sx/sdl_scale)*sdl_scale;
-    sy=(sy/sdl_scale)*sdl_scale;
-    ex=((ex+sdl_scale)/sdl_scale)*sdl_scale;
-    ey=((ey+sdl_scale)/sdl_scale)*sdl_scale;
+    sdli_best=sprite;
+}
 
-    if (ex<sx) ex=sx-1;
-    if (ey<sy) ey=sy-1;
+// Frees the least recently used images nobody is reading until the rest
+// fits into the budget. Mapped images are not on the list, they cost no
+// memory of ours. Called with premutex held.
+static void sdl_ic_trim(void) {
+    struct sdl_image *si;
+    int sprite,prev;
 
-    // write
-    si->flags=1;
-    si->xres=ex-sx;
-    si->yres=ey-sy;
-    si->xoff=-(p.xres/2)+sx;
-    si->yoff=-(p.yres/2)+sy;
+    for (sprite=sdli_last; sprite!=SIDX_NONE && mem_png>sdli_budget; sprite=prev) {
+        si=sdli+sprite;
+        prev=si->prev;
+        if (si->ref) continue;
 
+        sdl_ic_unlink(sprite);
+        mem_png-=sdl_ic_bytes(si);
 #ifdef SDL_FAST_MALLOC
-    si->pixel=malloc(si->xres*si->yres*sizeof(uint32_t));
+        free(si->pixel);
 #else
-    si->pixel=xmalloc(si->xres*si->yres*sizeof(uint32_t),MEM_SDL_PNG);
+        xfree(si->pixel);
 #endif
-    mem_png+=si->xres*si->yres*sizeof(uint32_t);
-
-    for (y=0; y<si->yres; y++) {
-        for (x=0; x<si->xres; x++) {
-
-            if (p.bpp==32) {
-                if (sx+x>=p.xres || sy+y>=p.yres) r=g=b=a=0;
-                else {
-                    r=p.row[(sy+y)][(sx+x)*4+0];
-                    g=p.row[(sy+y)][(sx+x)*4+1];
-                    b=p.row[(sy+y)][(sx+x)*4+2];
-                    a=p.row[(sy+y)][(sx+x)*4+3];
-                }
-            } else {
-                if (sx+x>=p.xres || sy+y>=p.yres) r=g=b=a=0;
-                else {
-                    r=p.row[(sy+y)][(sx+x)*3+0];
-                    g=p.row[(sy+y)][(sx+x)*3+1];
-                    b=p.row[(sy+y)][(sx+x)*3+2];
-                    if (r==255 && g==0 && b==255) a=0;
-                    else a=255;
-                }
-            }
-
-            if (r==255 && g==0 && b==255) a=0;
-
-            if (a) {    // pre-multiply rgb channel by alpha
-                r=min(255,r*255/a);
-                g=min(255,g*255/a);
-                b=min(255,b*255/a);
-            } else r=g=b=0;
-
-            c=IRGBA(r,g,b,a);
-
-            si->pixel[x+y*si->xres]=c;
-        }
+        si->pixel=NULL;
+        si->flags=0;
+        sdli_evict++;
     }
-
-    png_load_helper_exit(&p);
-
-    si->xres/=sdl_scale;
-    si->yres/=sdl_scale;
-    si->xoff/=sdl_scale;
-    si->yoff/=sdl_scale;
-
-    return 0;
 }
 
-// Load and up-scale low res PNG
-// TODO: add support for using a 2X image as a base for 4X
-// and possibly the other way around too
-int sdl_load_image_png(struct sdl_image *si,char *filename,zip_t *zip,int smoothify) {
-    int x,y,r,g,b,a,sx,sy,ex,ey;
-    uint32_t c;
-    struct png_helper p;
+// Loads the image for sprite using the archive handles z, and makes it
+// visible to everybody else. ref is added to the reference count right
+// away, so it can't be evicted before the caller gets to use it.
+static int sdl_ic_decode(int sprite,struct sdl_zips *z,int ref) {
+    struct sdl_image si;
+    struct sdl_image *dst=sdli+sprite;
+    int err;
 
-    p.zip=zip;
-    p.filename=filename;
-    if (png_load_helper(&p)) return -1;
+    bzero(&si,sizeof(si));
+    if (sdl_icache_get(sprite,&si)) {
+        err=sdl_load_image(&si,sprite,z);
+        if (!err && !(si.flags&SI_MAPPED)) sdl_icache_put(sprite,&si);
+    } else err=0;
+    if (!err) sdl_span_image(&si);
 
-    // prescan
-    sx=p.xres;
-    sy=p.yres;
-    ex=0;
-    ey=0;
-
-    for (y=0; y<p.yres; y++) {
-        for (x=0; x<p.xres; x++) {
-            if (p.bpp==32 && (p.row[y][x*4+3]==0 || (p.row[y][x*4+0]==255 && p.row[y][x*4+1]==0 && p.row[y][x*4+2]==255))) continue;
-            if (p.bpp==24 && ((p.row[y][x*3+0]==255 && p.row[y][x*3+1]==0 && p.row[y][x*3+2]==255))) continue;
-            if (x<sx) sx=x;
-            if (x>ex) ex=x;
-            if (y<sy) sy=y;
-            if (y>ey) ey=y;
+    if (sdl_multi) SDL_LockMutex(premutex);
+    if (!err) {
+        dst->pixel=si.pixel;
+        dst->xres=si.xres;
+        dst->yres=si.yres;
+        dst->xoff=si.xoff;
+        dst->yoff=si.yoff;
+        dst->size=si.size;
+        dst->flags=si.flags;
+        if (!(si.flags&SI_MAPPED)) {
+            mem_png+=sdl_ic_bytes(dst);
+            sdl_ic_front(sprite);
         }
     }
-
-    if (ex<sx) ex=sx-1;
-    if (ey<sy) ey=sy-1;
-
-    // write
-    si->flags=1;
-    si->xres=ex-sx+1;
-    si->yres=ey-sy+1;
-    si->xoff=-(p.xres/2)+sx;
-    si->yoff=-(p.yres/2)+sy;
-
-#ifdef SDL_FAST_MALLOC
-    si->pixel=malloc(si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale);
-#else
-    si->pixel=xmalloc(si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale,MEM_SDL_PNG);
-#endif
-    mem_png+=si->xres*si->yres*sizeof(uint32_t);
-
-    for (y=0; y<si->yres; y++) {
-        for (x=0; x<si->xres; x++) {
-
-            if (p.bpp==32) {
-                r=p.row[(sy+y)][(sx+x)*4+0];
-                g=p.row[(sy+y)][(sx+x)*4+1];
-                b=p.row[(sy+y)][(sx+x)*4+2];
-                a=p.row[(sy+y)][(sx+x)*4+3];
-            } else {
-                r=p.row[(sy+y)][(sx+x)*3+0];
-                g=p.row[(sy+y)][(sx+x)*3+1];
-                b=p.row[(sy+y)][(sx+x)*3+2];
-                if (r==255 && g==0 && b==255) a=0;
-                else a=255;
-            }
-
-            if (r==255 && g==0 && b==255) a=0;
-
-            if (!a) // don't pre-multiply rgb channel by alpha because that needs to happen after scaling
-                r=g=b=0;
-
-            c=IRGBA(r,g,b,a);
-
-            switch (sdl_scale) {
-                case 1:
-                    si->pixel[x+y*si->xres]=c;
-                    break;
-                case 2:
-                    si->pixel[x*2+y*si->xres*4]=c;
-                    si->pixel[x*2+y*si->xres*4+1]=c;
-                    si->pixel[x*2+y*si->xres*4+si->xres*2]=c;
-                    si->pixel[x*2+y*si->xres*4+1+si->xres*2]=c;
-                    break;
-                case 3:
-                    si->pixel[x*3+y*si->xres*9+0]=c;
-                    si->pixel[x*3+y*si->xres*9+0+si->xres*3]=c;
-                    si->pixel[x*3+y*si->xres*9+0+si->xres*6]=c;
-
-                    si->pixel[x*3+y*si->xres*9+1]=c;
-                    si->pixel[x*3+y*si->xres*9+1+si->xres*3]=c;
-                    si->pixel[x*3+y*si->xres*9+1+si->xres*6]=c;
-
-                    si->pixel[x*3+y*si->xres*9+2]=c;
-                    si->pixel[x*3+y*si->xres*9+2+si->xres*3]=c;
-                    si->pixel[x*3+y*si->xres*9+2+si->xres*6]=c;
-                    break;
-                case 4:
-                    si->pixel[x*4+y*si->xres*16+0]=c;
-                    si->pixel[x*4+y*si->xres*16+0+si->xres*4]=c;
-                    si->pixel[x*4+y*si->xres*16+0+si->xres*8]=c;
-                    si->pixel[x*4+y*si->xres*16+0+si->xres*12]=c;
-
-                    si->pixel[x*4+y*si->xres*16+1]=c;
-                    si->pixel[x*4+y*si->xres*16+1+si->xres*4]=c;
-                    si->pixel[x*4+y*si->xres*16+1+si->xres*8]=c;
-                    si->pixel[x*4+y*si->xres*16+1+si->xres*12]=c;
-
-                    si->pixel[x*4+y*si->xres*16+2]=c;
-                    si->pixel[x*4+y*si->xres*16+2+si->xres*4]=c;
-                    si->pixel[x*4+y*si->xres*16+2+si->xres*8]=c;
-                    si->pixel[x*4+y*si->xres*16+2+si->xres*12]=c;
-
-                    si->pixel[x*4+y*si->xres*16+3]=c;
-                    si->pixel[x*4+y*si->xres*16+3+si->xres*4]=c;
-                    si->pixel[x*4+y*si->xres*16+3+si->xres*8]=c;
-                    si->pixel[x*4+y*si->xres*16+3+si->xres*12]=c;
-                    break;
-                default:
-                    warn("Unsupported scale %d in sdl_load_image_png()",sdl_scale);
-                    break;
-            }
-        }
+    if (err==SDL_IMG_NOGFX) SDL_AtomicSet(&sdl_nogfx,1);
+    dst->ref+=ref;
+    dst->load=SIL_NONE;
+    sdl_ic_trim();
+    if (sdl_multi) {
+        SDL_CondBroadcast(predone);
+        SDL_UnlockMutex(premutex);
     }
 
-    if (sdl_scale>1 && smoothify) {
-        sdl_smoothify(si->pixel,si->xres*sdl_scale,si->yres*sdl_scale,sdl_scale);
-        sdl_premulti(si->pixel,si->xres*sdl_scale,si->yres*sdl_scale,sdl_scale);
-    } else sdl_premulti(si->pixel,si->xres*sdl_scale,si->yres*sdl_scale,sdl_scale);
-
-    png_load_helper_exit(&p);
-
-    return 0;
+    return err;
 }
 
+// Tells the user the graphics are missing and quits, if loading an image
+// found so. Main thread only, images get loaded by the workers as well.
+static void sdl_gfx_check(void) {
+    if (!SDL_AtomicGet(&sdl_nogfx)) return;
 
-int do_smoothify(int sprite) {
+    display_messagebox("Graphics Not Found","The client could not locate the graphics file gx1.zip. "
+                       "Please make sure you start the client from the main folder, "
+                       "not from within the bin-folder.\n\n"
+                       "You can create a shortcut with the working directory set to the main folder.");
+    exit(105);
+}
 
-    // TODO: add more to this list
-    if (sprite>=50 && sprite<=56) return 0;
-    if (sprite>0 && sprite<=1000) return 1;         // GUI
-    if (sprite>=10000 && sprite<11000) return 1;    // items
-    if (sprite>=11000 && sprite<12000) return 1;    // coffin, berries, farn, ...
-    if (sprite>=13000 && sprite<14000) return 1;    // bones and towers, ...
-    if (sprite>=16000 && sprite<17000) return 1;    // cameron doors, carts, ...
-    if (sprite>=20025 && sprite<20034) return 1;    // torches
-    if (sprite>=20042 && sprite<20082) return 1;    // torches
-    if (sprite>=20086 && sprite<20119) return 1;    // chests, chairs
+// The archive handles for worker, -1 being the main thread.
+static struct sdl_zips *sdl_ic_zips(int worker) {
+    struct sdl_zips *z=sdl_zips+worker+1;
 
-    if (sprite>=100000) return 1;                   // all character sprites
+    if (!z->open) sdl_zip_open(z);
 
-    return 0;
+    return z;
 }
 
-int sdl_load_image(struct sdl_image *si,int sprite) {
-    char filename[1024];
+// Job: load the image for a sprite, unless somebody else got to it first.
+static void sdl_ic_job(void *data,int worker) {
+    int sprite=(int)(long long)data;
 
-    if (sprite>MAXSPRITE || sprite<0) {
-        note("sdl_load_image: illegal sprite %d wanted",sprite);
-        return -1;
+    if (sdl_multi) SDL_LockMutex(premutex);
+    if (sdli[sprite].load!=SIL_QUEUED) {
+        if (sdl_multi) SDL_UnlockMutex(premutex);
+        return;
     }
+    sdli[sprite].load=SIL_BUSY;
+    if (sdl_multi) SDL_UnlockMutex(premutex);
 
-#if 0
-    // get patch png
-    sprintf(filename,"../gfxp/x%d/%08d/%08d.png",sdl_scale,(sprite/1000)*1000,sprite);
-    if (sdl_load_image_png_(si,filename,NULL)==0) return 0;
-#endif
+    sdl_ic_decode(sprite,sdl_ic_zips(worker),0);
+}
 
-    // get high res from archive
-    if (sdl_zip2 || sdl_zip2p || sdl_zip2m) {
-        sprintf(filename,"%08d.png",sprite);
-        if (sdl_zip2m && sdl_load_image_png_(si,filename,sdl_zip2m)==0) return 0;    // check mod archive first
-        if (sdl_zip2p && sdl_load_image_png_(si,filename,sdl_zip2p)==0) return 0;    // check patch archive second
-        if (sdl_zip2 && sdl_load_image_png_(si,filename,sdl_zip2)==0) return 0;     // check base archive third
-    }
+// Has the image for sprite loaded in the background. Returns 1 if it is
+// ready to be used, 0 if it is still on its way.
+static int sdl_ic_prefetch(int sprite) {
+    int ready,queue=0;
 
-#if 0
-    // get high res from base png folder
-    sprintf(filename,"../gfx/x%d/%08d/%08d.png",sdl_scale,(sprite/1000)*1000,sprite);
-    if (sdl_load_image_png_(si,filename,NULL)==0) return 0;
-#endif
+    if (sprite>=MAXSPRITE || sprite<0) return 1;    // sdl_ic_get() will complain
 
-    // get standard from archive
-    if (sdl_zip1 || sdl_zip1p || sdl_zip1m) {
-        sprintf(filename,"%08d.png",sprite);
-        if (sdl_zip1m && sdl_load_image_png(si,filename,sdl_zip1m,do_smoothify(sprite))==0) return 0;
-        if (sdl_zip1p && sdl_load_image_png(si,filename,sdl_zip1p,do_smoothify(sprite))==0) return 0;
-        if (sdl_zip1 && sdl_load_image_png(si,filename,sdl_zip1,do_smoothify(sprite))==0) return 0;
+    if (sdl_multi) SDL_LockMutex(premutex);
+    ready=(sdli[sprite].flags!=0);
+    if (!ready && sdli[sprite].load==SIL_NONE) {
+        sdli[sprite].load=SIL_QUEUED;
+        queue=1;
     }
+    if (sdl_multi) SDL_UnlockMutex(premutex);
 
-#if 0
-    // get standard from base png folder
-    sprintf(filename,"../gfx/x1/%08d/%08d.png",(sprite/1000)*1000,sprite);
-    if (sdl_load_image_png(si,filename,NULL,do_smoothify(sprite))==0) return 0;
-    sprintf(filename,"../gfxp/x1/%08d/%08d.png",(sprite/1000)*1000,sprite);
-    if (sdl_load_image_png(si,filename,NULL,do_smoothify(sprite))==0) return 0;
-#endif
-
-    sprintf(filename,"%08d.png",sprite);
-    warn("%s not found",filename);
-
-    // get unknown sprite image
-    sprintf(filename,"%08d.png",2);
-    if (sdl_zip1 && sdl_load_image_png(si,filename,sdl_zip1,do_smoothify(sprite))==0) return 0;
+    if (queue) sdl_job_submit(sdl_ic_job,(void *)(long long)sprite);
 
-    char *txt="The client could not locate the graphics file gx1.zip. "
-        "Please make sure you start the client from the main folder, "
-        "not from within the bin-folder.\n\n"
-        "You can create a shortcut with the working directory set to the main folder.";
-    display_messagebox("Graphics Not Found",txt);
-    exit(105);
-    return -1;
+    return ready;
 }
 
-int sdl_ic_load(int sprite) {
+// Gets the image for sprite and holds on to it until sdl_ic_put(), it
+// won't be evicted while the pixels are in use. Loads the image right now
+// if need be. If a worker is busy loading it, waits for that instead.
+// Images which are only queued are loaded here, the job will find them
+// done. worker is the background worker calling, -1 for the main thread.
+// Every call needs a matching sdl_ic_put(), even if it failed.
+static int sdl_ic_get(int sprite,int worker) {
+    struct sdl_image *si=sdli+sprite;
     uint64_t start;
 
     start=SDL_GetTicks64();
 
-    if (sprite>=MAXSPRITE || sprite<0) {
-        note("illegal sprite %d wanted in sdl_ic_load",sprite);
-        return -1;
+    if (sdl_multi) SDL_LockMutex(premutex);
+    while (!si->flags && si->load==SIL_BUSY) SDL_CondWait(predone,premutex);
+    if (si->flags) {
+        si->ref++;
+        if (!(si->flags&SI_MAPPED) && sdli_best!=sprite) {
+            sdl_ic_unlink(sprite);
+            sdl_ic_front(sprite);
+        }
+        if (sdl_multi) SDL_UnlockMutex(premutex);
+        return 0;
     }
-    if (sdli[sprite].flags) return sprite;
-
-    if (sdl_load_image(sdli+sprite,sprite)) return -1;
-
-    sdl_time_load+=SDL_GetTicks64()-start;
-
-    return sprite;
-}
-
-#define DDFX_MAX_FREEZE         8
-
-static inline int light_calc(int val,int light) {
-    int v1,v2,m=3,d=4;
+    si->load=SIL_BUSY;
+    if (sdl_multi) SDL_UnlockMutex(premutex);
 
-    if (game_options&(GO_LIGHTER|GO_LIGHTER2)) {
-        v1=val*light/15;
-        v2=val*sqrt(light)/3.87;
-        if (game_options&GO_LIGHTER) { m--; d--; }
-        if (game_options&GO_LIGHTER2) { m-=2; d-=2; }
-        return (v1*m+v2)/d;
-    } else return val*light/15;
-}
+    if (sdl_ic_decode(sprite,sdl_ic_zips(worker),1)) return -1;
 
-static inline uint32_t sdl_light(int light,uint32_t irgb) {
-    int r,g,b,a;
+    if (worker==-1) sdl_time_load+=SDL_GetTicks64()-start;
 
-    r=IGET_R(irgb);
-    g=IGET_G(irgb);
-    b=IGET_B(irgb);
-    a=IGET_A(irgb);
-
-    if (light==0) {
-        r=min(255,r*2+4);
-        g=min(255,g*2+4);
-        b=min(255,b*2+4);
-    } else {
-        r=light_calc(r,light);
-        g=light_calc(g,light);
-        b=light_calc(b,light);
-    }
-
-    return IRGBA(r,g,b,a);
+    return 0;
 }
 
-static inline uint32_t sdl_freeze(int freeze,uint32_t irgb) {
-    int r,g,b,a;
-
-    r=IGET_R(irgb);
-    g=IGET_G(irgb);
-    b=IGET_B(irgb);
-    a=IGET_A(irgb);
-
-    r=min(255,r+255*freeze/(3*DDFX_MAX_FREEZE-1));
-    g=min(255,g+255*freeze/(3*DDFX_MAX_FREEZE-1));
-    b=min(255,b+255*3*freeze/(3*DDFX_MAX_FREEZE-1));
-
-    return IRGBA(r,g,b,a);
+static void sdl_ic_put(int sprite) {
+    if (sdl_multi) SDL_LockMutex(premutex);
+    sdli[sprite].ref--;
+    if (!sdli[sprite].ref) sdl_ic_trim();
+    if (sdl_multi) SDL_UnlockMutex(premutex);
 }
 
-
 #define REDCOL		(0.40)
 #define GREENCOL	(0.70)
 #define BLUECOL		(0.70)
@@ -848,28 +711,6 @@ static inline uint32_t sdl_freeze(int freeze,uint32_t irgb) {
 #define OGET_B(c) ((((unsigned short int)(c))>>0)&0x1F)
 
 
-static uint32_t sdl_shine_pix(uint32_t irgb,unsigned short shine) {
-    int a;
-    double r,g,b;
-
-    r=IGET_R(irgb)/127.5;
-    g=IGET_G(irgb)/127.5;
-    b=IGET_B(irgb)/127.5;
-    a=IGET_A(irgb);
-
-    r=((r*r*r*r)*shine+r*(100.0-shine))/200.0;
-    g=((g*g*g*g)*shine+g*(100.0-shine))/200.0;
-    b=((b*b*b*b)*shine+b*(100.0-shine))/200.0;
-
-    if (r>1.0) r=1.0;
-    if (g>1.0) g=1.0;
-    if (b>1.0) b=1.0;
-
-    irgb=IRGBA((int)(r*255.0),(int)(g*255.0),(int)(b*255.0),a);
-
-    return irgb;
-}
-
 static uint32_t sdl_colorize_pix(uint32_t irgb,unsigned short c1v,unsigned short c2v,unsigned short c3v) {
     double rf,gf,bf,m,rm,gm,bm;
     double c1=0,c2=0,c3=0;
@@ -1029,56 +870,548 @@ static uint32_t sdl_colorize_pix2(uint32_t irgb,unsigned short c1v,unsigned shor
     return irgb;
 }
 
-static uint32_t sdl_colorbalance(uint32_t irgb,char cr,char cg,char cb,char light,char sat) {
-    int r,g,b,a,grey;
+// Memory used by a texture, at the real (scaled) resolution. Counted from
+// the allocation of the pixel buffer until the entry is evicted, since the
+// texture takes the place of the buffer.
+static inline long long sdl_tx_bytes(struct sdl_texture *st) {
+    return (long long)st->xres*st->yres*sizeof(uint32_t)*sdl_scale*sdl_scale;
+}
 
-    r=IGET_R(irgb);
-    g=IGET_G(irgb);
-    b=IGET_B(irgb);
-    a=IGET_A(irgb);
+// Opens a new shelf of height h on page n. Returns its index, or -1 if the
+// page is full.
+static int sdl_atlas_shelf(int n,int h) {
+    struct sdl_page *pg=sdla+n;
+    struct sdl_shelf *sh;
+
+    if (pg->top+h>sdla_size || pg->nshelf>=SDLA_SHELVES) return -1;
+
+    sh=pg->shelf+pg->nshelf;
+    sh->y=pg->top;
+    sh->h=h;
+    sh->x=0;
+    sh->live=0;
+    pg->top+=h;
+
+    return pg->nshelf++;
+}
+
+// Finds room for the texture of st on one of the atlas pages, one pixel
+// apart from its neighbours. Shelves of the same height are tried first,
+// then a new shelf, then a new page. Returns -1 if st has to get a texture
+// of its own.
+static int sdl_atlas_alloc(struct sdl_texture *st) {
+    struct sdl_page *pg;
+    struct sdl_shelf *sh;
+    uint32_t white[SDLA_WHITE*SDLA_WHITE];
+    SDL_Rect rc;
+    int n,i,w,h,sh_h;
+
+    if (!sdla) return -1;
+
+    w=st->xres*sdl_scale+1;
+    h=st->yres*sdl_scale+1;
+    if (w>sdla_size/SDLA_MAXDIM || h>sdla_size/SDLA_MAXDIM) return -1;
+
+    sh_h=(h+SDLA_ROUND-1)/SDLA_ROUND*SDLA_ROUND;
 
-    // lightness
-    if (light) {
-        r+=light; g+=light; b+=light;
+    for (n=0; n<sdla_pages; n++) {
+        pg=sdla+n;
+        for (i=0; i<pg->nshelf; i++)
+            if (pg->shelf[i].h==sh_h && pg->shelf[i].x+w<=sdla_size) goto found;
     }
+    for (n=0; n<sdla_pages; n++)
+        if ((i=sdl_atlas_shelf(n,sh_h))!=-1) goto found;
+
+    if (sdla_pages<sdla_maxpage) {
+        n=sdla_pages;
+        sdla[n].tex=SDL_CreateTexture(sdlren,SDL_PIXELFORMAT_ARGB8888,SDL_TEXTUREACCESS_STATIC,sdla_size,sdla_size);
+        if (!sdla[n].tex) {
+            warn("SDL_texture Error: %s in atlas page %d",SDL_GetError(),n);
+            sdla_maxpage=n;
+            return -1;
+        }
+        SDL_SetTextureBlendMode(sdla[n].tex,SDL_BLENDMODE_BLEND);
+
+        // solid quads are drawn from this, the shelves start below
+        memset(white,255,sizeof(white));
+        rc.x=rc.y=0; rc.w=rc.h=SDLA_WHITE;
+        SDL_UpdateTexture(sdla[n].tex,&rc,white,SDLA_WHITE*sizeof(uint32_t));
+        sdla[n].top=SDLA_WHITE+1;
+        sdla_pages++;
 
-    // saturation
-    if (sat) {
-        grey=(r+g+b)/3;
-        r=((r*(20-sat))+(grey*sat))/20;
-        g=((g*(20-sat))+(grey*sat))/20;
-        b=((b*(20-sat))+(grey*sat))/20;
+        i=sdl_atlas_shelf(n,sh_h);
+        goto found;
     }
 
-    // color balancing
-    cr*=0.75; cg*=0.75; cg*=0.75;
+    sdla_full=1;
+    return -1;
 
-    r+=cr; g-=cr/2; b-=cr/2;
-    r-=cg/2; g+=cg; b-=cg/2;
-    r-=cb/2; g-=cb/2; b+=cb;
+found:
+    pg=sdla+n;
+    sh=pg->shelf+i;
 
-    if (r<0) r=0;
-    if (g<0) g=0;
-    if (b<0) b=0;
+    st->page=n;
+    st->shelf=i;
+    st->ax=sh->x;
+    st->ay=sh->y;
 
-    if (r>255) { g+=(r-255)/2; b+=(r-255)/2; r=255; }
-    if (g>255) { r+=(g-255)/2; b+=(g-255)/2; g=255; }
-    if (b>255) { r+=(b-255)/2; g+=(b-255)/2; b=255; }
+    sh->x+=w;
+    sh->live++;
+    pg->live++;
+    pg->area+=w*h;
 
-    if (r>255) r=255;
-    if (g>255) g=255;
-    if (b>255) b=255;
+    return 0;
+}
 
-    irgb=IRGBA(r,g,b,a);
+// Gives the room taken by st back. An empty shelf gets filled from the left
+// again, empty shelves at the bottom of the page are given up.
+static void sdl_atlas_free(struct sdl_texture *st) {
+    struct sdl_page *pg=sdla+st->page;
+    struct sdl_shelf *sh=pg->shelf+st->shelf;
 
-    return irgb;
+    sh->live--;
+    pg->live--;
+    pg->area-=(st->xres*sdl_scale+1)*(st->yres*sdl_scale+1);
+
+    if (!sh->live) sh->x=0;
+
+    while (pg->nshelf && !pg->shelf[pg->nshelf-1].live) {
+        pg->nshelf--;
+        pg->top=pg->shelf[pg->nshelf].y;
+    }
+}
+
+// source pixels and weight for one row or column of a scaled sprite
+struct sdl_tap {
+    int i0,i1;          // the two source pixels
+    int w;              // weight of i1, 0 to 256
+};
+
+// Calculates the taps for cnt destination pixels scaled by scale percent
+// from a source of size pixels.
+static struct sdl_tap *sdl_make_taps(int cnt,int scale,int size) {
+    int n;
+    double i;
+    struct sdl_tap *tap;
+
+#ifdef SDL_FAST_MALLOC
+    tap=malloc(cnt*sizeof(struct sdl_tap));
+#else
+    tap=xmalloc(cnt*sizeof(struct sdl_tap),MEM_TEMP);
+#endif
+
+    for (n=0; n<cnt; n++) {
+        i=n*100.0/scale;
+        if (ceil(i)>=size) i=size-1.001;
+        if (i<0) i=0;
+
+        tap[n].i0=floor(i);
+        tap[n].i1=ceil(i);
+        tap[n].w=(int)((i-floor(i))*256.0+0.5);
+    }
+    return tap;
+}
+
+// Linear interpolation between two ARGB pixels, w=0 gives a, w=256 gives b.
+// Works on two channels at once, which fits since 255*256 needs only 16 bits.
+static inline uint32_t sdl_lerp(uint32_t a,uint32_t b,int w) {
+    uint32_t rb,ag;
+
+    rb=((a&0x00ff00ff)*(256-w)+(b&0x00ff00ff)*w)>>8;
+    ag=(((a>>8)&0x00ff00ff)*(256-w)+((b>>8)&0x00ff00ff)*w)>>8;
+
+    return (rb&0x00ff00ff)|((ag<<8)&0xff00ff00);
+}
+
+// Returns a colorized copy of the source pixels. Used for scaled sprites,
+// which would otherwise colorize each source pixel up to four times.
+static uint32_t *sdl_make_colorized(struct sdl_texture *st,struct sdl_image *si,uint32_t *src) {
+    int x,y,sx,sy;
+    uint32_t *pixel;
+
+    sx=si->xres*sdl_scale;
+    sy=si->yres*sdl_scale;
+
+#ifdef SDL_FAST_MALLOC
+    pixel=malloc(sx*sy*sizeof(uint32_t));
+#else
+    pixel=xmalloc(sx*sy*sizeof(uint32_t),MEM_TEMP);
+#endif
+
+    for (y=0; y<sy; y++)
+        for (x=0; x<sx; x++)
+            pixel[x+y*sx]=sdl_colorize_pix2(src[x+y*sx],st->c1,st->c2,st->c3,x,y,si->xres,si->yres,src,st->sprite);
+
+    return pixel;
+}
+
+// Colour balance and shine for cnt pixels. Together with colorizing and
+// scaling this makes the base image, see sdl_base_get().
+static void sdl_make_tint(struct sdl_texture *st,uint32_t *pixel,int cnt) {
+    if (st->cr || st->cg || st->cb || st->light || st->sat) sdl_shader.colorbalance(pixel,cnt,st->cr,st->cg,st->cb,st->light,st->sat);
+    if (st->shine) sdl_shader.shine(pixel,cnt,st->shine);
+}
+
+// Light, sink and freeze for cnt pixels of row y, starting at column x. This
+// is what turns a base image into one of its lit variants.
+static void sdl_make_light(struct sdl_texture *st,uint32_t *pixel,int cnt,int x,int y,int sink,int shaded) {
+    int n,mw;
+    const int32_t *wgt;
+
+    if (shaded) {
+        wgt=sdl_light_mask(y,&mw);
+        n=min(max(0,mw-x),cnt);
+        if (n) sdl_shader.light5(pixel,n,wgt+x,mw,st->ml,st->ll,st->rl,st->ul,st->dl);
+        if (n<cnt) sdl_shader.light(pixel+n,cnt-n,st->ml);  // only the middle light is left out here
+    } else sdl_shader.light(pixel,cnt,st->ml);
+
+    if (sink) {
+        if (st->yres*sdl_scale-sink*sdl_scale<y) {
+            for (n=0; n<cnt; n++) pixel[n]&=0xffffff;    // zero alpha to make it transparent
+        }
+    }
+
+    if (st->freeze) sdl_shader.freeze(pixel,cnt,st->freeze);
+}
+
+// Shades cnt pixels of row y, starting at column x. Everything here works
+// pixel by pixel, so a row can be done in one go or in pieces. Without lit
+// only the base image steps are done.
+static void sdl_make_shade(struct sdl_texture *st,uint32_t *pixel,int cnt,int x,int y,int sink,int shaded,int lit) {
+    sdl_make_tint(st,pixel,cnt);
+    if (lit) sdl_make_light(st,pixel,cnt,x,y,sink,shaded);
+}
+
+// Makes an unscaled sprite from a span image into dst. Only the stored pixels
+// get shaded, the transparent ones stay zero. Colorizing must not need the
+// neighbouring pixels here, see sdl_colorize_pix2().
+static void sdl_make_spans(struct sdl_texture *st,struct sdl_image *si,uint32_t *dst,int sink,int shaded,int lit) {
+    const uint32_t *src=si->pixel,*end=si->pixel+si->size;
+    uint32_t *pixel;
+    int x,y,i,n,cnt,dx;
+    long long pos=0;
+
+    dx=st->xres*sdl_scale;
+    bzero(dst,(long long)dx*st->yres*sdl_scale*sizeof(uint32_t));
+
+    while (src<end) {
+        pos+=*src>>16;
+        n=*src&0xffff;
+        src++;
+
+        // split the run at the end of each row
+        while (n) {
+            y=pos/dx;
+            x=pos%dx;
+            cnt=min(n,dx-x);
+            pixel=dst+pos;
+
+            if (st->c1 || st->c2 || st->c3) {
+                for (i=0; i<cnt; i++) pixel[i]=sdl_colorize_pix2(src[i],st->c1,st->c2,st->c3,x+i,y,si->xres,si->yres,NULL,st->sprite);
+            } else memcpy(pixel,src,cnt*sizeof(uint32_t));
+
+            sdl_make_shade(st,pixel,cnt,x,y,sink,shaded,lit);
+
+            pos+=cnt;
+            src+=cnt;
+            n-=cnt;
+        }
+    }
+}
+
+// Makes the pixels of st from the image si into dst, scaled by scale percent.
+// Without lit the light, sink and freeze are left out, which gives the base
+// image.
+static void sdl_make_pixels(struct sdl_texture *st,struct sdl_image *si,int scale,uint32_t *dst,int sink,int shaded,int lit) {
+    int x,y,dx,colorize;
+    uint32_t irgb,*row,*src,*pix;
+    struct sdl_tap *xtap,*ytap;
+
+    dx=st->xres*sdl_scale;
+    colorize=(st->c1 || st->c2 || st->c3);
+
+    // span images are made straight from the spans if they can be,
+    // everything else needs all the pixels
+    if (si->flags&SI_SPANS) {
+        if (scale==100 && (!colorize || st->sprite<220000)) {
+            sdl_make_spans(st,si,dst,sink,shaded,lit);
+            return;
+        }
+#ifdef SDL_FAST_MALLOC
+        pix=malloc(si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale);
+#else
+        pix=xmalloc(si->xres*si->yres*sizeof(uint32_t)*sdl_scale*sdl_scale,MEM_TEMP);
+#endif
+        sdl_span_unpack(pix,(long long)si->xres*si->yres*sdl_scale*sdl_scale,si->pixel,si->size);
+    } else pix=si->pixel;
+
+    if (scale!=100) {
+        xtap=sdl_make_taps(dx,scale,si->xres*sdl_scale);
+        ytap=sdl_make_taps(st->yres*sdl_scale,scale,si->yres*sdl_scale);
+        if (colorize) src=sdl_make_colorized(st,si,pix);
+        else src=pix;
+    } else {
+        xtap=ytap=NULL;
+        src=pix;
+    }
+
+    for (y=0; y<st->yres*sdl_scale; y++) {
+        row=dst+y*dx;
+
+        // fetch, colorize and scale one row
+        if (scale!=100) {
+            uint32_t *src0,*src1;
+
+            src0=src+ytap[y].i0*si->xres*sdl_scale;
+            src1=src+ytap[y].i1*si->xres*sdl_scale;
+
+            for (x=0; x<dx; x++) {
+                row[x]=sdl_lerp(sdl_lerp(src0[xtap[x].i0],src0[xtap[x].i1],xtap[x].w),
+                                sdl_lerp(src1[xtap[x].i0],src1[xtap[x].i1],xtap[x].w),ytap[y].w);
+            }
+        } else {
+            for (x=0; x<dx; x++) {
+                irgb=pix[x+y*si->xres*sdl_scale];
+                if (colorize) irgb=sdl_colorize_pix2(irgb,st->c1,st->c2,st->c3,x,y,si->xres,si->yres,pix,st->sprite);
+                row[x]=irgb;
+            }
+        }
+
+        // the remaining steps work on the whole row
+        sdl_make_shade(st,row,dx,0,y,sink,shaded,lit);
+    }
+
+#ifdef SDL_FAST_MALLOC
+    free(xtap);
+    free(ytap);
+    if (src!=pix) free(src);
+    if (pix!=si->pixel) free(pix);
+#else
+    if (xtap) xfree(xtap);
+    if (ytap) xfree(ytap);
+    if (src!=pix) xfree(src);
+    if (pix!=si->pixel) xfree(pix);
+#endif
+}
+
+static inline uint64_t hashmix(uint64_t h) {
+    h^=h>>33;
+    h*=0xff51afd7ed558ccdULL;
+    h^=h>>33;
+    h*=0xc4ceb9fe1a85ec53ULL;
+    h^=h>>33;
+
+    return h;
+}
+
+static inline uint64_t hashfunc(struct sdl_key *key) {
+    return hashmix(key->k[0]^hashmix(key->k[1]^hashmix(key->k[2])));
+}
+
+// Packs all the fields of a sprite texture into the key. The light and
+// color balance values come from chars in DDFX, so 8 bits each suffice.
+static inline void sdl_key_sprite(struct sdl_key *key,int sprite,int sink,int freeze,int scale,int cr,int cg,int cb,int light,int sat,int c1,int c2,int c3,int shine,int ml,int ll,int rl,int ul,int dl) {
+    key->k[0]=((uint64_t)(sprite&0xffffff))|((uint64_t)(uint8_t)dl<<24)|((uint64_t)(uint16_t)c1<<32)|((uint64_t)(uint16_t)c2<<48);
+    key->k[1]=((uint64_t)(uint16_t)c3)|((uint64_t)(uint16_t)shine<<16)|((uint64_t)(uint8_t)cr<<32)|((uint64_t)(uint8_t)cg<<40)|((uint64_t)(uint8_t)cb<<48)|((uint64_t)(uint8_t)light<<56);
+    key->k[2]=((uint64_t)(uint8_t)sat)|((uint64_t)(uint8_t)sink<<8)|((uint64_t)(uint8_t)freeze<<16)|((uint64_t)(uint8_t)scale<<24)|
+              ((uint64_t)(uint8_t)ml<<32)|((uint64_t)(uint8_t)ll<<40)|((uint64_t)(uint8_t)rl<<48)|((uint64_t)(uint8_t)ul<<56);
+    key->hash=hashfunc(key);
+}
+
+static inline long long sdl_base_bytes(struct sdl_base *sb) {
+    return (long long)(sb->size?sb->size:sb->len)*sizeof(uint32_t);
+}
+
+static void sdl_base_unlink(int sbx) {
+    struct sdl_base *sb=sdlb+sbx;
+
+    if (sb->prev==SDLB_NONE) sdlb_best=sb->next;
+    else sdlb[sb->prev].next=sb->next;
+
+    if (sb->next==SDLB_NONE) sdlb_last=sb->prev;
+    else sdlb[sb->next].prev=sb->prev;
+}
+
+static void sdl_base_front(int sbx) {
+    struct sdl_base *sb=sdlb+sbx;
+
+    sb->prev=SDLB_NONE;
+    sb->next=sdlb_best;
+
+    if (sdlb_best!=SDLB_NONE) sdlb[sdlb_best].prev=sbx;
+    else sdlb_last=sbx;
+
+    sdlb_best=sbx;
+}
+
+// Frees the least recently used base images nobody is using until the rest
+// fits into the budget and at least need entries are free. Called with
+// premutex held.
+static void sdl_base_trim(int need) {
+    struct sdl_base *sb;
+    int sbx,prev,*p;
+
+    for (sbx=sdlb_last; sbx!=SDLB_NONE && (mem_base>sdlb_budget || sdlb_nfree<need); sbx=prev) {
+        sb=sdlb+sbx;
+        prev=sb->prev;
+        if (sb->ref) continue;
+
+        for (p=sdlb_table+(sb->key.hash&(SDLB_HASH-1)); *p!=sbx; p=&sdlb[*p].hnext) ;
+        *p=sb->hnext;
+
+        sdl_base_unlink(sbx);
+        mem_base-=sdl_base_bytes(sb);
+#ifdef SDL_FAST_MALLOC
+        free(sb->pixel);
+#else
+        xfree(sb->pixel);
+#endif
+        sb->pixel=NULL;
+        sdlb_free[sdlb_nfree++]=sbx;
+    }
+}
+
+// Gets the base image of st, the sprite scaled, colorized and colour
+// balanced, but not lit, and holds on to it until sdl_base_put(). Makes it
+// if it isn't there yet. If another thread is making it, waits for that.
+// All the lit variants of a sprite share one base image, so the expensive
+// steps are done only once for them. Returns NULL if the cache is full of
+// images in use, st has to be made the long way then.
+static struct sdl_base *sdl_base_get(struct sdl_texture *st,struct sdl_image *si,int scale) {
+    struct sdl_key key;
+    struct sdl_base *sb;
+    uint32_t *pixel,*span;
+    long long len,size;
+    int sbx,*head;
+
+    sdl_key_sprite(&key,st->sprite,0,0,st->scale,st->cr,st->cg,st->cb,st->light,st->sat,st->c1,st->c2,st->c3,st->shine,0,0,0,0,0);
+    head=sdlb_table+(key.hash&(SDLB_HASH-1));
+
+    if (sdl_multi) SDL_LockMutex(premutex);
+    for (sbx=*head; sbx!=SDLB_NONE; sbx=sdlb[sbx].hnext)
+        if (!memcmp(sdlb[sbx].key.k,key.k,sizeof(key.k))) break;
+
+    if (sbx!=SDLB_NONE) {
+        sb=sdlb+sbx;
+        sb->ref++;
+        if (sdlb_best!=sbx) {
+            sdl_base_unlink(sbx);
+            sdl_base_front(sbx);
+        }
+        if (sdl_multi) while (sb->busy) SDL_CondWait(predone,premutex);
+        sdlb_hit++;
+        if (sdl_multi) SDL_UnlockMutex(premutex);
+        return sb;
+    }
+
+    sdl_base_trim(1);
+    if (!sdlb_nfree) {
+        if (sdl_multi) SDL_UnlockMutex(premutex);
+        return NULL;
+    }
+    sbx=sdlb_free[--sdlb_nfree];
+    sb=sdlb+sbx;
+
+    len=(long long)st->xres*st->yres*sdl_scale*sdl_scale;
+
+    sb->key=key;
+    sb->pixel=NULL;
+    sb->size=0;
+    sb->len=len;
+    sb->busy=1;
+    sb->ref=1;
+    sb->hnext=*head;
+    *head=sbx;
+    sdl_base_front(sbx);
+    sdlb_miss++;
+    if (sdl_multi) SDL_UnlockMutex(premutex);
+
+#ifdef SDL_FAST_MALLOC
+    pixel=malloc(len*sizeof(uint32_t));
+#else
+    pixel=xmalloc(len*sizeof(uint32_t),MEM_SDL_PIXEL);
+#endif
+    sdl_make_pixels(st,si,scale,pixel,0,0,0);
+
+    // mostly transparent ones are kept as spans, like the images
+    size=sdl_span_pack(NULL,pixel,len);
+    if (size<len*3/4) {
+#ifdef SDL_FAST_MALLOC
+        span=malloc(max(1,size)*sizeof(uint32_t));
+        sdl_span_pack(span,pixel,len);
+        free(pixel);
+#else
+        span=xmalloc(max(1,size)*sizeof(uint32_t),MEM_SDL_PIXEL);
+        sdl_span_pack(span,pixel,len);
+        xfree(pixel);
+#endif
+        pixel=span;
+    } else size=0;
+
+    if (sdl_multi) SDL_LockMutex(premutex);
+    sb->pixel=pixel;
+    sb->size=size;
+    sb->busy=0;
+    mem_base+=sdl_base_bytes(sb);
+    sdl_base_trim(0);
+    if (sdl_multi) {
+        SDL_CondBroadcast(predone);
+        SDL_UnlockMutex(premutex);
+    }
+
+    return sb;
+}
+
+static void sdl_base_put(struct sdl_base *sb) {
+    if (sdl_multi) SDL_LockMutex(premutex);
+    sb->ref--;
+    if (!sb->ref) sdl_base_trim(0);
+    if (sdl_multi) SDL_UnlockMutex(premutex);
+}
+
+// Makes the lit variant st from its base image. Only the light, sink and
+// freeze are left to do.
+static void sdl_make_lit(struct sdl_texture *st,struct sdl_base *sb,int sink,int shaded) {
+    const uint32_t *src,*end;
+    int x,y,n,cnt,dx;
+    long long pos=0;
+
+    dx=st->xres*sdl_scale;
+
+    if (!sb->size) {
+        memcpy(st->pixel,sb->pixel,sb->len*sizeof(uint32_t));
+        for (y=0; y<st->yres*sdl_scale; y++) sdl_make_light(st,st->pixel+y*dx,dx,0,y,sink,shaded);
+        return;
+    }
+
+    bzero(st->pixel,sb->len*sizeof(uint32_t));
+
+    for (src=sb->pixel,end=sb->pixel+sb->size; src<end; ) {
+        pos+=*src>>16;
+        n=*src&0xffff;
+        src++;
+
+        // split the run at the end of each row
+        while (n) {
+            y=pos/dx;
+            x=pos%dx;
+            cnt=min(n,dx-x);
+
+            memcpy(st->pixel+pos,src,cnt*sizeof(uint32_t));
+            sdl_make_light(st,st->pixel+pos,cnt,x,y,sink,shaded);
+
+            pos+=cnt;
+            src+=cnt;
+            n-=cnt;
+        }
+    }
 }
 
 static void sdl_make(struct sdl_texture *st,struct sdl_image *si,int preload) {
     SDL_Texture *texture;
-    int x,y,scale,sink;
-    double ix,iy,low_x,low_y,high_x,high_y,dbr,dbg,dbb,dba;
-    uint32_t irgb;
+    SDL_Rect part;
+    int scale,sink,shaded,colorize;
+    struct sdl_base *sb;
     long long start;
 
     if (si->xres==0 || si->yres==0) scale=100;    // !!! needs better handling !!!
@@ -1088,34 +1421,34 @@ static void sdl_make(struct sdl_texture *st,struct sdl_image *si,int preload) {
     // this was originally done during loading from PAKs.
     if (st->sprite>=160000 && st->sprite<170000) scale*=0.88;
 
-    if (scale!=100) {
-        st->xres=ceil((double)(si->xres-1)*scale/100.0);
-        st->yres=ceil((double)(si->yres-1)*scale/100.0);
-
-        st->xoff=floor(si->xoff*scale/100.0+0.5);
-        st->yoff=floor(si->yoff*scale/100.0+0.5);
-    } else {
-        st->xres=si->xres;
-        st->yres=si->yres;
-        st->xoff=si->xoff;
-        st->yoff=si->yoff;
-    }
-
-    if (st->sink) sink=min(st->sink,max(0,st->yres-4));
-    else sink=0;
-
     if (!preload || preload==1) {
         if (st->flags&SF_DIDALLOC) {
             fail("double alloc for sprite %d (%d)",st->sprite,preload);
             note("... sprite=%d (%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d)",st->sprite,st->sink,st->freeze,st->scale,st->cr,st->cg,st->cb,st->light,st->sat,st->c1,st->c2,st->c3,st->shine,st->ml,st->ll,st->rl,st->ul,st->dl);
             return;
         }
+
+        // the size is only taken from the image here, the image might be
+        // gone again by the time the texture gets created
+        if (scale!=100) {
+            st->xres=ceil((double)(si->xres-1)*scale/100.0);
+            st->yres=ceil((double)(si->yres-1)*scale/100.0);
+
+            st->xoff=floor(si->xoff*scale/100.0+0.5);
+            st->yoff=floor(si->yoff*scale/100.0+0.5);
+        } else {
+            st->xres=si->xres;
+            st->yres=si->yres;
+            st->xoff=si->xoff;
+            st->yoff=si->yoff;
+        }
 #ifdef SDL_FAST_MALLOC
         st->pixel=malloc(st->xres*st->yres*sizeof(uint32_t)*sdl_scale*sdl_scale);
 #else
         st->pixel=xmalloc(st->xres*st->yres*sizeof(uint32_t)*sdl_scale*sdl_scale,MEM_SDL_PIXEL);
 #endif
         st->flags|=SF_DIDALLOC;
+        mem_tex+=sdl_tx_bytes(st);
     }
 
     sdlm_sprite=st->sprite;
@@ -1146,160 +1479,17 @@ static void sdl_make(struct sdl_texture *st,struct sdl_image *si,int preload) {
 
         start=SDL_GetTicks64();
 
-        for (y=0; y<st->yres*sdl_scale; y++) {
-            for (x=0; x<st->xres*sdl_scale; x++) {
-
-                if (scale!=100) {
-                    ix=x*100.0/scale;
-                    iy=y*100.0/scale;
-
-                    if (ceil(ix)>=si->xres*sdl_scale) ix=si->xres*sdl_scale-1.001;
-
-                    if (ceil(iy)>=si->yres*sdl_scale) iy=si->yres*sdl_scale-1.001;
-
-                    high_x=ix-floor(ix);
-                    high_y=iy-floor(iy);
-                    low_x=1-high_x;
-                    low_y=1-high_y;
-
-                    irgb=si->pixel[(int)(floor(ix)+floor(iy)*si->xres*sdl_scale)];
-
-                    if (st->c1 || st->c2 || st->c3) irgb=sdl_colorize_pix2(irgb,st->c1,st->c2,st->c3,floor(ix),floor(iy),si->xres,si->yres,si->pixel,st->sprite);
-                    dba=IGET_A(irgb)*low_x*low_y;
-                    dbr=IGET_R(irgb)*low_x*low_y;
-                    dbg=IGET_G(irgb)*low_x*low_y;
-                    dbb=IGET_B(irgb)*low_x*low_y;
-
-                    irgb=si->pixel[(int)(ceil(ix)+floor(iy)*si->xres*sdl_scale)];
-
-                    if (st->c1 || st->c2 || st->c3) irgb=sdl_colorize_pix2(irgb,st->c1,st->c2,st->c3,ceil(ix),floor(iy),si->xres,si->yres,si->pixel,st->sprite);
-                    dba+=IGET_A(irgb)*high_x*low_y;
-                    dbr+=IGET_R(irgb)*high_x*low_y;
-                    dbg+=IGET_G(irgb)*high_x*low_y;
-                    dbb+=IGET_B(irgb)*high_x*low_y;
-
-                    irgb=si->pixel[(int)(floor(ix)+ceil(iy)*si->xres*sdl_scale)];
+        if (st->sink) sink=min(st->sink,max(0,st->yres-4));
+        else sink=0;
 
-                    if (st->c1 || st->c2 || st->c3) irgb=sdl_colorize_pix2(irgb,st->c1,st->c2,st->c3,floor(ix),ceil(iy),si->xres,si->yres,si->pixel,st->sprite);
-                    dba+=IGET_A(irgb)*low_x*high_y;
-                    dbr+=IGET_R(irgb)*low_x*high_y;
-                    dbg+=IGET_G(irgb)*low_x*high_y;
-                    dbb+=IGET_B(irgb)*low_x*high_y;
+        shaded=(st->ll!=st->ml || st->rl!=st->ml || st->ul!=st->ml || st->dl!=st->ml);
+        colorize=(st->c1 || st->c2 || st->c3);
 
-                    irgb=si->pixel[(int)(ceil(ix)+ceil(iy)*si->xres*sdl_scale)];
+        if ((colorize || scale!=100) && (sb=sdl_base_get(st,si,scale))) {
+            sdl_make_lit(st,sb,sink,shaded);
+            sdl_base_put(sb);
+        } else sdl_make_pixels(st,si,scale,st->pixel,sink,shaded,1);
 
-                    if (st->c1 || st->c2 || st->c3) irgb=sdl_colorize_pix2(irgb,st->c1,st->c2,st->c3,ceil(ix),ceil(iy),si->xres,si->yres,si->pixel,st->sprite);
-                    dba+=IGET_A(irgb)*high_x*high_y;
-                    dbr+=IGET_R(irgb)*high_x*high_y;
-                    dbg+=IGET_G(irgb)*high_x*high_y;
-                    dbb+=IGET_B(irgb)*high_x*high_y;
-
-                    irgb=IRGBA(((int)dbr),((int)dbg),((int)dbb),((int)dba));
-
-                } else {
-                    irgb=si->pixel[x+y*si->xres*sdl_scale];
-                    if (st->c1 || st->c2 || st->c3) irgb=sdl_colorize_pix2(irgb,st->c1,st->c2,st->c3,x,y,si->xres,si->yres,si->pixel,st->sprite);
-                }
-
-                if (st->cr || st->cg || st->cb || st->light || st->sat) irgb=sdl_colorbalance(irgb,st->cr,st->cg,st->cb,st->light,st->sat);
-                if (st->shine) irgb=sdl_shine_pix(irgb,st->shine);
-
-                if (st->ll!=st->ml || st->rl!=st->ml || st->ul!=st->ml || st->dl!=st->ml) {
-                    int r,g,b,a;
-                    int r1=0,r2=0,r3=0,r4=0,r5=0;
-                    int g1=0,g2=0,g3=0,g4=0,g5=0;
-                    int b1=0,b2=0,b3=0,b4=0,b5=0;
-                    int v1,v2,v3,v4,v5=0;
-                    int div;
-
-
-                    if (y<10*sdl_scale+(20*sdl_scale-abs(20*sdl_scale-x))/2) {
-
-                        // This part calculates a floor tile, or the top of a wall tile
-                        if (x/2<20*sdl_scale-y) {
-                            v2=-(x/2-(20*sdl_scale-y));
-                            r2=IGET_R(sdl_light(st->ll,irgb));
-                            g2=IGET_G(sdl_light(st->ll,irgb));
-                            b2=IGET_B(sdl_light(st->ll,irgb));
-                        } else v2=0;
-                        if (x/2>20*sdl_scale-y) {
-                            v3=(x/2-(20*sdl_scale-y));
-                            r3=IGET_R(sdl_light(st->rl,irgb));
-                            g3=IGET_G(sdl_light(st->rl,irgb));
-                            b3=IGET_B(sdl_light(st->rl,irgb));
-                        } else v3=0;
-                        if (x/2>y) {
-                            v4=(x/2-y);
-                            r4=IGET_R(sdl_light(st->ul,irgb));
-                            g4=IGET_G(sdl_light(st->ul,irgb));
-                            b4=IGET_B(sdl_light(st->ul,irgb));
-                        } else v4=0;
-                        if (x/2<y) {
-                            v5=-(x/2-y);
-                            r5=IGET_R(sdl_light(st->dl,irgb));
-                            g5=IGET_G(sdl_light(st->dl,irgb));
-                            b5=IGET_B(sdl_light(st->dl,irgb));
-                        } else v5=0;
-
-                        v1=20*sdl_scale-(v2+v3+v4+v5);
-                        r1=IGET_R(sdl_light(st->ml,irgb));
-                        g1=IGET_G(sdl_light(st->ml,irgb));
-                        b1=IGET_B(sdl_light(st->ml,irgb));
-                    } else {
-
-                        // This is for the lower part (left side and front as seen on the screen)
-                        if (x<10*sdl_scale) {
-                            v2=(10*sdl_scale-x)*2-2;
-                            r2=IGET_R(sdl_light(st->ll,irgb));
-                            g2=IGET_G(sdl_light(st->ll,irgb));
-                            b2=IGET_B(sdl_light(st->ll,irgb));
-                        } else v2=0;
-                        if (x>10*sdl_scale && x<20*sdl_scale) {
-                            v3=(x-10*sdl_scale)*2-2;
-                            r3=IGET_R(sdl_light(st->rl,irgb));
-                            g3=IGET_G(sdl_light(st->rl,irgb));
-                            b3=IGET_B(sdl_light(st->rl,irgb));
-                        } else v3=0;
-                        if (x>20*sdl_scale && x<30*sdl_scale) {
-                            v5=(10*sdl_scale-(x-20*sdl_scale))*2-2;
-                            r5=IGET_R(sdl_light(st->dl,irgb));
-                            g5=IGET_G(sdl_light(st->dl,irgb));
-                            b5=IGET_B(sdl_light(st->dl,irgb));
-                        } else v5=0;
-                        if (x>30*sdl_scale) {
-                            if (x<40*sdl_scale) v4=(x-30*sdl_scale)*2-2;
-                            else v4=0;
-                            r4=IGET_R(sdl_light(st->ul,irgb));
-                            g4=IGET_G(sdl_light(st->ul,irgb));
-                            b4=IGET_B(sdl_light(st->ul,irgb));
-                        } else v4=0;
-
-                        v1=20*sdl_scale-(v2+v3+v4+v5)/2;
-                        r1=IGET_R(sdl_light(st->ml,irgb));
-                        g1=IGET_G(sdl_light(st->ml,irgb));
-                        b1=IGET_B(sdl_light(st->ml,irgb));
-                    }
-
-                    div=v1+v2+v3+v4+v5;
-
-                    a=IGET_A(irgb);
-                    r=(r1*v1+r2*v2+r3*v3+r4*v4+r5*v5)/div;
-                    g=(g1*v1+g2*v2+g3*v3+g4*v4+g5*v5)/div;
-                    b=(b1*v1+b2*v2+b3*v3+b4*v4+b5*v5)/div;
-
-                    irgb=IRGBA(r,g,b,a);
-
-                } else irgb=sdl_light(st->ml,irgb);
-
-                if (sink) {
-                    if (st->yres*sdl_scale-sink*sdl_scale<y) irgb&=0xffffff;    // zero alpha to make it transparent
-                }
-
-                if (st->freeze) irgb=sdl_freeze(st->freeze,irgb);
-
-                st->pixel[x+y*st->xres*sdl_scale]=irgb;
-            }
-        }
         st->flags|=SF_DIDMAKE;
 
         if (preload) sdl_time_preload+=SDL_GetTicks64()-start;
@@ -1320,14 +1510,23 @@ static void sdl_make(struct sdl_texture *st,struct sdl_image *si,int preload) {
 
         start=SDL_GetTicks64();
 
-        if (st->xres>0 && st->yres>0) {
+        if (st->xres>0 && st->yres>0 && !sdl_atlas_alloc(st)) {
+            texture=sdla[st->page].tex;
+            sdl_flush_tex(texture);
+            part.x=st->ax; part.w=st->xres*sdl_scale;
+            part.y=st->ay; part.h=st->yres*sdl_scale;
+            SDL_UpdateTexture(texture,&part,st->pixel,st->xres*sizeof(uint32_t)*sdl_scale);
+            st->flags|=SF_ATLAS;
+            texc_atlas++;
+        } else if (st->xres>0 && st->yres>0) {
             texture=SDL_CreateTexture(sdlren,SDL_PIXELFORMAT_ARGB8888,SDL_TEXTUREACCESS_STATIC,st->xres*sdl_scale,st->yres*sdl_scale);
             if (!texture) {
-                warn("SDL_texture Error: %s in sprite %d (%s, %d,%d) preload=%d",SDL_GetError(),st->sprite,st->text,st->xres,st->yres,preload);
+                warn("SDL_texture Error: %s in sprite %d (%d,%d) preload=%d",SDL_GetError(),st->sprite,st->xres,st->yres,preload);
                 return;
             }
             SDL_UpdateTexture(texture,NULL,st->pixel,st->xres*sizeof(uint32_t)*sdl_scale);
             SDL_SetTextureBlendMode(texture,SDL_BLENDMODE_BLEND);
+            texc_single++;
         } else texture=NULL;
 #ifdef SDL_FAST_MALLOC
         free(st->pixel);
@@ -1343,153 +1542,270 @@ static void sdl_make(struct sdl_texture *st,struct sdl_image *si,int preload) {
     }
 }
 
+static void sdl_tx_unlink(int stx) {
+    int seg=sdlt[stx].seg;
+
+    if (sdlt[stx].prev==STX_NONE) sdlt_best[seg]=sdlt[stx].next;
+    else sdlt[sdlt[stx].prev].next=sdlt[stx].next;
+
+    if (sdlt[stx].next==STX_NONE) sdlt_last[seg]=sdlt[stx].prev;
+    else sdlt[sdlt[stx].next].prev=sdlt[stx].prev;
+
+    sdlt[stx].prev=sdlt[stx].next=STX_NONE;
+    sdlt_cnt[seg]--;
+}
+
+static void sdl_tx_front(int stx,int seg) {
+    sdlt[stx].seg=seg;
+    sdlt[stx].prev=STX_NONE;
+    sdlt[stx].next=sdlt_best[seg];
+
+    if (sdlt_best[seg]!=STX_NONE) sdlt[sdlt_best[seg]].prev=stx;
+    else sdlt_last[seg]=stx;
+
+    sdlt_best[seg]=stx;
+    sdlt_cnt[seg]++;
+}
+
+// Called when an entry gets drawn. The first draw keeps it on probation (it
+// might have been prefetched, which does not count as a use), any further one
+// moves it to the protected segment. If that grows too large, its least
+// recently used entries go back to probation.
 static void sdl_tx_best(int stx) {
+    int seg,demote;
+
     PARANOIA(if (stx==STX_NONE) paranoia("sdl_tx_best(): sidx=SIDX_NONE"); )
     PARANOIA(if (stx>=MAX_TEXCACHE) paranoia("sdl_tx_best(): sidx>max_systemcache (%d>=%d)",stx,MAX_TEXCACHE); )
 
-    if (sdlt[stx].prev==STX_NONE) {
+    seg=sdlt[stx].seg;
+    if (sdlt[stx].drawn) seg=SDLT_PROTECTED;
+    else sdlt[stx].drawn=1;
 
-        PARANOIA(if (stx!=sdlt_best) paranoia("sdl_tx_best(): stx should be best"); )
+    if (sdlt_best[seg]==stx) return;
 
-        return;
-    } else if (sdlt[stx].next==STX_NONE) {
+    sdl_tx_unlink(stx);
+    sdl_tx_front(stx,seg);
+
+    if (seg!=SDLT_PROTECTED) return;
 
-        PARANOIA(if (stx!=sdlt_last) paranoia("sdl_tx_best(): sidx should be last"); )
+    while (sdlt_cnt[SDLT_PROTECTED]*100>(sdlt_cnt[SDLT_PROBATION]+sdlt_cnt[SDLT_PROTECTED])*SDLT_PROTECT &&
+           sdlt_last[SDLT_PROTECTED]!=stx) {
+        demote=sdlt_last[SDLT_PROTECTED];
+        sdl_tx_unlink(demote);
+        sdl_tx_front(demote,SDLT_PROBATION);
+    }
+}
 
-        sdlt_last=sdlt[stx].prev;
-        sdlt[sdlt_last].next=STX_NONE;
-        sdlt[sdlt_best].prev=stx;
-        sdlt[stx].prev=STX_NONE;
-        sdlt[stx].next=sdlt_best;
-        sdlt_best=stx;
+static int sdlt_find(struct sdl_key *key) {
+    unsigned int i,fp,probe=1;
+    int stx;
 
-        return;
-    } else {
-        sdlt[sdlt[stx].prev].next=sdlt[stx].next;
-        sdlt[sdlt[stx].next].prev=sdlt[stx].prev;
-        sdlt[stx].prev=STX_NONE;
-        sdlt[stx].next=sdlt_best;
-        sdlt[sdlt_best].prev=stx;
-        sdlt_best=stx;
-        return;
+    fp=key->hash>>32;
+
+    for (i=key->hash&sdlt_mask; (stx=sdlt_table[i].stx)!=STX_NONE; i=(i+1)&sdlt_mask,probe++) {
+        if (sdlt_table[i].fp!=fp) continue;
+        if (sdlt_key[stx].k[0]!=key->k[0] || sdlt_key[stx].k[1]!=key->k[1] || sdlt_key[stx].k[2]!=key->k[2]) continue;
+        break;
     }
+
+    texc_lookup++;
+    texc_probe+=probe;
+    if (probe>texc_probe_max) texc_probe_max=probe;
+
+    return stx;
 }
 
-static inline unsigned int hashfunc(int sprite,int ml,int ll,int rl,int ul,int dl) {
-    unsigned int hash;
+static void sdlt_insert(int stx) {
+    unsigned int i;
 
-    hash=sprite^(ml<<2)^(ll<<4)^(rl<<6)^(ul<<8)^(dl<<10);
+    for (i=sdlt_key[stx].hash&sdlt_mask; sdlt_table[i].stx!=STX_NONE; i=(i+1)&sdlt_mask) ;
 
-    return hash%MAX_TEXHASH;
+    sdlt_table[i].fp=sdlt_key[stx].hash>>32;
+    sdlt_table[i].stx=stx;
 }
 
-static inline unsigned int hashfunc_text(const char *text,int color,int flags) {
-    unsigned int hash,t0,t1,t2,t3;
+// Removes stx from the table. Uses backward shift deletion, so there are
+// no tombstones and probe sequences stay short.
+static int sdlt_remove(int stx) {
+    unsigned int i,j,home;
+
+    for (i=sdlt_key[stx].hash&sdlt_mask; sdlt_table[i].stx!=stx; i=(i+1)&sdlt_mask)
+        if (sdlt_table[i].stx==STX_NONE) return 0;
 
-    t0=text[0];
-    if (text[0]) {
-        t1=text[1];
-        if (text[1]) {
-            t2=text[2];
-            if (text[2]) {
-                t3=text[3];
-            } else t3=0;
-        } else t2=t3=0;
-    } else t1=t2=t3=0;
+    for (j=i; ; ) {
+        j=(j+1)&sdlt_mask;
+        if (sdlt_table[j].stx==STX_NONE) break;
 
-    hash=(t0<<0)^(t1<<3)^(t2<<6)^(t3<<9)^(color<<0)^(flags<<5);
+        // entries which are still reachable from their home slot stay where they are
+        home=sdlt_key[sdlt_table[j].stx].hash&sdlt_mask;
+        if (i<=j ? (i<home && home<=j) : (i<home || home<=j)) continue;
 
-    return hash%MAX_TEXHASH;
+        sdlt_table[i]=sdlt_table[j];
+        i=j;
+    }
+    sdlt_table[i].stx=STX_NONE;
+
+    return 1;
 }
 
-SDL_Texture *sdl_maketext(const char *text,struct ddfont *font,uint32_t color,int flags);
 
-static void not_busy_or_panic(struct sdl_texture *st) {
-    int panic=0;
+// Waits until no background worker is working on the entry, then claims it.
+// The workers only ever hold an entry for one sdl_make() call, so this
+// blocks for as long as that takes and no longer.
+static void busy(struct sdl_texture *st) {
+    if (sdl_multi) {
+        SDL_LockMutex(premutex);
+        while (st->flags&SF_BUSY) SDL_CondWait(predone,premutex);
+        st->flags|=SF_BUSY;
+        SDL_UnlockMutex(premutex);
+    } else st->flags|=SF_BUSY;
+}
 
+static void unbusy(struct sdl_texture *st) {
+    if (sdl_multi) SDL_LockMutex(premutex);
+    st->flags&=~SF_BUSY;
     if (sdl_multi) {
-        while (42) {
-            SDL_LockMutex(premutex);
-            if (!(st->flags&(SF_BUSY))) {
-                st->flags|=SF_BUSY;
-                SDL_UnlockMutex(premutex);
-                break;
-            }
-            SDL_UnlockMutex(premutex);
-            SDL_Delay(1);
-            if (panic++>100) { fail("texture cache too small (Delete: BUSY)"); exit(42); }
+        SDL_CondBroadcast(predone);
+        SDL_UnlockMutex(premutex);
+    }
+}
+
+// Removes an entry from the cache and puts it on the free list.
+static void sdl_tx_evict(int stx) {
+
+    if (sdlt[stx].flags&SF_SPRITE) busy(sdlt+stx);
+    else warn("weird entry in texture cache!");
+
+    if (!sdlt_remove(stx)) {
+        fail("texture %d not found in hash table\n",stx);
+        exit(42);
+    }
+
+    if (sdlt[stx].flags&SF_DIDALLOC) mem_tex-=sdl_tx_bytes(sdlt+stx);
+
+    if (sdlt[stx].flags&SF_ATLAS) {
+        sdl_atlas_free(sdlt+stx);
+    } else if (sdlt[stx].flags&SF_DIDTEX) {
+        if (sdlt[stx].tex) {
+            sdl_flush_tex(sdlt[stx].tex);
+            SDL_DestroyTexture(sdlt[stx].tex);
         }
-    } else st->flags|=SF_BUSY;
+    } else if (sdlt[stx].flags&SF_DIDALLOC) {
+        if (sdlt[stx].pixel) {
+#ifdef SDL_FAST_MALLOC
+            free(sdlt[stx].pixel);
+#else
+            xfree(sdlt[stx].pixel);
+#endif
+            sdlt[stx].pixel=NULL;
+        }
+    }
+
+    sdlt[stx].flags=0;
+    sdlt[stx].fortick=0;
+
+    if (sdlt[stx].seg==SDLT_PROTECTED) texc_evict_prot++;
+    else texc_evict_prob++;
+
+    sdl_tx_unlink(stx);
+    sdlt_free[sdlt_nfree++]=stx;
+    texc_used--;
+}
+
+// Picks the entry to evict: the least recently used one on probation, then
+// the least recently used protected one. Entries prefetched for a tick which
+// has not been shown yet are skipped, they would only have to be made again a
+// moment later. Returns STX_NONE if there is nothing to evict, unless force is
+// set, in which case the tail of the list is taken anyway.
+static int sdl_tx_victim(int keep,int force) {
+    int seg,stx,n;
+
+    for (seg=SDLT_PROBATION; seg<=SDLT_PROTECTED; seg++) {
+        for (stx=sdlt_last[seg],n=0; stx!=STX_NONE && n<SDLT_SCAN; stx=sdlt[stx].prev,n++) {
+            if (stx==keep) continue;
+            if (sdlt[stx].fortick>sdlt_tick) continue;
+            return stx;
+        }
+    }
+    if (!force) return STX_NONE;
+
+    for (seg=SDLT_PROBATION; seg<=SDLT_PROTECTED; seg++) {
+        for (stx=sdlt_last[seg]; stx!=STX_NONE; stx=sdlt[stx].prev)
+            if (stx!=keep) return stx;
+    }
+    return STX_NONE;
+}
+
+// Once the atlas has run full, empties the page with the fewest pixels in
+// use by evicting what is left on it. Evicted entries leave holes only
+// shelves of the same height can use, over time the pages would be nothing
+// but fragments. The entries are made again when they are needed. Pages
+// which are more than half full are left alone, the atlas is really full
+// then. Entry keep, and so its page, stays.
+static void sdl_atlas_defrag(int keep) {
+    int n,best=-1,stx;
+
+    sdla_full=0;
+
+    for (n=0; n<sdla_pages; n++) {
+        if (keep!=STX_NONE && (sdlt[keep].flags&SF_ATLAS) && sdlt[keep].page==n) continue;
+        if (best==-1 || sdla[n].area<sdla[best].area) best=n;
+    }
+    if (best==-1 || sdla[best].area>(long long)sdla_size*sdla_size/2) return;
+
+    for (stx=0; stx<MAX_TEXCACHE; stx++)
+        if ((sdlt[stx].flags&SF_ATLAS) && sdlt[stx].page==best) sdl_tx_evict(stx);
+
+    texc_defrag++;
+}
+
+// Evicts entries until the cache fits into its memory budget again. Entry
+// keep, the one just loaded, stays.
+static void sdl_tx_trim(int keep) {
+    int stx;
+
+    if (sdla_full) sdl_atlas_defrag(keep);
+
+    while (mem_tex>sdlt_budget && (stx=sdl_tx_victim(keep,0))!=STX_NONE)
+        sdl_tx_evict(stx);
 }
 
-static void unbusy(struct sdl_texture *st) {
-    if (sdl_multi) SDL_LockMutex(premutex);
-    st->flags&=~SF_BUSY;
-    if (sdl_multi) SDL_UnlockMutex(premutex);
+// Lighting on the graphics card (GO_GPULIGHT): sprites are made with
+// SDL_NLIGHT and the light gets applied when they are blitted, by modulating
+// the texture. That way one texture serves all the lights a sprite is seen
+// in. Modulating can only darken, which rules out DDFX_BRIGHT, and freezing
+// has to come after the light, so those are still made on the CPU.
+static inline int sdl_gpu_light(int freeze,int ml,int ll,int rl,int ul,int dl) {
+    if (!(game_options&GO_GPULIGHT) || freeze) return 0;
+
+    return ml>0 && ml<=SDL_NLIGHT && ll>0 && ll<=SDL_NLIGHT && rl>0 && rl<=SDL_NLIGHT &&
+           ul>0 && ul<=SDL_NLIGHT && dl>0 && dl<=SDL_NLIGHT;
 }
 
 int sdl_tx_load(int sprite,int sink,int freeze,int scale,int cr,int cg,int cb,int light,int sat,int c1,int c2,int c3,int shine,int ml,int ll,int rl,int ul,int dl,
-                const char *text,int text_color,int text_flags,void *text_font,int checkonly,int preload,int fortick) {
-    int stx,ptx,ntx,panic=0;
-    int hash;
+                int checkonly,int preload,int fortick) {
+    int stx;
+    struct sdl_key key;
 
-    if (!text) hash=hashfunc(sprite,ml,ll,rl,ul,dl);
-    else hash=hashfunc_text(text,text_color,text_flags);
+    sdl_gfx_check();
 
     if (sprite>=MAXSPRITE || sprite<0) {
         note("illegal sprite %d wanted in sdl_tx_load",sprite);
         return STX_NONE;
     }
 
-    for (stx=sdlt_cache[hash]; stx!=STX_NONE; stx=sdlt[stx].hnext,panic++) {
+    if (sdl_gpu_light(freeze,ml,ll,rl,ul,dl)) ml=ll=rl=ul=dl=SDL_NLIGHT;
 
-        if (panic>999) {
-            warn("%04d: stx=%d, hprev=%d, hnext=%d sprite=%d (%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d,%p) PANIC\n",panic,stx,sdlt[stx].hprev,sdlt[stx].hnext,sprite,
-                   sdlt[stx].sink,sdlt[stx].freeze,sdlt[stx].scale,
-                   sdlt[stx].cr,sdlt[stx].cg,sdlt[stx].cb,sdlt[stx].light,
-                   sdlt[stx].sat,sdlt[stx].c1,sdlt[stx].c2,sdlt[stx].c3,
-                   sdlt[stx].shine,sdlt[stx].ml,sdlt[stx].ll,sdlt[stx].rl,
-                   sdlt[stx].ul,sdlt[stx].dl,sdlt[stx].text);
-            if (panic>1099) {
-#ifdef DEVELOPER
-                sdl_dump_spritecache();
-#endif
-                exit(42);
-            }
-        }
-        if (text) {
-            if (!(sdlt[stx].flags&SF_TEXT)) continue;
-            if (!(sdlt[stx].tex)) continue;     // text does not go through the preloader, so if the texture is empty maketext failed earlier.
-            if (!sdlt[stx].text || strcmp(sdlt[stx].text,text)) continue;
-            if (sdlt[stx].text_flags!=text_flags) continue;
-            if (sdlt[stx].text_color!=text_color) continue;
-            if (sdlt[stx].text_font!=text_font) continue;
-        } else {
-            if (!(sdlt[stx].flags&SF_SPRITE)) continue;
-            if (sdlt[stx].sprite!=sprite) continue;
-            if (sdlt[stx].sink!=sink) continue;
-            if (sdlt[stx].freeze!=freeze) continue;
-            if (sdlt[stx].scale!=scale) continue;
-            if (sdlt[stx].cr!=cr) continue;
-            if (sdlt[stx].cg!=cg) continue;
-            if (sdlt[stx].cb!=cb) continue;
-            if (sdlt[stx].light!=light) continue;
-            if (sdlt[stx].sat!=sat) continue;
-            if (sdlt[stx].c1!=c1) continue;
-            if (sdlt[stx].c2!=c2) continue;
-            if (sdlt[stx].c3!=c3) continue;
-            if (sdlt[stx].shine!=shine) continue;
-            if (sdlt[stx].ml!=ml) continue;
-            if (sdlt[stx].ll!=ll) continue;
-            if (sdlt[stx].rl!=rl) continue;
-            if (sdlt[stx].ul!=ul) continue;
-            if (sdlt[stx].dl!=dl) continue;
-        }
+    sdl_key_sprite(&key,sprite,sink,freeze,scale,cr,cg,cb,light,sat,c1,c2,c3,shine,ml,ll,rl,ul,dl);
 
-        if (checkonly) return 1;
-        if (preload==1) return -1;
+    stx=sdlt_find(&key);
+    if (stx!=STX_NONE) {
 
-        if (panic>maxpanic) maxpanic=panic;
+        if (checkonly) return 1;
+        if (preload==1) {
+            if (fortick>sdlt[stx].fortick) sdlt[stx].fortick=fortick;
+            return -1;
+        }
 
         if (!preload && (sdlt[stx].flags&SF_SPRITE)) {
 
@@ -1497,61 +1813,47 @@ int sdl_tx_load(int sprite,int sink,int freeze,int scale,int cr,int cg,int cb,in
             if (!(sdlt[stx].flags&SF_DIDALLOC)) {
                 //long long start=SDL_GetTicks64();
                 //printf("main-making alloc and make for sprite %d (%d)\n",sprite,preload);
-                sdl_ic_load(sprite);
+                sdl_ic_get(sprite,-1);
 
-                not_busy_or_panic(sdlt+stx);
+                busy(sdlt+stx);
                 sdl_make(sdlt+stx,sdli+sprite,1);
                 sdl_make(sdlt+stx,sdli+sprite,2);
                 unbusy(sdlt+stx);
+
+                sdl_ic_put(sprite);
                 //sdl_time_tex_main+=SDL_GetTicks64()-start; TODO
             }
 
-            // Make make in main if not busy
-            if (sdl_multi) SDL_LockMutex(premutex);
+            // Make make in main if no background worker is on it already,
+            // otherwise wait for the worker to finish
+            if (sdl_multi) {
+                SDL_LockMutex(premutex);
+                while (sdlt[stx].flags&SF_BUSY) SDL_CondWait(predone,premutex);
+            }
 
-            if (!(sdlt[stx].flags&(SF_DIDMAKE|SF_BUSY))) {
+            if (!(sdlt[stx].flags&SF_DIDMAKE)) {
+                long long start=SDL_GetTicks64();
 
                 sdlt[stx].flags|=SF_BUSY;
 
                 if (sdl_multi) SDL_UnlockMutex(premutex);
 
+                sdl_ic_get(sprite,-1);
                 sdl_make(sdlt+stx,sdli+sprite,2);
+                sdl_ic_put(sprite);
 
                 if (sdl_multi) SDL_LockMutex(premutex);
 
                 sdlt[stx].flags&=~SF_BUSY;
                 sdlt[stx].flags|=SF_DIDMAKE;
 
-                if (sdl_multi) SDL_UnlockMutex(premutex);
-            } else {
-                if (sdl_multi) SDL_UnlockMutex(premutex);
-            }
-
-            // wait for the background preloader if we have multiple threads
-            panic=0;
-            while (sdl_multi) {
-                if ((sdlt[stx].flags&SF_DIDMAKE)) break;
-
-                //warn("waiting for graphics...");
-                SDL_Delay(1);
-
-                if (panic++>100) {
-                    fail("graphics not being made for sprite %d (flags=%s %s %s %s)",
-                         sdlt[stx].sprite,
-                         (sdlt[stx].flags&SF_DIDALLOC)?"didalloc":"",
-                         (sdlt[stx].flags&SF_DIDMAKE)?"didmake":"",
-                         (sdlt[stx].flags&SF_DIDTEX)?"didtex":"",
-                         (sdlt[stx].flags&SF_BUSY)?"busy":"");
-                    exit(42);
+                if (sdl_multi) {
+                    SDL_CondBroadcast(predone);
+                    SDL_UnlockMutex(premutex);
                 }
-            }
-
-            // if we are single threaded do it yourself
-            if (!sdl_multi && !(sdlt[stx].flags&SF_DIDMAKE)) {
-                //printf("main-making make for sprite %d\n",sprite);
-                long long start=SDL_GetTicks64();
-                sdl_make(sdlt+stx,sdli+sprite,2);
                 sdl_time_make_main+=SDL_GetTicks64()-start;
+            } else {
+                if (sdl_multi) SDL_UnlockMutex(premutex);
             }
 
             // make texture now if preload didn't finish it
@@ -1564,25 +1866,7 @@ int sdl_tx_load(int sprite,int sink,int freeze,int scale,int cr,int cg,int cb,in
         }
 
         sdl_tx_best(stx);
-
-        // remove from old pos
-        ntx=sdlt[stx].hnext;
-        ptx=sdlt[stx].hprev;
-
-        if (ptx==STX_NONE) sdlt_cache[hash]=ntx;
-        else sdlt[ptx].hnext=sdlt[stx].hnext;
-
-        if (ntx!=STX_NONE) sdlt[ntx].hprev=sdlt[stx].hprev;
-
-        // add to top pos
-        ntx=sdlt_cache[hash];
-
-        if (ntx!=STX_NONE) sdlt[ntx].hprev=stx;
-
-        sdlt[stx].hprev=STX_NONE;
-        sdlt[stx].hnext=ntx;
-
-        sdlt_cache[hash]=stx;
+        sdl_tx_trim(stx);
 
         // update statistics
         if (fortick) sdlt[stx].fortick=fortick;
@@ -1592,140 +1876,85 @@ int sdl_tx_load(int sprite,int sink,int freeze,int scale,int cr,int cg,int cb,in
     }
     if (checkonly) return 0;
 
-    stx=sdlt_last;
-
-    // delete
-    if (sdlt[stx].flags) {
-        int hash2;
-
-        if (sdlt[stx].flags&SF_SPRITE) not_busy_or_panic(sdlt+stx);
-
-        if (sdlt[stx].flags&SF_SPRITE) hash2=hashfunc(sdlt[stx].sprite,sdlt[stx].ml,sdlt[stx].ll,sdlt[stx].rl,sdlt[stx].ul,sdlt[stx].dl);
-        else if (sdlt[stx].flags&SF_TEXT) hash2=hashfunc_text(sdlt[stx].text,sdlt[stx].text_color,sdlt[stx].text_flags);
-        else { hash2=0; warn("weird entry in texture cache!"); }
-
-        ntx=sdlt[stx].hnext;
-        ptx=sdlt[stx].hprev;
-
-        if (ptx==STX_NONE) {
-            if (sdlt_cache[hash2]!=stx) {
-                fail("sdli[sprite].stx!=stx\n");
-                exit(42);
-            }
-            sdlt_cache[hash2]=ntx;
-        } else {
-            sdlt[ptx].hnext=sdlt[stx].hnext;
-        }
-
-        if (ntx!=STX_NONE) {
-            sdlt[ntx].hprev=sdlt[stx].hprev;
-        }
-
-        if (sdlt[stx].flags&SF_DIDTEX) {
-            mem_tex-=sdlt[stx].xres*sdlt[stx].yres*sizeof(uint32_t);
-            if (sdlt[stx].tex) SDL_DestroyTexture(sdlt[stx].tex);
-        } else if (sdlt[stx].flags&SF_DIDALLOC) {
-            if (sdlt[stx].pixel) {
-#ifdef SDL_FAST_MALLOC
-                free(sdlt[stx].pixel);
-#else
-                xfree(sdlt[stx].pixel);
-#endif
-                sdlt[stx].pixel=NULL;
-            }
-        }
-#ifdef SDL_FAST_MALLOC
-        if (sdlt[stx].flags&SF_TEXT) {
-            free(sdlt[stx].text);
-            sdlt[stx].text=NULL;
-        }
-#else
-        if (sdlt[stx].flags&SF_TEXT) {
-            xfree(sdlt[stx].text);
-            sdlt[stx].text=NULL;
-        }
-#endif
+    if (!sdlt_nfree) sdl_tx_evict(sdl_tx_victim(STX_NONE,1));
 
-        sdlt[stx].flags=0;
-    } else texc_used++;
+    stx=sdlt_free[--sdlt_nfree];
+    texc_used++;
 
     // build
-    if (text) {
-        int w,h;
-        sdlt[stx].tex=sdl_maketext(text,(struct ddfont *)text_font,text_color,text_flags);
-        sdlt[stx].flags=SF_USED|SF_TEXT|SF_DIDALLOC|SF_DIDMAKE|SF_DIDTEX;
-        sdlt[stx].text_color=text_color;
-        sdlt[stx].text_flags=text_flags;
-        sdlt[stx].text_font=text_font;
-#ifdef SDL_FAST_MALLOC
-        sdlt[stx].text=strdup(text);
-#else
-        sdlt[stx].text=xstrdup(text,MEM_TEMP7);
-#endif
-        if (sdlt[stx].tex) {
-            SDL_QueryTexture(sdlt[stx].tex,NULL,NULL,&w,&h);
-            sdlt[stx].xres=w;
-            sdlt[stx].yres=h;
-        } else sdlt[stx].xres=sdlt[stx].yres=0;
-    } else {
-
-        if (preload!=1) sdl_ic_load(sprite);
-
-        // init
-        sdlt[stx].flags=SF_USED|SF_SPRITE|SF_BUSY;
-        sdlt[stx].sprite=sprite;
-        sdlt[stx].sink=sink;
-        sdlt[stx].freeze=freeze;
-        sdlt[stx].scale=scale;
-        sdlt[stx].cr=cr;
-        sdlt[stx].cg=cg;
-        sdlt[stx].cb=cb;
-        sdlt[stx].light=light;
-        sdlt[stx].sat=sat;
-        sdlt[stx].c1=c1;
-        sdlt[stx].c2=c2;
-        sdlt[stx].c3=c3;
-        sdlt[stx].shine=shine;
-        sdlt[stx].ml=ml;
-        sdlt[stx].ll=ll;
-        sdlt[stx].rl=rl;
-        sdlt[stx].ul=ul;
-        sdlt[stx].dl=dl;
-
-        if (preload!=1) sdl_make(sdlt+stx,sdli+sprite,preload);
-        unbusy(sdlt+stx);
-    }
-
-    mem_tex+=sdlt[stx].xres*sdlt[stx].yres*sizeof(uint32_t);
-
-    ntx=sdlt_cache[hash];
-
-    if (ntx!=STX_NONE) sdlt[ntx].hprev=stx;
-
-    sdlt[stx].hprev=STX_NONE;
-    sdlt[stx].hnext=ntx;
-
-    sdlt_cache[hash]=stx;
-
-    sdl_tx_best(stx);
+    if (preload!=1) sdl_ic_get(sprite,-1);
+
+    // init
+    sdlt[stx].flags=SF_USED|SF_SPRITE|SF_BUSY;
+    sdlt[stx].sprite=sprite;
+    sdlt[stx].sink=sink;
+    sdlt[stx].freeze=freeze;
+    sdlt[stx].scale=scale;
+    sdlt[stx].cr=cr;
+    sdlt[stx].cg=cg;
+    sdlt[stx].cb=cb;
+    sdlt[stx].light=light;
+    sdlt[stx].sat=sat;
+    sdlt[stx].c1=c1;
+    sdlt[stx].c2=c2;
+    sdlt[stx].c3=c3;
+    sdlt[stx].shine=shine;
+    sdlt[stx].ml=ml;
+    sdlt[stx].ll=ll;
+    sdlt[stx].rl=rl;
+    sdlt[stx].ul=ul;
+    sdlt[stx].dl=dl;
+
+    if (preload!=1) {
+        sdl_make(sdlt+stx,sdli+sprite,preload);
+        sdl_ic_put(sprite);
+    }
+    unbusy(sdlt+stx);
+
+    sdlt_key[stx]=key;
+    sdlt_insert(stx);
+
+    sdlt[stx].drawn=!preload;
+    sdl_tx_front(stx,SDLT_PROBATION);
+    sdl_tx_trim(stx);
 
     // update statistics
     if (fortick) sdlt[stx].fortick=fortick;
 
     if (preload) texc_pre++;
-    else if (sprite) {  // Do not count missed text sprites. Those are expected.
-        texc_miss++;
-    }
+    else texc_miss++;
 
     return stx;
 }
 
-static void sdl_blit_tex(SDL_Texture *tex,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
-    int addx=0,addy=0,dx,dy;
+// The part of its texture an entry takes, NULL if it's all of it.
+static inline SDL_Rect *sdl_tx_part(struct sdl_texture *st,SDL_Rect *part) {
+    if (!(st->flags&SF_ATLAS)) return NULL;
+
+    part->x=st->ax; part->w=st->xres*sdl_scale;
+    part->y=st->ay; part->h=st->yres*sdl_scale;
+
+    return part;
+}
+
+// Blits part of tex, all of it if part is NULL. Parts are only ever on atlas
+// pages. The quad goes into the batch, with the color and alpha modulation
+// the texture has right now.
+static void sdl_blit_tex(SDL_Texture *tex,const SDL_Rect *part,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
+    int addx=0,addy=0,dx,dy,tw,th;
     SDL_Rect dr,sr;
+    SDL_Color col;
     long long start=SDL_GetTicks64();
 
-    SDL_QueryTexture(tex, NULL, NULL, &dx, &dy);
+    if (part) {
+        dx=part->w;
+        dy=part->h;
+        tw=th=sdla_size;
+    } else {
+        SDL_QueryTexture(tex, NULL, NULL, &dx, &dy);
+        tw=dx;
+        th=dy;
+    }
 
     dx/=sdl_scale; dy/=sdl_scale;
     if (sx<clipsx) { addx=clipsx-sx; dx-=addx; sx=clipsx; }
@@ -1739,14 +1968,136 @@ static void sdl_blit_tex(SDL_Texture *tex,int sx,int sy,int clipsx,int clipsy,in
 
     sr.x=addx*sdl_scale; sr.w=dx;
     sr.y=addy*sdl_scale; sr.h=dy;
+    if (part) {
+        sr.x+=part->x;
+        sr.y+=part->y;
+    }
 
-    SDL_RenderCopy(sdlren,tex,&sr,&dr);
+    if (dx>0 && dy>0) {
+        SDL_GetTextureColorMod(tex,&col.r,&col.g,&col.b);
+        SDL_GetTextureAlphaMod(tex,&col.a);
+        sdl_queue_quad(tex,&dr,&sr,tw,th,col);
+    }
 
     sdl_time_blit+=SDL_GetTicks64()-start;
 }
 
 void sdl_blit(int stx,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
-    if (sdlt[stx].tex) sdl_blit_tex(sdlt[stx].tex,sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+    SDL_Rect part;
+
+    if (sdlt[stx].tex) sdl_blit_tex(sdlt[stx].tex,sdl_tx_part(sdlt+stx,&part),sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+}
+
+// The mesh used to apply the five lights, grid lines every 10 columns and
+// every 5 rows of a tile up to where the lights stop changing, plus the
+// edges of the sprite. The lights bend diagonally through every other cell,
+// alternating between falling and rising, and the cells are split along
+// those lines. Within each triangle the lights are linear then, or nearly.
+// They jump between the top of the tile and the wall faces, so every
+// triangle gets vertices of its own.
+#define SDL_MESH_X      8
+#define SDL_MESH_Y      6
+
+static void sdl_blit_mesh(struct sdl_texture *st,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset,int ml,int ll,int rl,int ul,int dl) {
+    SDL_Vertex vert[(SDL_MESH_X-1)*(SDL_MESH_Y-1)*6];
+    int gx[SDL_MESH_X],gy[SDL_MESH_Y];
+    int nx,ny,x,y,w,h,i,k,m,n=0,tx=0,ty=0,tw,th;
+    static const int tri[2][6][2]={
+        {{0,0},{1,0},{1,1},{0,0},{1,1},{0,1}},      // falling
+        {{0,0},{1,0},{0,1},{1,0},{1,1},{0,1}}       // rising
+    };
+    const int (*t)[2],(*p)[2];
+    float rx,ry;
+    Uint8 alpha;
+    SDL_Rect clip;
+    SDL_Vertex *v;
+    long long start=SDL_GetTicks64();
+
+    w=tw=st->xres*sdl_scale;
+    h=th=st->yres*sdl_scale;
+
+    // texture coordinates are relative to the whole atlas page
+    if (st->flags&SF_ATLAS) {
+        tx=st->ax; tw=sdla_size;
+        ty=st->ay; th=sdla_size;
+    }
+
+    for (nx=0,x=0; x<w && x<=60*sdl_scale; x+=10*sdl_scale) gx[nx++]=x;
+    gx[nx++]=w;
+    for (ny=0,y=0; y<h && y<=20*sdl_scale; y+=5*sdl_scale) gy[ny++]=y;
+    gy[ny++]=h;
+
+    SDL_GetTextureAlphaMod(st->tex,&alpha);
+
+    for (y=0; y<ny-1; y++) {
+        for (x=0; x<nx-1; x++) {
+            t=tri[(x+y)&1];
+            for (k=0; k<6; k+=3) {
+                p=t+k;
+
+                // the triangle decides which part of the tile this is
+                rx=(gx[x+p[0][0]]+gx[x+p[1][0]]+gx[x+p[2][0]])/3.0f;
+                ry=(gy[y+p[0][1]]+gy[y+p[1][1]]+gy[y+p[2][1]])/3.0f;
+
+                for (i=0; i<3; i++,n++) {
+                    v=vert+n;
+
+                    m=sdl_light5_mod(gx[x+p[i][0]],gy[y+p[i][1]],rx,ry,ml,ll,rl,ul,dl);
+
+                    v->position.x=(sx+x_offset)*sdl_scale+gx[x+p[i][0]];
+                    v->position.y=(sy+y_offset)*sdl_scale+gy[y+p[i][1]];
+                    v->color.r=v->color.g=v->color.b=m;
+                    v->color.a=alpha;
+                    v->tex_coord.x=(float)(tx+gx[x+p[i][0]])/tw;
+                    v->tex_coord.y=(float)(ty+gy[y+p[i][1]])/th;
+                }
+            }
+        }
+    }
+
+    // clipped meshes are drawn on their own, the rest goes into the batch
+    if (sx<clipsx || sy<clipsy || sx+st->xres>clipex || sy+st->yres>clipey) {
+        sdl_flush();
+        clip.x=(clipsx+x_offset)*sdl_scale; clip.w=(clipex-clipsx)*sdl_scale;
+        clip.y=(clipsy+y_offset)*sdl_scale; clip.h=(clipey-clipsy)*sdl_scale;
+        SDL_RenderSetClipRect(sdlren,&clip);
+        SDL_RenderGeometry(sdlren,st->tex,vert,n,NULL,0);
+        SDL_RenderSetClipRect(sdlren,NULL);
+        sdlq_calls++;
+    } else {
+        memcpy(sdl_queue(st->tex,n,n),vert,n*sizeof(SDL_Vertex));
+        for (i=0; i<n; i++) sdlq_index[sdlq_nindex+i]=sdlq_nvert+i;
+        sdlq_nvert+=n;
+        sdlq_nindex+=n;
+    }
+
+    sdl_time_blit+=SDL_GetTicks64()-start;
+}
+
+// Blits a sprite wanted with the lights ml to dl. If the texture was made
+// with different ones, it was made for lighting on the graphics card, see
+// sdl_gpu_light().
+void sdl_blit_light(int stx,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset,int ml,int ll,int rl,int ul,int dl) {
+    struct sdl_texture *st=sdlt+stx;
+    SDL_Rect part;
+    int m;
+
+    if (!st->tex) return;
+
+    if (st->ml==ml && st->ll==ll && st->rl==rl && st->ul==ul && st->dl==dl) {
+        sdl_blit_tex(st->tex,sdl_tx_part(st,&part),sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+        return;
+    }
+
+    if (ll==ml && rl==ml && ul==ml && dl==ml) {
+        m=sdl_light_mod(ml);
+        SDL_SetTextureColorMod(st->tex,m,m,m);
+        sdl_blit_tex(st->tex,sdl_tx_part(st,&part),sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+        SDL_SetTextureColorMod(st->tex,255,255,255);
+        return;
+    }
+
+    sdl_blit_mesh(st,sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset,ml,ll,rl,ul,dl);
 }
 
 #define DD_LEFT         0
@@ -1766,79 +2117,77 @@ void sdl_blit(int stx,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,
 #define G16TO32(color)  (int)((((color>>5) &31)/31.0f)*255.0f)
 #define B16TO32(color)  (int)((((color)    &31)/31.0f)*255.0f)
 
-#define MAXFONTHEIGHT   64
-
-SDL_Texture *sdl_maketext(const char *text,struct ddfont *font,uint32_t color,int flags) {
-    uint32_t *pixel,*dst;
+// Finds the glyph atlas for font, making it on first use.
+static struct sdl_glyphs *sdl_glyphs(struct ddfont *font) {
+    struct sdl_glyphs *sg;
     unsigned char *rawrun;
-    int x,y=0,sizex,sizey=0,sx=0;
-    const char *c,*otext=text;
-    long long start=SDL_GetTicks64();
-
-    for (sizex=0,c=text; *c; c++) sizex+=font[*c].dim*sdl_scale;
-
-    if (flags&(DD__FRAMEFONT|DD__SHADEFONT)) sizex+=sdl_scale*2;
-
-#ifdef SDL_FAST_MALLOC
-    pixel=calloc(sizex*MAXFONTHEIGHT,sizeof(uint32_t));
-#else
-    pixel=xcalloc(sizex*MAXFONTHEIGHT*sizeof(uint32_t),MEM_SDL_PIXEL2);
-#endif
-    if (pixel==NULL) return NULL;
-
-    while (*text && *text!=DDT) {
+    uint32_t *pixel,*dst;
+    int n,x,y,w,h,sizex,sizey;
+    long long start;
 
-        if (*text<0) { note("PANIC: char over limit"); text++; continue; }
+    for (n=0; n<sdlg_cnt; n++)
+        if (sdlg[n].font==font) return sdlg+n;
 
-        rawrun=font[*text].raw;
+    if (sdlg_cnt==SDLG_MAX) {
+        warn("too many fonts in sdl_glyphs()");
+        return NULL;
+    }
+    sg=sdlg+sdlg_cnt;
+    sg->font=font;
 
-        x=sx;
-        y=0;
+    start=SDL_GetTicks64();
 
-        dst=pixel+x+y*sizex;
+    // measure, characters are drawn from their top left corner
+    for (n=sg->cw=sg->ch=0; n<SDLG_CHARS; n++) {
+        for (rawrun=font[n].raw,x=y=w=h=0; rawrun && *rawrun!=255; rawrun++) {
+            if (*rawrun==254) { y++; x=0; continue; }
+            x+=*rawrun;
+            w=max(w,x+1);
+            h=max(h,y+1);
+        }
+        sg->w[n]=w;
+        sg->h[n]=h;
+        sg->cw=max(sg->cw,w+1);
+        sg->ch=max(sg->ch,h+1);
+    }
 
-        while (*rawrun!=255) {
+    sizex=sg->cw*SDLG_ROW;
+    sizey=sg->ch*(SDLG_CHARS/SDLG_ROW);
 
-            if (*rawrun==254) {
-                y++;
-                x=sx;
-                rawrun++;
-                dst=pixel+x+y*sizex;
-                if (y>sizey) sizey=y;
-                continue;
-            }
+#ifdef SDL_FAST_MALLOC
+    pixel=calloc(sizex*sizey,sizeof(uint32_t));
+#else
+    pixel=xcalloc(sizex*sizey*sizeof(uint32_t),MEM_SDL_PIXEL2);
+#endif
+    if (!pixel) return NULL;
 
-            dst+=*rawrun;
+    // draw them in white, the color comes from the vertices
+    for (n=0; n<SDLG_CHARS; n++) {
+        dst=pixel+(n%SDLG_ROW)*sg->cw+(n/SDLG_ROW)*sg->ch*sizex;
+        for (rawrun=font[n].raw,x=y=0; rawrun && *rawrun!=255; rawrun++) {
+            if (*rawrun==254) { y++; x=0; continue; }
             x+=*rawrun;
-
-            rawrun++;
-            *dst=color;
+            dst[x+y*sizex]=0xffffffff;
         }
-        sx+=font[*text++].dim*sdl_scale;
     }
 
-    if (sizex<1) sizex=1;
-    if (sizey<1) sizey=1;
-
-    sizey++;
-    sdl_time_text+=SDL_GetTicks64()-start;
-
-    start=SDL_GetTicks64();
-    SDL_Texture *texture = SDL_CreateTexture(sdlren,SDL_PIXELFORMAT_ARGB8888,SDL_TEXTUREACCESS_STATIC,sizex,sizey);
-    if (texture) {
-        SDL_UpdateTexture(texture,NULL,pixel,sizex*sizeof(uint32_t));
-        SDL_SetTextureBlendMode(texture,SDL_BLENDMODE_BLEND);
+    sg->tex=SDL_CreateTexture(sdlren,SDL_PIXELFORMAT_ARGB8888,SDL_TEXTUREACCESS_STATIC,sizex,sizey);
+    if (sg->tex) {
+        SDL_UpdateTexture(sg->tex,NULL,pixel,sizex*sizeof(uint32_t));
+        SDL_SetTextureBlendMode(sg->tex,SDL_BLENDMODE_BLEND);
+        sdlg_cnt++;
     } else {
-        warn("SDL_texture Error: %s maketext (%s)",SDL_GetError(),otext);
+        warn("SDL_texture Error: %s in sdl_glyphs",SDL_GetError());
+        sg=NULL;
     }
 #ifdef SDL_FAST_MALLOC
     free(pixel);
 #else
     xfree(pixel);
 #endif
-    sdl_time_tex+=SDL_GetTicks64()-start;
+    sdl_time_text+=SDL_GetTicks64()-start;
 
-    return texture;
+    return sg;
 }
 
 #ifdef DEVELOPER
@@ -1853,9 +2202,6 @@ int dump_cmp(const void *ca,const void *cb) {
     if (!sdlt[a].flags) return 1;
     if (!sdlt[b].flags) return -1;
 
-    if (sdlt[a].flags&SF_TEXT) return 1;
-    if (sdlt[b].flags&SF_TEXT) return -1;
-
     if ((tmp=sdlt[a].sprite-sdlt[b].sprite)!=0) return tmp;
 
     if ((tmp=sdlt[a].ml-sdlt[b].ml)!=0) return tmp;
@@ -1867,7 +2213,7 @@ int dump_cmp(const void *ca,const void *cb) {
 }
 
 void sdl_dump_spritecache(void) {
-    int i,n,cnt=0,uni=0,text=0;
+    int i,n,cnt=0,uni=0;
     long long size=0;
     char filename[MAX_PATH];
     FILE *fp;
@@ -1886,12 +2232,9 @@ void sdl_dump_spritecache(void) {
         n=dumpidx[i];
         if (!sdlt[n].flags) break;
 
-        if (sdlt[n].flags&SF_TEXT) text++;
-        else {
-            if (i==0) uni++;
-            else if (sdlt[dumpidx[i]].sprite!=sdlt[dumpidx[i-1]].sprite) uni++;
-            cnt++;
-        }
+        if (i==0) uni++;
+        else if (sdlt[dumpidx[i]].sprite!=sdlt[dumpidx[i-1]].sprite) uni++;
+        cnt++;
 
         if (sdlt[n].flags&SF_SPRITE)
             fprintf(fp,"Sprite: %6d (%7d) %s%s%s%s%s\n",
@@ -1924,19 +2267,10 @@ void sdl_dump_spritecache(void) {
                    sdlt[n].shine,
                    sdlt[n].xres,
                    sdlt[n].yres);*/
-        if (sdlt[n].flags&SF_TEXT)
-            fprintf(fp,"Color: %08X, Flags: %04X, Font: %p, Text: %s (%dx%d)\n",
-                    sdlt[n].text_color,
-                    sdlt[n].text_flags,
-                    sdlt[n].text_font,
-                    sdlt[n].text,
-                    sdlt[n].xres,
-                    sdlt[n].yres);
-
         size+=sdlt[n].xres*sdlt[n].yres*sizeof(uint32_t);
 
     }
-    fprintf(fp,"\n%d unique sprites, %d sprites + %d texts of %d used. %.2fM texture memory.\n",uni,cnt,text,MAX_TEXCACHE,size/(1024.0*1024.0));
+    fprintf(fp,"\n%d unique sprites, %d sprites of %d used. %.2fM texture memory.\n",uni,cnt,MAX_TEXCACHE,size/(1024.0*1024.0));
     fclose(fp);
     xfree(dumpidx);
 }
@@ -1944,12 +2278,10 @@ void sdl_dump_spritecache(void) {
 
 void sdl_exit(void) {
 
-    if (sdl_zip1) zip_close(sdl_zip1);
-    if (sdl_zip1m) zip_close(sdl_zip1m);
-    if (sdl_zip1p) zip_close(sdl_zip1p);
-    if (sdl_zip2) zip_close(sdl_zip2);
-    if (sdl_zip2m) zip_close(sdl_zip2m);
-    if (sdl_zip2p) zip_close(sdl_zip2p);
+    int n;
+
+    for (n=0; sdl_zips && n<=sdl_multi; n++)
+        if (sdl_zips[n].open) sdl_zip_close(sdl_zips+n);
 
     if (game_options&GO_SOUND) Mix_Quit();
 #ifdef DEVELOPER
@@ -1958,42 +2290,61 @@ void sdl_exit(void) {
 }
 
 int sdl_drawtext(int sx,int sy,unsigned short int color,int flags,const char *text,struct ddfont *font,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
-    int dx,stx;
-    SDL_Texture *tex;
-    int r,g,b,a;
+    struct sdl_glyphs *sg;
+    int dx,x,y,n,cx0,cy0,cx1,cy1;
+    SDL_Rect dr,sr;
+    SDL_Color col;
     const char *c;
+    long long start;
 
     if (!*text) return sx;
 
-    r=R16TO32(color);
-    g=G16TO32(color);
-    b=B16TO32(color);
-    a=255;
+    for (dx=0,c=text; *c; c++) dx+=font[*c].dim;
 
-    if (flags&DD_NOCACHE) {
-        tex=sdl_maketext(text,font,IRGBA(r,g,b,a),flags);
-    } else {
-        stx=sdl_tx_load(0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,text,IRGBA(r,g,b,a),flags,font,0,0,0);
-        tex=sdlt[stx].tex;
-    }
+    if (flags&DD_CENTER) sx-=dx/2;
+    else if (flags&DD_RIGHT) sx-=dx;
 
-    for (dx=0,c=text; *c; c++) dx+=font[*c].dim;
+    if (!(sg=sdl_glyphs(font))) return sx+dx;
+
+    start=SDL_GetTicks64();
+
+    col.r=R16TO32(color);
+    col.g=G16TO32(color);
+    col.b=B16TO32(color);
+    col.a=255;
 
-    if (tex) {
-        if (flags&DD_CENTER) sx-=dx/2;
-        else if (flags&DD_RIGHT) sx-=dx;
+    // everything in real pixels from here on
+    cx0=(clipsx+x_offset)*sdl_scale; cx1=(clipex+x_offset)*sdl_scale;
+    cy0=(clipsy+y_offset)*sdl_scale; cy1=(clipey+y_offset)*sdl_scale;
 
-        sdl_blit_tex(tex,sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+    x=(sx+x_offset)*sdl_scale;
+    y=(sy+y_offset)*sdl_scale;
+
+    for (c=text; *c && *c!=DDT; c++) {
+        if (*c<0) { note("PANIC: char over limit"); continue; }
+        n=*c;
+
+        // the part of the character inside the clipping rectangle
+        dr.x=max(x,cx0); dr.w=min(x+sg->w[n],cx1)-dr.x;
+        dr.y=max(y,cy0); dr.h=min(y+sg->h[n],cy1)-dr.y;
+
+        if (dr.w>0 && dr.h>0) {
+            sr.x=(n%SDLG_ROW)*sg->cw+dr.x-x; sr.w=dr.w;
+            sr.y=(n/SDLG_ROW)*sg->ch+dr.y-y; sr.h=dr.h;
+            sdl_queue_quad(sg->tex,&dr,&sr,sg->cw*SDLG_ROW,sg->ch*(SDLG_CHARS/SDLG_ROW),col);
+        }
 
-        if (flags&DD_NOCACHE) SDL_DestroyTexture(tex);
+        x+=font[n].dim*sdl_scale;
     }
 
+    sdl_time_text+=SDL_GetTicks64()-start;
+
     return sx+dx;
 }
 
 void sdl_rect(int sx,int sy,int ex,int ey,unsigned short int color,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
     int r,g,b,a;
-    SDL_Rect rc;
+    SDL_Color col;
 
     r=R16TO32(color);
     g=G16TO32(color);
@@ -2007,16 +2358,13 @@ void sdl_rect(int sx,int sy,int ex,int ey,unsigned short int color,int clipsx,in
 
     if (sx>ex || sy>ey) return;
 
-    rc.x=(sx+x_offset)*sdl_scale; rc.w=(ex-sx)*sdl_scale;
-    rc.y=(sy+y_offset)*sdl_scale; rc.h=(ey-sy)*sdl_scale;
-
-    SDL_SetRenderDrawColor(sdlren,r,g,b,a);
-    SDL_RenderFillRect(sdlren,&rc);
+    col.r=r; col.g=g; col.b=b; col.a=a;
+    sdl_queue_fill((sx+x_offset)*sdl_scale,(sy+y_offset)*sdl_scale,(ex-sx)*sdl_scale,(ey-sy)*sdl_scale,col);
 }
 
 void sdl_shaded_rect(int sx,int sy,int ex,int ey,unsigned short int color,unsigned short alpha,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
     int r,g,b,a;
-    SDL_Rect rc;
+    SDL_Color col;
 
     r=R16TO32(color);
     g=G16TO32(color);
@@ -2030,102 +2378,28 @@ void sdl_shaded_rect(int sx,int sy,int ex,int ey,unsigned short int color,unsign
 
     if (sx>ex || sy>ey) return;
 
-    rc.x=(sx+x_offset)*sdl_scale; rc.w=(ex-sx)*sdl_scale;
-    rc.y=(sy+y_offset)*sdl_scale; rc.h=(ey-sy)*sdl_scale;
-
-    SDL_SetRenderDrawColor(sdlren,r,g,b,a);
-    SDL_SetRenderDrawBlendMode(sdlren,SDL_BLENDMODE_BLEND);
-    SDL_RenderFillRect(sdlren,&rc);
+    col.r=r; col.g=g; col.b=b; col.a=a;
+    sdl_queue_fill((sx+x_offset)*sdl_scale,(sy+y_offset)*sdl_scale,(ex-sx)*sdl_scale,(ey-sy)*sdl_scale,col);
 }
 
 void sdl_pixel(int x,int y,unsigned short color,int x_offset,int y_offset) {
-    int r,g,b,a,i;
-    SDL_Point pt[16];
+    SDL_Color col;
 
-    r=R16TO32(color);
-    g=G16TO32(color);
-    b=B16TO32(color);
-    a=255;
+    col.r=R16TO32(color);
+    col.g=G16TO32(color);
+    col.b=B16TO32(color);
+    col.a=255;
 
-    SDL_SetRenderDrawColor(sdlren,r,g,b,a);
-    switch (sdl_scale) {
-        case 1:     SDL_RenderDrawPoint(sdlren,x+x_offset,y+y_offset); return;
-        case 2:     pt[0].x=(x+x_offset)*sdl_scale;
-                    pt[0].y=(y+y_offset)*sdl_scale;
-                    pt[1].x=pt[0].x+1;
-                    pt[1].y=pt[0].y;
-                    pt[2].x=pt[0].x;
-                    pt[2].y=pt[0].y+1;
-                    pt[3].x=pt[0].x+1;
-                    pt[3].y=pt[0].y+1;
-                    i=4;
-                    break;
-        case 3:     pt[0].x=(x+x_offset)*sdl_scale;
-                    pt[0].y=(y+y_offset)*sdl_scale;
-                    pt[1].x=pt[0].x+1;
-                    pt[1].y=pt[0].y;
-                    pt[2].x=pt[0].x;
-                    pt[2].y=pt[0].y+1;
-                    pt[3].x=pt[0].x+1;
-                    pt[3].y=pt[0].y+1;
-                    pt[4].x=pt[0].x+2;
-                    pt[4].y=pt[0].y;
-                    pt[5].x=pt[0].x;
-                    pt[5].y=pt[0].y+2;
-                    pt[6].x=pt[0].x+2;
-                    pt[6].y=pt[0].y+2;
-                    pt[7].x=pt[0].x+2;
-                    pt[7].y=pt[0].y+1;
-                    pt[8].x=pt[0].x+1;
-                    pt[8].y=pt[0].y+2;
-                    i=9;
-                    break;
-        case 4:     pt[0].x=(x+x_offset)*sdl_scale;
-                    pt[0].y=(y+y_offset)*sdl_scale;
-                    pt[1].x=pt[0].x+1;
-                    pt[1].y=pt[0].y;
-                    pt[2].x=pt[0].x;
-                    pt[2].y=pt[0].y+1;
-                    pt[3].x=pt[0].x+1;
-                    pt[3].y=pt[0].y+1;
-                    pt[4].x=pt[0].x+2;
-                    pt[4].y=pt[0].y;
-                    pt[5].x=pt[0].x;
-                    pt[5].y=pt[0].y+2;
-                    pt[6].x=pt[0].x+2;
-                    pt[6].y=pt[0].y+2;
-                    pt[7].x=pt[0].x+2;
-                    pt[7].y=pt[0].y+1;
-                    pt[8].x=pt[0].x+1;
-                    pt[8].y=pt[0].y+2;
-                    pt[9].x=pt[0].x+3;
-                    pt[9].y=pt[0].y;
-                    pt[10].x=pt[0].x+3;
-                    pt[10].y=pt[0].y+1;
-                    pt[11].x=pt[0].x+3;
-                    pt[11].y=pt[0].y+2;
-                    pt[12].x=pt[0].x+3;
-                    pt[12].y=pt[0].y+3;
-                    pt[13].x=pt[0].x;
-                    pt[13].y=pt[0].y+3;
-                    pt[14].x=pt[0].x+1;
-                    pt[14].y=pt[0].y+3;
-                    pt[15].x=pt[0].x+2;
-                    pt[15].y=pt[0].y+3;
-                    i=16;
-                    break;
-        default:    warn("unsupported scale %d in sdl_pixel()",sdl_scale); return;
-    }
-    SDL_RenderDrawPoints(sdlren,pt,i);
+    sdl_queue_fill((x+x_offset)*sdl_scale,(y+y_offset)*sdl_scale,sdl_scale,sdl_scale,col);
 }
 
 void sdl_line(int fx,int fy,int tx,int ty,unsigned short color,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
-    int r,g,b,a;
+    SDL_Color col;
 
-    r=R16TO32(color);
-    g=G16TO32(color);
-    b=B16TO32(color);
-    a=255;
+    col.r=R16TO32(color);
+    col.g=G16TO32(color);
+    col.b=B16TO32(color);
+    col.a=255;
 
     if (fx<clipsx) fx=clipsx;
     if (fy<clipsy) fy=clipsy;
@@ -2140,9 +2414,8 @@ void sdl_line(int fx,int fy,int tx,int ty,unsigned short color,int clipsx,int cl
     fx+=x_offset; tx+=x_offset;
     fy+=y_offset; ty+=y_offset;
 
-    SDL_SetRenderDrawColor(sdlren,r,g,b,a);
     // TODO: This is a thinner line when scaled up. It looks surprisingly good. Maybe keep it this way?
-    SDL_RenderDrawLine(sdlren,fx*sdl_scale,fy*sdl_scale,tx*sdl_scale,ty*sdl_scale);
+    sdl_queue_line(fx*sdl_scale,fy*sdl_scale,tx*sdl_scale,ty*sdl_scale,col);
 }
 
 void gui_sdl_keyproc(int wparam);
@@ -2153,6 +2426,7 @@ void context_keyup(int key);
 
 void sdl_loop(void) {
     SDL_Event event;
+    int n;
 
     while (SDL_PollEvent(&event)) {
         switch(event.type) {
@@ -2184,6 +2458,10 @@ void sdl_loop(void) {
             case SDL_MOUSEWHEEL:
                 gui_sdl_mouseproc(event.wheel.x,event.wheel.y,SDL_MOUM_WHEEL,0);
                 break;
+            case SDL_RENDER_TARGETS_RESET:
+            case SDL_RENDER_DEVICE_RESET:
+                for (n=0; n<SDL_TARGETS; n++) sdl_tgt[n].lost=1;
+                break;
             case SDL_WINDOWEVENT:
                 if (event.window.event==SDL_WINDOWEVENT_FOCUS_GAINED) {
                     int x, y;
@@ -2424,10 +2702,7 @@ void sdl_pre_add(int attick,int sprite,signed char sink,unsigned char freeze,uns
     int n;
     long long start;
 
-    if ((pre_in+1)%MAXPRE==pre_3) { // buffer is full
-        if (sdl_multi) SDL_SemPost(prework); // nudge background tasks
-        return;
-    }
+    if ((pre_in+1)%MAXPRE==pre_3) return; // buffer is full
 
     if (sprite>MAXSPRITE || sprite<0) {
         note("illegal sprite %d wanted in pre_add",sprite);
@@ -2437,10 +2712,12 @@ void sdl_pre_add(int attick,int sprite,signed char sink,unsigned char freeze,uns
     // Find in texture cache
     // Will allocate a new entry if not found, or return -1 if already in cache
     start=SDL_GetTicks64();
-    n=sdl_tx_load(sprite,sink,freeze,scale,cr,cg,cb,light,sat,c1,c2,c3,shine,ml,ll,rl,ul,dl,NULL,0,0,NULL,0,1,attick);
+    n=sdl_tx_load(sprite,sink,freeze,scale,cr,cg,cb,light,sat,c1,c2,c3,shine,ml,ll,rl,ul,dl,0,1,attick);
     sdl_time_alloc+=SDL_GetTicks64()-start;
     if (n==-1) return;
 
+    sdl_ic_prefetch(sprite);
+
     pre[pre_in].stx=n;
     pre[pre_in].attick=attick;
     pre_in=(pre_in+1)%MAXPRE;
@@ -2455,17 +2732,49 @@ void sdl_lock(void *a){
 
 #define SDL_LockMutex(a)  sdl_lock(a)
 
+// Job: make (stage 2) a prefetched texture, unless the main thread got to
+// it first, or it was evicted in the meantime.
+static void sdl_pre_2(void *data,int worker) {
+    struct sdl_texture *st=sdlt+(int)(long long)data;
+
+    if (sdl_multi) SDL_LockMutex(premutex);
+    if ((st->flags&(SF_SPRITE|SF_DIDALLOC|SF_DIDMAKE|SF_BUSY))!=(SF_SPRITE|SF_DIDALLOC)) {
+        if (sdl_multi) SDL_UnlockMutex(premutex);
+        return;
+    }
+    st->flags|=SF_BUSY;
+    if (sdl_multi) SDL_UnlockMutex(premutex);
+
+    // the image might have been evicted since stage 1, get it back
+    sdl_ic_get(st->sprite,worker);
+    sdl_make(st,sdli+st->sprite,2);
+    sdl_ic_put(st->sprite);
+
+    if (sdl_multi) SDL_LockMutex(premutex);
+    st->flags&=~SF_BUSY;
+    st->flags|=SF_DIDMAKE;
+    if (sdl_multi) {
+        SDL_CondBroadcast(predone);
+        SDL_UnlockMutex(premutex);
+    }
+}
+
 int sdl_pre_1(void) {
 
     if (pre_in==pre_1) return 0;  // prefetch buffer is empty
 
-    if (!(sdlt[pre[pre_1].stx].flags&SF_DIDALLOC)) {
+    // the entry might have been evicted, and be unused now
+    if ((sdlt[pre[pre_1].stx].flags&SF_SPRITE) && !(sdlt[pre[pre_1].stx].flags&SF_DIDALLOC)) {
 
-        sdl_ic_load(sdlt[pre[pre_1].stx].sprite);
+        // the image is loaded by a background worker, come back later if it isn't there yet
+        if (!sdl_ic_prefetch(sdlt[pre[pre_1].stx].sprite)) return 0;
 
+        sdl_ic_get(sdlt[pre[pre_1].stx].sprite,-1);
         sdl_make(sdlt+pre[pre_1].stx,sdli+sdlt[pre[pre_1].stx].sprite,1);
+        sdl_ic_put(sdlt[pre[pre_1].stx].sprite);
+        sdl_tx_trim(pre[pre_1].stx);
 
-        if (sdl_multi) SDL_SemPost(prework);
+        sdl_job_submit(sdl_pre_2,(void *)(long long)pre[pre_1].stx);
     }
     pre_1=(pre_1+1)%MAXPRE;
 
@@ -2473,44 +2782,19 @@ int sdl_pre_1(void) {
 
 }
 
-int sdl_pre_2(void) {
-    int i,work=0;
-
-    if (pre_1==pre_2) return 0;  // prefetch buffer is empty
-
-    for (i=pre_2; i!=pre_1; i=(i+1)%MAXPRE) {
-
-        if (sdl_multi) SDL_LockMutex(premutex);
-
-        //printf("Preload2: Slot %d, STX %d, flags %X\n",i,pre[i].stx,pre[i].stx!=-1 ? sdlt[pre[i].stx].flags : 0);
-        if (pre[i].stx!=STX_NONE && !(sdlt[pre[i].stx].flags&(SF_DIDMAKE|SF_BUSY)) && (sdlt[pre[i].stx].flags&SF_DIDALLOC)) {
-            //printf("Preload2: Slot %d, sprite %d (%d, %d, %d, %d)\n",i,pre[i].sprite,pre_in,pre_1,pre_2,pre_3); fflush(stdout);
-
-            sdlt[pre[i].stx].flags|=SF_BUSY;
-            if (sdl_multi) SDL_UnlockMutex(premutex);
-
-            sdl_make(sdlt+pre[i].stx,sdli+sdlt[pre[i].stx].sprite,2);
-
-            if (sdl_multi) SDL_LockMutex(premutex);
-            sdlt[pre[i].stx].flags&=~SF_BUSY;
-            sdlt[pre[i].stx].flags|=SF_DIDMAKE;
-            if (sdl_multi) SDL_UnlockMutex(premutex);
-            work=1;
-            break;
-
-        } else {
-            if (sdl_multi) SDL_UnlockMutex(premutex);
-        }
-    }
+// Moves past the entries which are done with stage 2. Those which were
+// evicted before they could be made are skipped as well.
+static void sdl_pre_2_done(void) {
+    struct sdl_texture *st;
 
     if (sdl_multi) SDL_LockMutex(premutex);
-    while ((pre[pre_2].stx==STX_NONE || (sdlt[pre[pre_2].stx].flags&SF_DIDMAKE)) && pre_1!=pre_2) {
-        work=1;
+    while (pre_1!=pre_2) {
+        st=sdlt+pre[pre_2].stx;
+        if (pre[pre_2].stx!=STX_NONE && (st->flags&SF_BUSY)) break;
+        if (pre[pre_2].stx!=STX_NONE && (st->flags&(SF_SPRITE|SF_DIDALLOC|SF_DIDMAKE))==(SF_SPRITE|SF_DIDALLOC)) break;
         pre_2=(pre_2+1)%MAXPRE;
     }
     if (sdl_multi) SDL_UnlockMutex(premutex);
-
-    return work;
 }
 
 int sdl_pre_3(void) {
@@ -2529,18 +2813,23 @@ int sdl_pre_do(int curtick) {
     long long start;
     int size;
 
+    sdlt_tick=curtick;
+
     start=SDL_GetTicks64();
     sdl_pre_1();
     sdl_time_pre1+=SDL_GetTicks64()-start;
 
     start=SDL_GetTicks64();
-    if (!sdl_multi) sdl_pre_2();
+    if (!sdl_multi) sdl_job_run();
+    sdl_pre_2_done();
     sdl_time_pre2+=SDL_GetTicks64()-start;
 
     start=SDL_GetTicks64();
     sdl_pre_3();
     sdl_time_pre3+=SDL_GetTicks64()-start;
 
+    sdl_gfx_check();
+
     if (pre_in>=pre_1) size=pre_in-pre_1;
     else size=MAXPRE+pre_in-pre_1;
 
@@ -2553,40 +2842,19 @@ int sdl_pre_do(int curtick) {
     return size;
 }
 
-uint64_t sdl_backgnd_wait=0,sdl_backgnd_work=0;
-
-int sdl_pre_backgnd(void *ptr) {
-    uint64_t start;
-
-    while (!quit) {
-        start=SDL_GetTicks64();
-        SDL_SemWait(prework);
-        sdl_backgnd_wait+=SDL_GetTicks64()-start;
-
-        start=SDL_GetTicks64();
-        sdl_pre_2();
-        sdl_backgnd_work+=SDL_GetTicks64()-start;
-    }
-
-    return 0;
-}
-
 void sdl_bargraph_add(int dx,unsigned char *data,int val) {
     memmove(data+1,data,dx-1);
     data[0]=val;
 }
 
 void sdl_bargraph(int sx,int sy,int dx,unsigned char *data,int x_offset,int y_offset) {
+    static const SDL_Color red={255,80,80,127},green={80,255,80,127};
     int n;
 
-    for (n=0; n<dx; n++) {
-        if (data[n]>40) SDL_SetRenderDrawColor(sdlren,255,80,80,127);
-        else SDL_SetRenderDrawColor(sdlren,80,255,80,127);
-
-        SDL_RenderDrawLine(sdlren,
-                           (sx+n+x_offset)*sdl_scale,(sy+y_offset)*sdl_scale,
-                           (sx+n+x_offset)*sdl_scale,(sy-data[n]+y_offset)*sdl_scale);
-    }
+    for (n=0; n<dx; n++)
+        sdl_queue_line((sx+n+x_offset)*sdl_scale,(sy+y_offset)*sdl_scale,
+                       (sx+n+x_offset)*sdl_scale,(sy-data[n]+y_offset)*sdl_scale,
+                       data[n]>40?red:green);
 }
 
 int sdl_is_shown(void) {
@@ -2619,11 +2887,103 @@ void *sdl_create_texture(int width,int height) {
 }
 
 void sdl_render_copy(void *tex,void *sr,void *dr) {
+    sdl_flush();
     SDL_RenderCopy(sdlren,tex,sr,dr);
+    sdlq_calls++;
 }
 
 void sdl_render_copy_ex(void *tex,void *sr,void *dr,double angle) {
+    sdl_flush();
     SDL_RenderCopyEx(sdlren,tex,sr,dr,angle,0,SDL_FLIP_NONE);
+    sdlq_calls++;
+}
+
+// Parts of the game view get drawn into render targets and the targets get
+// drawn instead, for as long as those parts stay the same, see dl_ground()
+// and display_game(). Starts drawing into target nr of w by h, targets can
+// be nested. Returns 0 if there is none, 1 if it holds what was drawn into
+// it before and 2 if it's new or lost its contents and has to be drawn all
+// over.
+int sdl_target_begin(int nr,int w,int h) {
+    struct sdl_target *st=sdl_tgt+nr;
+    int ret=1;
+
+    if (!sdl_tgt_ok || sdl_tgt_depth==SDL_TARGETS) return 0;
+
+    sdl_flush();
+
+    if (!st->tex || st->w!=w || st->h!=h) {
+        if (st->tex) SDL_DestroyTexture(st->tex);
+        st->tex=SDL_CreateTexture(sdlren,SDL_PIXELFORMAT_ARGB8888,SDL_TEXTUREACCESS_TARGET,w*sdl_scale,h*sdl_scale);
+        if (!st->tex) {
+            warn("SDL_texture Error: %s in sdl_target_begin",SDL_GetError());
+            sdl_tgt_ok=0;
+            return 0;
+        }
+
+        // sprites are blended into the target, so its colors are
+        // pre-multiplied with its alpha already
+        if (SDL_SetTextureBlendMode(st->tex,SDL_ComposeCustomBlendMode(SDL_BLENDFACTOR_ONE,SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,SDL_BLENDOPERATION_ADD,
+                                                                      SDL_BLENDFACTOR_ONE,SDL_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,SDL_BLENDOPERATION_ADD))) {
+            note("no render target cache: %s",SDL_GetError());
+            SDL_DestroyTexture(st->tex);
+            st->tex=NULL;
+            sdl_tgt_ok=0;
+            return 0;
+        }
+        st->w=w;
+        st->h=h;
+        ret=2;
+    }
+    if (st->lost) {
+        st->lost=0;
+        ret=2;
+    }
+
+    if (SDL_SetRenderTarget(sdlren,st->tex)) {
+        warn("SDL_SetRenderTarget Error: %s in sdl_target_begin",SDL_GetError());
+        sdl_tgt_ok=0;
+        return 0;
+    }
+    sdl_tgt_stack[sdl_tgt_depth++]=nr;
+
+    return ret;
+}
+
+// Makes the part sx,sy to ex,ey of the current target transparent again.
+void sdl_target_clear(int sx,int sy,int ex,int ey) {
+    SDL_Rect rc;
+
+    rc.x=sx*sdl_scale; rc.w=(ex-sx)*sdl_scale;
+    rc.y=sy*sdl_scale; rc.h=(ey-sy)*sdl_scale;
+
+    sdl_flush();
+    SDL_SetRenderDrawBlendMode(sdlren,SDL_BLENDMODE_NONE);
+    SDL_SetRenderDrawColor(sdlren,0,0,0,0);
+    SDL_RenderFillRect(sdlren,&rc);
+    SDL_SetRenderDrawBlendMode(sdlren,SDL_BLENDMODE_BLEND);
+    sdlq_calls++;
+}
+
+// Back to drawing where we were drawing before sdl_target_begin().
+void sdl_target_end(void) {
+    if (!sdl_tgt_depth) return;
+
+    sdl_flush();
+    sdl_tgt_depth--;
+    if (sdl_tgt_depth) SDL_SetRenderTarget(sdlren,sdl_tgt[sdl_tgt_stack[sdl_tgt_depth-1]].tex);
+    else SDL_SetRenderTarget(sdlren,NULL);
+}
+
+// Draws target nr. Returns 0 if it doesn't hold anything to draw.
+int sdl_target_blit(int nr,int sx,int sy,int clipsx,int clipsy,int clipex,int clipey,int x_offset,int y_offset) {
+    struct sdl_target *st=sdl_tgt+nr;
+
+    if (!st->tex || st->lost) return 0;
+
+    sdl_blit_tex(st->tex,NULL,sx,sy,clipsx,clipsy,clipex,clipey,x_offset,y_offset);
+
+    return 1;
 }
 
 int sdl_tex_xres(int stx) {
@@ -2645,6 +3005,8 @@ void sdl_render_circle(int32_t centreX, int32_t centreY, int32_t radius,uint32_t
     int32_t tx = 1;
     int32_t ty = 1;
     int32_t error = (tx - diameter);
+    SDL_Color col;
+    int i;
 
     while (x >= y) {        
         pts[dC].x = centreX + x; pts[dC].y = centreY - y; dC++;
@@ -2669,8 +3031,8 @@ void sdl_render_circle(int32_t centreX, int32_t centreY, int32_t radius,uint32_t
         }
     }
 
-    SDL_SetRenderDrawColor(sdlren,IGET_R(color),IGET_G(color),IGET_B(color),IGET_A(color));
-    SDL_RenderDrawPoints(sdlren, pts, dC);
+    col.r=IGET_R(color); col.g=IGET_G(color); col.b=IGET_B(color); col.a=IGET_A(color);
+    for (i=0; i<dC; i++) sdl_queue_fill(pts[i].x,pts[i].y,1,1,col);
 
 }
 
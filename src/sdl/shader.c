@@ -0,0 +1,849 @@
+/*
+ * Part of Astonia Client (c) Daniel Brockhaus. Please read license.txt.
+ *
+ * Shader
+ *
+ * The per-pixel stages of the software shader used by sdl_make(): color
+ * balance, shine, lighting and freeze. Every stage works on a whole row of
+ * ARGB pixels. There is a scalar version of each row kernel, and SSE2 / AVX2
+ * versions which handle 4 / 8 pixels per iteration. The vector kernels give
+ * bit-identical results to the scalar ones, which stay as the fallback.
+ *
+ */
+
+#include <stdint.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHADER_X86
+#include <immintrin.h>
+#endif
+
+#include "../../src/astonia.h"
+#include "../../src/sdl.h"
+#include "../../src/sdl/_sdl.h"
+
+#define DDFX_MAX_FREEZE         8
+
+#define LIGHT_LEVELS            16
+
+struct sdl_shader sdl_shader;
+
+// Light lookup tables, one set for each combination of GO_LIGHTER and
+// GO_LIGHTER2. All four are built at startup, so changing game_options
+// just selects a different set.
+static int32_t light_lut[4][LIGHT_LEVELS][256];
+
+// ---------- scalar pixel functions ----------
+
+static inline int light_calc(int val,int light,uint64_t options) {
+    int v1,v2,m=3,d=4;
+
+    if (options&(GO_LIGHTER|GO_LIGHTER2)) {
+        v1=val*light/15;
+        v2=val*sqrt(light)/3.87;
+        if (options&GO_LIGHTER) { m--; d--; }
+        if (options&GO_LIGHTER2) { m-=2; d-=2; }
+        return (v1*m+v2)/d;
+    } else return val*light/15;
+}
+
+static inline uint32_t sdl_light(int light,uint32_t irgb) {
+    int r,g,b,a;
+
+    r=IGET_R(irgb);
+    g=IGET_G(irgb);
+    b=IGET_B(irgb);
+    a=IGET_A(irgb);
+
+    if (light==0) {
+        r=min(255,r*2+4);
+        g=min(255,g*2+4);
+        b=min(255,b*2+4);
+    } else {
+        r=light_calc(r,light,game_options);
+        g=light_calc(g,light,game_options);
+        b=light_calc(b,light,game_options);
+    }
+
+    return IRGBA(r,g,b,a);
+}
+
+static void light_lut_init(void) {
+    int n,light,val;
+    uint64_t options;
+
+    for (n=0; n<4; n++) {
+        options=((n&1)?GO_LIGHTER:0)|((n&2)?GO_LIGHTER2:0);
+
+        for (light=0; light<LIGHT_LEVELS; light++) {
+            for (val=0; val<256; val++) {
+                if (light==0) light_lut[n][light][val]=min(255,val*2+4);
+                else light_lut[n][light][val]=light_calc(val,light,options);
+            }
+        }
+    }
+}
+
+// Returns the lookup table for the given light level and the current
+// options, or NULL if the level is out of range.
+static inline const int32_t *light_lut_get(int light) {
+    int n;
+
+    if (light<0 || light>=LIGHT_LEVELS) return NULL;
+
+    n=((game_options&GO_LIGHTER)?1:0)|((game_options&GO_LIGHTER2)?2:0);
+
+    return light_lut[n][light];
+}
+
+static inline uint32_t light_lut_pix(const int32_t *lut,int light,uint32_t irgb) {
+    if (!lut) return sdl_light(light,irgb);
+
+    return IRGBA(lut[IGET_R(irgb)],lut[IGET_G(irgb)],lut[IGET_B(irgb)],IGET_A(irgb));
+}
+
+static inline uint32_t sdl_freeze(int freeze,uint32_t irgb) {
+    int r,g,b,a;
+
+    r=IGET_R(irgb);
+    g=IGET_G(irgb);
+    b=IGET_B(irgb);
+    a=IGET_A(irgb);
+
+    r=min(255,r+255*freeze/(3*DDFX_MAX_FREEZE-1));
+    g=min(255,g+255*freeze/(3*DDFX_MAX_FREEZE-1));
+    b=min(255,b+255*3*freeze/(3*DDFX_MAX_FREEZE-1));
+
+    return IRGBA(r,g,b,a);
+}
+
+uint32_t sdl_shine_pix(uint32_t irgb,unsigned short shine) {
+    int a;
+    double r,g,b;
+
+    r=IGET_R(irgb)/127.5;
+    g=IGET_G(irgb)/127.5;
+    b=IGET_B(irgb)/127.5;
+    a=IGET_A(irgb);
+
+    r=((r*r*r*r)*shine+r*(100.0-shine))/200.0;
+    g=((g*g*g*g)*shine+g*(100.0-shine))/200.0;
+    b=((b*b*b*b)*shine+b*(100.0-shine))/200.0;
+
+    if (r>1.0) r=1.0;
+    if (g>1.0) g=1.0;
+    if (b>1.0) b=1.0;
+
+    irgb=IRGBA((int)(r*255.0),(int)(g*255.0),(int)(b*255.0),a);
+
+    return irgb;
+}
+
+static uint32_t sdl_colorbalance(uint32_t irgb,char cr,char cg,char cb,char light,char sat) {
+    int r,g,b,a,grey;
+
+    r=IGET_R(irgb);
+    g=IGET_G(irgb);
+    b=IGET_B(irgb);
+    a=IGET_A(irgb);
+
+    // lightness
+    if (light) {
+        r+=light; g+=light; b+=light;
+    }
+
+    // saturation
+    if (sat) {
+        grey=(r+g+b)/3;
+        r=((r*(20-sat))+(grey*sat))/20;
+        g=((g*(20-sat))+(grey*sat))/20;
+        b=((b*(20-sat))+(grey*sat))/20;
+    }
+
+    // color balancing
+    cr*=0.75; cg*=0.75; cg*=0.75;
+
+    r+=cr; g-=cr/2; b-=cr/2;
+    r-=cg/2; g+=cg; b-=cg/2;
+    r-=cb/2; g-=cb/2; b+=cb;
+
+    if (r<0) r=0;
+    if (g<0) g=0;
+    if (b<0) b=0;
+
+    if (r>255) { g+=(r-255)/2; b+=(r-255)/2; r=255; }
+    if (g>255) { r+=(g-255)/2; b+=(g-255)/2; g=255; }
+    if (b>255) { r+=(b-255)/2; g+=(b-255)/2; b=255; }
+
+    if (r>255) r=255;
+    if (g>255) g=255;
+    if (b>255) b=255;
+
+    irgb=IRGBA(r,g,b,a);
+
+    return irgb;
+}
+
+// Five-way light blend for floor and wall tiles. v1 to v5 are the weights
+// of the middle, left, right, up and down lights, div is their sum. lut
+// holds the lookup tables of the five lights.
+static inline uint32_t sdl_light5(uint32_t irgb,const int32_t **lut,int ml,int ll,int rl,int ul,int dl,int v1,int v2,int v3,int v4,int v5,int div) {
+    int r,g,b,a;
+    uint32_t c;
+
+    c=light_lut_pix(lut[0],ml,irgb);
+    r=IGET_R(c)*v1; g=IGET_G(c)*v1; b=IGET_B(c)*v1;
+
+    if (v2) { c=light_lut_pix(lut[1],ll,irgb); r+=IGET_R(c)*v2; g+=IGET_G(c)*v2; b+=IGET_B(c)*v2; }
+    if (v3) { c=light_lut_pix(lut[2],rl,irgb); r+=IGET_R(c)*v3; g+=IGET_G(c)*v3; b+=IGET_B(c)*v3; }
+    if (v4) { c=light_lut_pix(lut[3],ul,irgb); r+=IGET_R(c)*v4; g+=IGET_G(c)*v4; b+=IGET_B(c)*v4; }
+    if (v5) { c=light_lut_pix(lut[4],dl,irgb); r+=IGET_R(c)*v5; g+=IGET_G(c)*v5; b+=IGET_B(c)*v5; }
+
+    a=IGET_A(irgb);
+    r/=div;
+    g/=div;
+    b/=div;
+
+    return IRGBA(r,g,b,a);
+}
+
+// Calculates the weights of the five lights for pixel x,y of a tile, v[0]
+// to v[4] for the middle, left, right, up and down lights.
+static void light_weight(int x,int y,int *v) {
+    int v1,v2,v3,v4,v5;
+
+    if (y<10*sdl_scale+(20*sdl_scale-abs(20*sdl_scale-x))/2) {
+
+        // This part calculates a floor tile, or the top of a wall tile
+        if (x/2<20*sdl_scale-y) v2=-(x/2-(20*sdl_scale-y));
+        else v2=0;
+        if (x/2>20*sdl_scale-y) v3=(x/2-(20*sdl_scale-y));
+        else v3=0;
+        if (x/2>y) v4=(x/2-y);
+        else v4=0;
+        if (x/2<y) v5=-(x/2-y);
+        else v5=0;
+
+        v1=20*sdl_scale-(v2+v3+v4+v5);
+    } else {
+
+        // This is for the lower part (left side and front as seen on the screen)
+        if (x<10*sdl_scale) v2=(10*sdl_scale-x)*2-2;
+        else v2=0;
+        if (x>10*sdl_scale && x<20*sdl_scale) v3=(x-10*sdl_scale)*2-2;
+        else v3=0;
+        if (x>20*sdl_scale && x<30*sdl_scale) v5=(10*sdl_scale-(x-20*sdl_scale))*2-2;
+        else v5=0;
+        if (x>30*sdl_scale && x<40*sdl_scale) v4=(x-30*sdl_scale)*2-2;
+        else v4=0;
+
+        v1=20*sdl_scale-(v2+v3+v4+v5)/2;
+    }
+
+    v[0]=v1; v[1]=v2; v[2]=v3; v[3]=v4; v[4]=v5;
+}
+
+// Calculates the weights of the five lights for row y of a tile. Results
+// are stored planar: v1 in wgt[0..cnt-1], v2 in wgt[stride..stride+cnt-1],
+// and so on, with the divisor in the sixth plane.
+static void light_weights(int32_t *wgt,int stride,int cnt,int y) {
+    int x,v[5];
+
+    for (x=0; x<cnt; x++) {
+        light_weight(x,y,v);
+
+        wgt[x]=v[0];
+        wgt[x+stride]=v[1];
+        wgt[x+stride*2]=v[2];
+        wgt[x+stride*3]=v[3];
+        wgt[x+stride*4]=v[4];
+        wgt[x+stride*5]=v[0]+v[1]+v[2]+v[3]+v[4];
+    }
+}
+
+// The weights only depend on the position in the tile and on sdl_scale,
+// so they are calculated once at startup. Below row 20*sdl_scale all rows
+// are the same, and from column 60*sdl_scale on only the middle light is
+// left (v1=div=20*sdl_scale), which is the same as uniform light.
+static struct light_mask {
+    int scale;
+    int width,height;
+    int32_t *wgt;
+} light_mask;
+
+static void light_mask_init(void) {
+    int y,size;
+
+    if (light_mask.wgt && light_mask.scale==sdl_scale) return;
+    if (light_mask.wgt) xfree(light_mask.wgt);
+
+    light_mask.scale=sdl_scale;
+    light_mask.width=60*sdl_scale;
+    light_mask.height=20*sdl_scale+1;
+
+    size=light_mask.width*6;
+    light_mask.wgt=xmalloc(light_mask.height*size*sizeof(int32_t),MEM_SDL_BASE);
+
+    for (y=0; y<light_mask.height; y++)
+        light_weights(light_mask.wgt+y*size,light_mask.width,light_mask.width,y);
+}
+
+// Returns the weights for row y. The planes are light_mask.width apart,
+// which is also the number of pixels covered; returned in *width.
+const int32_t *sdl_light_mask(int y,int *width) {
+    *width=light_mask.width;
+
+    return light_mask.wgt+min(y,light_mask.height-1)*light_mask.width*6;
+}
+
+// ---------- lighting on the graphics card ----------
+
+// What light level light leaves of a full channel, 0 to 255, relative to
+// SDL_NLIGHT. Textures lit on the graphics card are made with SDL_NLIGHT
+// and modulated with this. Light is linear in the channel value for all
+// levels but DDFX_BRIGHT, so this is exact but for rounding.
+int sdl_light_mod(int light) {
+    const int32_t *lut,*nlut;
+
+    lut=light_lut_get(light);
+    nlut=light_lut_get(SDL_NLIGHT);
+    if (!lut || !nlut[255]) return 255;
+
+    return min(255,lut[255]*255/nlut[255]);
+}
+
+// The weights of light_weight() for any point x,y, without the rounding.
+// The light jumps between the top of a tile and the wall faces, and between
+// the faces, so which part applies is decided by the point rx,ry instead.
+// That way points on the edges can be had for either side.
+static void light_weight_f(float x,float y,float rx,float ry,float *v) {
+    float s=sdl_scale;
+
+    if (rx>=light_mask.width) {
+        v[0]=20*s; v[1]=v[2]=v[3]=v[4]=0;
+    } else if (ry<10*s+(20*s-fabsf(20*s-rx))/2) {
+        v[1]=max(0,(20*s-y)-x/2);
+        v[2]=max(0,x/2-(20*s-y));
+        v[3]=max(0,x/2-y);
+        v[4]=max(0,y-x/2);
+        v[0]=20*s-(v[1]+v[2]+v[3]+v[4]);
+    } else {
+        v[1]=(rx<10*s)?(10*s-x)*2:0;
+        v[2]=(rx>10*s && rx<20*s)?(x-10*s)*2:0;
+        v[4]=(rx>20*s && rx<30*s)?(10*s-(x-20*s))*2:0;
+        v[3]=(rx>30*s && rx<40*s)?(x-30*s)*2:0;
+        v[0]=20*s-(v[1]+v[2]+v[3]+v[4])/2;
+    }
+}
+
+// The five lights blended at point x,y of a tile, as light5 does it, as a
+// modulation like sdl_light_mod(). rx,ry picks the part of the tile, see
+// light_weight_f().
+int sdl_light5_mod(float x,float y,float rx,float ry,int ml,int ll,int rl,int ul,int dl) {
+    float v[5],div,m;
+
+    light_weight_f(x,y,rx,ry,v);
+    div=v[0]+v[1]+v[2]+v[3]+v[4];
+    if (div<=0) return sdl_light_mod(ml);
+
+    m=(sdl_light_mod(ml)*v[0]+sdl_light_mod(ll)*v[1]+sdl_light_mod(rl)*v[2]+sdl_light_mod(ul)*v[3]+sdl_light_mod(dl)*v[4])/div;
+
+    return max(0,min(255,(int)(m+0.5f)));
+}
+
+// ---------- scalar row kernels ----------
+
+static void colorbalance_c(uint32_t *pixel,int cnt,int cr,int cg,int cb,int light,int sat) {
+    int n;
+
+    for (n=0; n<cnt; n++) pixel[n]=sdl_colorbalance(pixel[n],cr,cg,cb,light,sat);
+}
+
+static void shine_c(uint32_t *pixel,int cnt,int shine) {
+    int n;
+
+    for (n=0; n<cnt; n++) pixel[n]=sdl_shine_pix(pixel[n],shine);
+}
+
+static void light_c(uint32_t *pixel,int cnt,int light) {
+    int n;
+    const int32_t *lut;
+
+    lut=light_lut_get(light);
+    for (n=0; n<cnt; n++) pixel[n]=light_lut_pix(lut,light,pixel[n]);
+}
+
+static inline void light5_lut(const int32_t **lut,int ml,int ll,int rl,int ul,int dl) {
+    lut[0]=light_lut_get(ml);
+    lut[1]=light_lut_get(ll);
+    lut[2]=light_lut_get(rl);
+    lut[3]=light_lut_get(ul);
+    lut[4]=light_lut_get(dl);
+}
+
+static void light5_c(uint32_t *pixel,int cnt,const int32_t *wgt,int stride,int ml,int ll,int rl,int ul,int dl) {
+    int n;
+    const int32_t *lut[5];
+
+    light5_lut(lut,ml,ll,rl,ul,dl);
+    for (n=0; n<cnt; n++)
+        pixel[n]=sdl_light5(pixel[n],lut,ml,ll,rl,ul,dl,wgt[n],wgt[n+stride],wgt[n+stride*2],wgt[n+stride*3],wgt[n+stride*4],wgt[n+stride*5]);
+}
+
+static void freeze_c(uint32_t *pixel,int cnt,int freeze) {
+    int n;
+
+    for (n=0; n<cnt; n++) pixel[n]=sdl_freeze(freeze,pixel[n]);
+}
+
+#ifdef SHADER_X86
+
+// All vector kernels keep the channels in 32 bit integer lanes. Divisions
+// of small integers are done in float, which is exact for all values that
+// can occur here (|n|<2^24) and truncates towards zero just like C does.
+// The parts of the scalar code using double use double here, too, with the
+// same order of operations, so results match bit by bit. Lighting uses the
+// lookup tables. Light levels without a table go the scalar way.
+
+// precalculated color balance constants, see sdl_colorbalance()
+struct cb_param {
+    int light,sat;
+    int dr,dg,db;
+};
+
+static void cb_param_set(struct cb_param *cp,char cr,char cg,char cb,char light,char sat) {
+    cr*=0.75; cg*=0.75; cg*=0.75;
+
+    cp->light=light;
+    cp->sat=sat;
+    cp->dr=cr-cg/2-cb/2;
+    cp->dg=-cr/2+cg-cb/2;
+    cp->db=-cr/2-cg/2+cb;
+}
+
+// ---------- SSE2 ----------
+
+#define SSE2_FN __attribute__((target("sse2")))
+
+static inline SSE2_FN __m128i sse2_min(__m128i a,__m128i b) {
+    __m128i m=_mm_cmpgt_epi32(a,b);
+    return _mm_or_si128(_mm_and_si128(m,b),_mm_andnot_si128(m,a));
+}
+
+static inline SSE2_FN __m128i sse2_max(__m128i a,__m128i b) {
+    __m128i m=_mm_cmpgt_epi32(a,b);
+    return _mm_or_si128(_mm_and_si128(m,a),_mm_andnot_si128(m,b));
+}
+
+static inline SSE2_FN __m128i sse2_div(__m128i a,__m128 d) {
+    return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(a),d));
+}
+
+static inline SSE2_FN __m128i sse2_pack(__m128i a,__m128i r,__m128i g,__m128i b) {
+    return _mm_or_si128(_mm_or_si128(a,_mm_slli_epi32(r,16)),_mm_or_si128(_mm_slli_epi32(g,8),b));
+}
+
+#define SSE2_UNPACK(p,a,r,g,b) \
+    a=_mm_and_si128(p,_mm_set1_epi32(0xff000000)); \
+    r=_mm_and_si128(_mm_srli_epi32(p,16),_mm_set1_epi32(0xff)); \
+    g=_mm_and_si128(_mm_srli_epi32(p,8),_mm_set1_epi32(0xff)); \
+    b=_mm_and_si128(p,_mm_set1_epi32(0xff))
+
+// SSE2 has no gather, so look up the four lanes one by one
+static inline SSE2_FN __m128i sse2_light_chan(__m128i v,const int32_t *lut) {
+    int32_t i[4] __attribute__((aligned(16)));
+
+    _mm_store_si128((__m128i *)i,v);
+
+    return _mm_set_epi32(lut[i[3]],lut[i[2]],lut[i[1]],lut[i[0]]);
+}
+
+static inline SSE2_FN __m128d sse2_shine_pd(__m128d r,__m128d shine,__m128d shine2) {
+    __m128d t;
+
+    r=_mm_div_pd(r,_mm_set1_pd(127.5));
+    t=_mm_mul_pd(_mm_mul_pd(_mm_mul_pd(r,r),r),r);
+    r=_mm_div_pd(_mm_add_pd(_mm_mul_pd(t,shine),_mm_mul_pd(r,shine2)),_mm_set1_pd(200.0));
+    r=_mm_min_pd(r,_mm_set1_pd(1.0));
+
+    return _mm_mul_pd(r,_mm_set1_pd(255.0));
+}
+
+static inline SSE2_FN __m128i sse2_shine_chan(__m128i v,__m128d shine,__m128d shine2) {
+    __m128d lo,hi;
+
+    lo=sse2_shine_pd(_mm_cvtepi32_pd(v),shine,shine2);
+    hi=sse2_shine_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v,_MM_SHUFFLE(1,0,3,2))),shine,shine2);
+
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo),_mm_cvttpd_epi32(hi));
+}
+
+static SSE2_FN void colorbalance_sse2(uint32_t *pixel,int cnt,int cr,int cg,int cb,int light,int sat) {
+    int n;
+    struct cb_param cp;
+    __m128i p,a,r,g,b,ex,c255,zero;
+    __m128 f3,f20,fs1,fs2,grey;
+
+    cb_param_set(&cp,cr,cg,cb,light,sat);
+    c255=_mm_set1_epi32(255);
+    zero=_mm_setzero_si128();
+    f3=_mm_set1_ps(3.0f);
+    f20=_mm_set1_ps(20.0f);
+    fs1=_mm_set1_ps(20-cp.sat);
+    fs2=_mm_set1_ps(cp.sat);
+
+    for (n=0; n+4<=cnt; n+=4) {
+        p=_mm_loadu_si128((__m128i *)(pixel+n));
+        SSE2_UNPACK(p,a,r,g,b);
+
+        if (cp.light) {
+            ex=_mm_set1_epi32(cp.light);
+            r=_mm_add_epi32(r,ex); g=_mm_add_epi32(g,ex); b=_mm_add_epi32(b,ex);
+        }
+        if (cp.sat) {
+            grey=_mm_cvtepi32_ps(sse2_div(_mm_add_epi32(_mm_add_epi32(r,g),b),f3));
+            grey=_mm_mul_ps(grey,fs2);
+            r=_mm_cvttps_epi32(_mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(r),fs1),grey),f20));
+            g=_mm_cvttps_epi32(_mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(g),fs1),grey),f20));
+            b=_mm_cvttps_epi32(_mm_div_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(b),fs1),grey),f20));
+        }
+
+        r=sse2_max(_mm_add_epi32(r,_mm_set1_epi32(cp.dr)),zero);
+        g=sse2_max(_mm_add_epi32(g,_mm_set1_epi32(cp.dg)),zero);
+        b=sse2_max(_mm_add_epi32(b,_mm_set1_epi32(cp.db)),zero);
+
+        ex=_mm_srli_epi32(sse2_max(_mm_sub_epi32(r,c255),zero),1);
+        g=_mm_add_epi32(g,ex); b=_mm_add_epi32(b,ex); r=sse2_min(r,c255);
+        ex=_mm_srli_epi32(sse2_max(_mm_sub_epi32(g,c255),zero),1);
+        r=_mm_add_epi32(r,ex); b=_mm_add_epi32(b,ex); g=sse2_min(g,c255);
+        ex=_mm_srli_epi32(sse2_max(_mm_sub_epi32(b,c255),zero),1);
+        r=_mm_add_epi32(r,ex); g=_mm_add_epi32(g,ex); b=sse2_min(b,c255);
+
+        r=sse2_min(r,c255);
+        g=sse2_min(g,c255);
+
+        _mm_storeu_si128((__m128i *)(pixel+n),sse2_pack(a,r,g,b));
+    }
+    colorbalance_c(pixel+n,cnt-n,cr,cg,cb,light,sat);
+}
+
+static SSE2_FN void shine_sse2(uint32_t *pixel,int cnt,int shine) {
+    int n;
+    __m128i p,a,r,g,b;
+    __m128d s1,s2;
+
+    s1=_mm_set1_pd((unsigned short)shine);
+    s2=_mm_set1_pd(100.0-(unsigned short)shine);
+
+    for (n=0; n+4<=cnt; n+=4) {
+        p=_mm_loadu_si128((__m128i *)(pixel+n));
+        SSE2_UNPACK(p,a,r,g,b);
+
+        r=sse2_shine_chan(r,s1,s2);
+        g=sse2_shine_chan(g,s1,s2);
+        b=sse2_shine_chan(b,s1,s2);
+
+        _mm_storeu_si128((__m128i *)(pixel+n),sse2_pack(a,r,g,b));
+    }
+    shine_c(pixel+n,cnt-n,shine);
+}
+
+static SSE2_FN void light5_sse2(uint32_t *pixel,int cnt,const int32_t *wgt,int stride,int ml,int ll,int rl,int ul,int dl) {
+    int n,i;
+    const int32_t *lut[5];
+    __m128i p,a,r,g,b;
+    __m128 w,sr,sg,sb,div;
+
+    light5_lut(lut,ml,ll,rl,ul,dl);
+    if (!lut[0] || !lut[1] || !lut[2] || !lut[3] || !lut[4]) {
+        light5_c(pixel,cnt,wgt,stride,ml,ll,rl,ul,dl);
+        return;
+    }
+
+    for (n=0; n+4<=cnt; n+=4) {
+        p=_mm_loadu_si128((__m128i *)(pixel+n));
+        SSE2_UNPACK(p,a,r,g,b);
+
+        sr=sg=sb=_mm_setzero_ps();
+        for (i=0; i<5; i++) {
+            w=_mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(wgt+n+stride*i)));
+            sr=_mm_add_ps(sr,_mm_mul_ps(_mm_cvtepi32_ps(sse2_light_chan(r,lut[i])),w));
+            sg=_mm_add_ps(sg,_mm_mul_ps(_mm_cvtepi32_ps(sse2_light_chan(g,lut[i])),w));
+            sb=_mm_add_ps(sb,_mm_mul_ps(_mm_cvtepi32_ps(sse2_light_chan(b,lut[i])),w));
+        }
+        div=_mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(wgt+n+stride*5)));
+
+        r=_mm_cvttps_epi32(_mm_div_ps(sr,div));
+        g=_mm_cvttps_epi32(_mm_div_ps(sg,div));
+        b=_mm_cvttps_epi32(_mm_div_ps(sb,div));
+
+        _mm_storeu_si128((__m128i *)(pixel+n),sse2_pack(a,r,g,b));
+    }
+    for (; n<cnt; n++)
+        pixel[n]=sdl_light5(pixel[n],lut,ml,ll,rl,ul,dl,wgt[n],wgt[n+stride],wgt[n+stride*2],wgt[n+stride*3],wgt[n+stride*4],wgt[n+stride*5]);
+}
+
+static SSE2_FN void freeze_sse2(uint32_t *pixel,int cnt,int freeze) {
+    int n;
+    __m128i p,a,r,g,b,frg,fb,c255;
+
+    frg=_mm_set1_epi32(255*freeze/(3*DDFX_MAX_FREEZE-1));
+    fb=_mm_set1_epi32(255*3*freeze/(3*DDFX_MAX_FREEZE-1));
+    c255=_mm_set1_epi32(255);
+
+    for (n=0; n+4<=cnt; n+=4) {
+        p=_mm_loadu_si128((__m128i *)(pixel+n));
+        SSE2_UNPACK(p,a,r,g,b);
+
+        r=sse2_min(_mm_add_epi32(r,frg),c255);
+        g=sse2_min(_mm_add_epi32(g,frg),c255);
+        b=sse2_min(_mm_add_epi32(b,fb),c255);
+
+        _mm_storeu_si128((__m128i *)(pixel+n),sse2_pack(a,r,g,b));
+    }
+    freeze_c(pixel+n,cnt-n,freeze);
+}
+
+// ---------- AVX2 ----------
+
+#define AVX2_FN __attribute__((target("avx2")))
+
+static inline AVX2_FN __m256i avx2_div(__m256i a,__m256 d) {
+    return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a),d));
+}
+
+static inline AVX2_FN __m256i avx2_pack(__m256i a,__m256i r,__m256i g,__m256i b) {
+    return _mm256_or_si256(_mm256_or_si256(a,_mm256_slli_epi32(r,16)),_mm256_or_si256(_mm256_slli_epi32(g,8),b));
+}
+
+static inline AVX2_FN __m256i avx2_join(__m128i lo,__m128i hi) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo),hi,1);
+}
+
+#define AVX2_UNPACK(p,a,r,g,b) \
+    a=_mm256_and_si256(p,_mm256_set1_epi32(0xff000000)); \
+    r=_mm256_and_si256(_mm256_srli_epi32(p,16),_mm256_set1_epi32(0xff)); \
+    g=_mm256_and_si256(_mm256_srli_epi32(p,8),_mm256_set1_epi32(0xff)); \
+    b=_mm256_and_si256(p,_mm256_set1_epi32(0xff))
+
+static inline AVX2_FN __m256i avx2_light_chan(__m256i v,const int32_t *lut) {
+    return _mm256_i32gather_epi32((const int *)lut,v,4);
+}
+
+static inline AVX2_FN __m256d avx2_shine_pd(__m256d r,__m256d shine,__m256d shine2) {
+    __m256d t;
+
+    r=_mm256_div_pd(r,_mm256_set1_pd(127.5));
+    t=_mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(r,r),r),r);
+    r=_mm256_div_pd(_mm256_add_pd(_mm256_mul_pd(t,shine),_mm256_mul_pd(r,shine2)),_mm256_set1_pd(200.0));
+    r=_mm256_min_pd(r,_mm256_set1_pd(1.0));
+
+    return _mm256_mul_pd(r,_mm256_set1_pd(255.0));
+}
+
+static inline AVX2_FN __m256i avx2_shine_chan(__m256i v,__m256d shine,__m256d shine2) {
+    __m256d lo,hi;
+
+    lo=avx2_shine_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)),shine,shine2);
+    hi=avx2_shine_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v,1)),shine,shine2);
+
+    return avx2_join(_mm256_cvttpd_epi32(lo),_mm256_cvttpd_epi32(hi));
+}
+
+static AVX2_FN void colorbalance_avx2(uint32_t *pixel,int cnt,int cr,int cg,int cb,int light,int sat) {
+    int n;
+    struct cb_param cp;
+    __m256i p,a,r,g,b,ex,c255,zero;
+    __m256 f3,f20,fs1,fs2,grey;
+
+    cb_param_set(&cp,cr,cg,cb,light,sat);
+    c255=_mm256_set1_epi32(255);
+    zero=_mm256_setzero_si256();
+    f3=_mm256_set1_ps(3.0f);
+    f20=_mm256_set1_ps(20.0f);
+    fs1=_mm256_set1_ps(20-cp.sat);
+    fs2=_mm256_set1_ps(cp.sat);
+
+    for (n=0; n+8<=cnt; n+=8) {
+        p=_mm256_loadu_si256((__m256i *)(pixel+n));
+        AVX2_UNPACK(p,a,r,g,b);
+
+        if (cp.light) {
+            ex=_mm256_set1_epi32(cp.light);
+            r=_mm256_add_epi32(r,ex); g=_mm256_add_epi32(g,ex); b=_mm256_add_epi32(b,ex);
+        }
+        if (cp.sat) {
+            grey=_mm256_cvtepi32_ps(avx2_div(_mm256_add_epi32(_mm256_add_epi32(r,g),b),f3));
+            grey=_mm256_mul_ps(grey,fs2);
+            r=_mm256_cvttps_epi32(_mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(r),fs1),grey),f20));
+            g=_mm256_cvttps_epi32(_mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(g),fs1),grey),f20));
+            b=_mm256_cvttps_epi32(_mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(b),fs1),grey),f20));
+        }
+
+        r=_mm256_max_epi32(_mm256_add_epi32(r,_mm256_set1_epi32(cp.dr)),zero);
+        g=_mm256_max_epi32(_mm256_add_epi32(g,_mm256_set1_epi32(cp.dg)),zero);
+        b=_mm256_max_epi32(_mm256_add_epi32(b,_mm256_set1_epi32(cp.db)),zero);
+
+        ex=_mm256_srli_epi32(_mm256_max_epi32(_mm256_sub_epi32(r,c255),zero),1);
+        g=_mm256_add_epi32(g,ex); b=_mm256_add_epi32(b,ex); r=_mm256_min_epi32(r,c255);
+        ex=_mm256_srli_epi32(_mm256_max_epi32(_mm256_sub_epi32(g,c255),zero),1);
+        r=_mm256_add_epi32(r,ex); b=_mm256_add_epi32(b,ex); g=_mm256_min_epi32(g,c255);
+        ex=_mm256_srli_epi32(_mm256_max_epi32(_mm256_sub_epi32(b,c255),zero),1);
+        r=_mm256_add_epi32(r,ex); g=_mm256_add_epi32(g,ex); b=_mm256_min_epi32(b,c255);
+
+        r=_mm256_min_epi32(r,c255);
+        g=_mm256_min_epi32(g,c255);
+
+        _mm256_storeu_si256((__m256i *)(pixel+n),avx2_pack(a,r,g,b));
+    }
+    colorbalance_c(pixel+n,cnt-n,cr,cg,cb,light,sat);
+}
+
+static AVX2_FN void shine_avx2(uint32_t *pixel,int cnt,int shine) {
+    int n;
+    __m256i p,a,r,g,b;
+    __m256d s1,s2;
+
+    s1=_mm256_set1_pd((unsigned short)shine);
+    s2=_mm256_set1_pd(100.0-(unsigned short)shine);
+
+    for (n=0; n+8<=cnt; n+=8) {
+        p=_mm256_loadu_si256((__m256i *)(pixel+n));
+        AVX2_UNPACK(p,a,r,g,b);
+
+        r=avx2_shine_chan(r,s1,s2);
+        g=avx2_shine_chan(g,s1,s2);
+        b=avx2_shine_chan(b,s1,s2);
+
+        _mm256_storeu_si256((__m256i *)(pixel+n),avx2_pack(a,r,g,b));
+    }
+    shine_c(pixel+n,cnt-n,shine);
+}
+
+static AVX2_FN void light_avx2(uint32_t *pixel,int cnt,int light) {
+    int n;
+    const int32_t *lut;
+    __m256i p,a,r,g,b;
+
+    lut=light_lut_get(light);
+    if (!lut) { light_c(pixel,cnt,light); return; }
+
+    for (n=0; n+8<=cnt; n+=8) {
+        p=_mm256_loadu_si256((__m256i *)(pixel+n));
+        AVX2_UNPACK(p,a,r,g,b);
+
+        r=avx2_light_chan(r,lut);
+        g=avx2_light_chan(g,lut);
+        b=avx2_light_chan(b,lut);
+
+        _mm256_storeu_si256((__m256i *)(pixel+n),avx2_pack(a,r,g,b));
+    }
+    light_c(pixel+n,cnt-n,light);
+}
+
+static AVX2_FN void light5_avx2(uint32_t *pixel,int cnt,const int32_t *wgt,int stride,int ml,int ll,int rl,int ul,int dl) {
+    int n,i;
+    const int32_t *lut[5];
+    __m256i p,a,r,g,b;
+    __m256 w,sr,sg,sb,div;
+
+    light5_lut(lut,ml,ll,rl,ul,dl);
+    if (!lut[0] || !lut[1] || !lut[2] || !lut[3] || !lut[4]) {
+        light5_c(pixel,cnt,wgt,stride,ml,ll,rl,ul,dl);
+        return;
+    }
+
+    for (n=0; n+8<=cnt; n+=8) {
+        p=_mm256_loadu_si256((__m256i *)(pixel+n));
+        AVX2_UNPACK(p,a,r,g,b);
+
+        sr=sg=sb=_mm256_setzero_ps();
+        for (i=0; i<5; i++) {
+            w=_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(wgt+n+stride*i)));
+            sr=_mm256_add_ps(sr,_mm256_mul_ps(_mm256_cvtepi32_ps(avx2_light_chan(r,lut[i])),w));
+            sg=_mm256_add_ps(sg,_mm256_mul_ps(_mm256_cvtepi32_ps(avx2_light_chan(g,lut[i])),w));
+            sb=_mm256_add_ps(sb,_mm256_mul_ps(_mm256_cvtepi32_ps(avx2_light_chan(b,lut[i])),w));
+        }
+        div=_mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *)(wgt+n+stride*5)));
+
+        r=_mm256_cvttps_epi32(_mm256_div_ps(sr,div));
+        g=_mm256_cvttps_epi32(_mm256_div_ps(sg,div));
+        b=_mm256_cvttps_epi32(_mm256_div_ps(sb,div));
+
+        _mm256_storeu_si256((__m256i *)(pixel+n),avx2_pack(a,r,g,b));
+    }
+    for (; n<cnt; n++)
+        pixel[n]=sdl_light5(pixel[n],lut,ml,ll,rl,ul,dl,wgt[n],wgt[n+stride],wgt[n+stride*2],wgt[n+stride*3],wgt[n+stride*4],wgt[n+stride*5]);
+}
+
+static AVX2_FN void freeze_avx2(uint32_t *pixel,int cnt,int freeze) {
+    int n;
+    __m256i p,a,r,g,b,frg,fb,c255;
+
+    frg=_mm256_set1_epi32(255*freeze/(3*DDFX_MAX_FREEZE-1));
+    fb=_mm256_set1_epi32(255*3*freeze/(3*DDFX_MAX_FREEZE-1));
+    c255=_mm256_set1_epi32(255);
+
+    for (n=0; n+8<=cnt; n+=8) {
+        p=_mm256_loadu_si256((__m256i *)(pixel+n));
+        AVX2_UNPACK(p,a,r,g,b);
+
+        r=_mm256_min_epi32(_mm256_add_epi32(r,frg),c255);
+        g=_mm256_min_epi32(_mm256_add_epi32(g,frg),c255);
+        b=_mm256_min_epi32(_mm256_add_epi32(b,fb),c255);
+
+        _mm256_storeu_si256((__m256i *)(pixel+n),avx2_pack(a,r,g,b));
+    }
+    freeze_c(pixel+n,cnt-n,freeze);
+}
+
+#endif
+
+// Picks the best set of kernels for the CPU we are running on.
+// level: 0=scalar, 1=SSE2, 2=AVX2, -1=autodetect
+void sdl_shader_init(int level) {
+
+    light_lut_init();
+    light_mask_init();
+
+#ifdef SHADER_X86
+    if (level<0) {
+        if (SDL_HasAVX2()) level=2;
+        else if (SDL_HasSSE2()) level=1;
+        else level=0;
+    }
+#else
+    level=0;
+#endif
+
+    switch (level) {
+#ifdef SHADER_X86
+        case 2:
+            sdl_shader.name="AVX2";
+            sdl_shader.colorbalance=colorbalance_avx2;
+            sdl_shader.shine=shine_avx2;
+            sdl_shader.light=light_avx2;
+            sdl_shader.light5=light5_avx2;
+            sdl_shader.freeze=freeze_avx2;
+            break;
+        case 1:
+            sdl_shader.name="SSE2";
+            sdl_shader.colorbalance=colorbalance_sse2;
+            sdl_shader.shine=shine_sse2;
+            sdl_shader.light=light_c;  // a plain table lookup beats the SSE2 version
+            sdl_shader.light5=light5_sse2;
+            sdl_shader.freeze=freeze_sse2;
+            break;
+#endif
+        default:
+            sdl_shader.name="scalar";
+            sdl_shader.colorbalance=colorbalance_c;
+            sdl_shader.shine=shine_c;
+            sdl_shader.light=light_c;
+            sdl_shader.light5=light5_c;
+            sdl_shader.freeze=freeze_c;
+            break;
+    }
+}